@@ -0,0 +1,462 @@
+/**
+ * @file   bench.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Userspace benchmark of /dev/UARTencode and /dev/UARTdecode. Every message goes through
+ * the encoder, optionally has correctable damage done to it, goes through the decoder and is
+ * compared with what was sent. Message sizes, threads and batch sizes are swept in powers of two
+ * and the p50/p99 round trip latency and the throughput of every combination are printed. The
+ * modules have to be loaded without tty=, so both devices can be read and written. With -x the
+ * encoded and decoded bytes of every unframed message are also checked against libuartcodec.
+ * Build it with `make bench`.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "uartcodec.h"
+#include "libuartcodec.h"         // The reference codecs of -x
+
+#define ENC_DEVICE  "/dev/UARTencode"
+#define DEC_DEVICE  "/dev/UARTdecode"
+#define PARAM_DIR   "/sys/module"
+#define MAX_BLOCK   1024          ///< Largest codec block, CODEC_MAX_BLOCK of codec.h
+
+/** @brief Codec names as the modules know them, indexed by UART_CODEC_* */
+static const char *codecNames[] = { "repeat3", "hamming74", "secded84", "rs255", "repeat3i" };
+
+static int codecId = -1;          ///< Codec chosen with -c, -1 to keep the modules' default
+static unsigned int maxThreads = 1;   ///< -t, threads are swept from 1 to this
+static unsigned int maxBatch = 0;     ///< -b, batch sizes are swept from 1 to this, 0 for plain read/write
+static size_t maxSize = 0;        ///< -s, message sizes are swept from 1 to this, 0 for the encoder's fifo_size/3
+static unsigned int iterations = 200; ///< -n, round trips per thread and combination
+static int fuzz = 0;              ///< -f, damage the encoded bytes between encoder and decoder
+static int cross = 0;             ///< -x, compare the modules' bytes with libuartcodec's
+static int framed = 0;            ///< Whether the modules were loaded with framed=1
+static unsigned int repeatBlock = 128;  ///< repeat_block of uartcodec.ko
+static unsigned int rsDepth = 1;  ///< rs_depth of uartcodec.ko
+
+/** @brief The work and results of one thread */
+struct bench_thread {
+   pthread_t thread;
+   unsigned int batch;            ///< Records per batch, 0 for plain read/write
+   size_t size;                   ///< Plaintext bytes per message
+   uint64_t rnd;                  ///< State of the random number generator
+   int enc, dec;                  ///< The thread's own files of both devices
+   uint32_t codec;                ///< UART_CODEC_* the files use
+   uint64_t *lat;                 ///< Round trip time of every iteration in ns
+   unsigned long failures;        ///< Messages that did not come back as sent
+   unsigned long mismatches;      ///< Messages the modules and libuartcodec coded differently, with -x
+   int err;                       ///< errno of a failed call, 0 if none
+};
+
+/** @brief xorshift64, good enough for test data and error positions */
+static uint64_t rnd(struct bench_thread *t){
+   t->rnd ^= t->rnd << 13;
+   t->rnd ^= t->rnd >> 7;
+   t->rnd ^= t->rnd << 17;
+   return t->rnd;
+}
+
+/** @brief Returns a random byte other than zero, to XOR something into a byte */
+static uint8_t rndFlip(struct bench_thread *t){
+   return rnd(t) % 255 + 1;
+}
+
+static uint64_t nowNs(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief Reads a module parameter from sysfs
+ *  @return returns the first character of its value in buf, or -1 if it could not be read
+ */
+static int readParam(const char *module, const char *name, char *buf, size_t len){
+   char path[256];
+   FILE *f;
+   int ok;
+
+   snprintf(path, sizeof(path), PARAM_DIR "/%s/parameters/%s", module, name);
+   f = fopen(path, "r");
+   if (!f)
+      return -1;
+   ok = fgets(buf, len, f) != NULL;
+   fclose(f);
+   return ok ? buf[0] : -1;
+}
+
+/** @brief Damages an encoded stream in ways its codec is guaranteed to repair: at most one copy
+ *  of every byte for the repetition codes, at most one bit of every Hamming codeword and at most
+ *  16 bytes of every Reed-Solomon codeword. Each unit is hit with a probability of one half. The
+ *  stream has to start on a block boundary, which every write and every frame does.
+ */
+static void damage(struct bench_thread *t, uint8_t *buf, size_t len){
+   size_t i, j, block;
+   unsigned int e, errors;
+
+   switch (t->codec){
+   case UART_CODEC_REPEAT3:
+      for (i = 0; i+3 <= len; i += 3)
+         if (rnd(t) & 1)
+            buf[i + rnd(t)%3] ^= rndFlip(t);
+      break;
+   case UART_CODEC_REPEAT3I:
+      block = 3*repeatBlock;
+      for (i = 0; i+block <= len; i += block)
+         for (j = 0; j < repeatBlock; j++)
+            if (rnd(t) & 1)
+               buf[i + rnd(t)%3*repeatBlock + j] ^= rndFlip(t);
+      break;
+   case UART_CODEC_HAMMING74:
+   case UART_CODEC_SECDED84:
+      for (i = 0; i < len; i++)
+         if (rnd(t) & 1)
+            buf[i] ^= 1 << rnd(t)%(t->codec == UART_CODEC_HAMMING74 ? 7 : 8);
+      break;
+   case UART_CODEC_RS255:
+      block = 255*rsDepth;
+      for (i = 0; i+block <= len; i += block)
+         for (j = 0; j < rsDepth; j++){
+            errors = rnd(t) & 1 ? rnd(t)%17 : 0;
+            for (e = 0; e < errors; e++)
+               buf[i + rnd(t)%255*rsDepth + j] ^= rndFlip(t);
+         }
+      break;
+   }
+}
+
+/** @brief Reads everything waiting on a nonblocking file into a growing buffer
+ *  @return returns 0, or -1 with errno set
+ */
+static int drain(int fd, uint8_t **buf, size_t *len, size_t *cap){
+   ssize_t r;
+
+   for (;;){
+      if (*cap - *len < 65536){
+         *cap = 2*(*cap) + 65536;
+         *buf = realloc(*buf, *cap);
+         if (!*buf)
+            return -1;
+      }
+      r = read(fd, *buf + *len, *cap - *len);
+      if (r>0)
+         *len += r;
+      else if (r<0 && errno == EAGAIN)
+         return 0;
+      else
+         return -1;
+   }
+}
+
+/** @brief Pushes n bytes through one of the devices and collects everything that comes out,
+ *  draining it whenever a write finds the buffer full
+ *  @return returns 0, or -1 with errno set
+ */
+static int pump(int fd, const uint8_t *in, size_t n, uint8_t **out, size_t *outLen, size_t *cap){
+   struct pollfd p = { .fd = fd, .events = POLLIN | POLLOUT };
+   size_t done = 0;
+   ssize_t r;
+
+   *outLen = 0;
+   while (done<n){
+      r = write(fd, in + done, n - done);
+      if (r>0){
+         done += r;
+         continue;
+      }
+      if (r<0 && errno != EAGAIN)
+         return -1;
+      if (drain(fd, out, outLen, cap))
+         return -1;
+      poll(&p, 1, 10);
+   }
+   return drain(fd, out, outLen, cap);
+}
+
+/** @brief Codes a message with libuartcodec and counts a mismatch if the module did not write the
+ *  same bytes. Frames and Reed-Solomon are not in the library and are left out.
+ *  @param t The thread, whose codec is used
+ *  @param decode Whether in is encoded bytes to decode rather than plaintext to encode
+ *  @param in What was written to the device
+ *  @param inLen Its length
+ *  @param out What the device gave back
+ *  @param outLen Its length
+ *  @return returns 0, or -1 with errno set
+ */
+static int crossCheck(struct bench_thread *t, int decode, const uint8_t *in, size_t inLen, const uint8_t *out, size_t outLen){
+   uint8_t *ref;
+   ssize_t len;
+
+   if (!cross || framed || t->codec == UART_CODEC_RS255)
+      return 0;
+   ref = malloc(decode ? inLen : uc_encoded_len(t->codec, inLen));
+   if (!ref)
+      return -1;
+   len = decode ? uc_decode(t->codec, ref, in, inLen, NULL) : uc_encode(t->codec, ref, in, inLen);
+   if (len<0){
+      free(ref);
+      return -1;
+   }
+   if ((size_t)len != outLen || memcmp(ref, out, len))
+      t->mismatches++;
+   free(ref);
+   return 0;
+}
+
+/** @brief Sends a message round the loop with plain writes and reads */
+static int roundTrip(struct bench_thread *t, const uint8_t *msg, uint8_t **enc, size_t *encCap, uint8_t **dec, size_t *decCap){
+   size_t encLen, decLen;
+
+   if (pump(t->enc, msg, t->size, enc, &encLen, encCap) || crossCheck(t, 0, msg, t->size, *enc, encLen))
+      return -1;
+   if (fuzz)
+      damage(t, *enc, encLen);
+   if (pump(t->dec, *enc, encLen, dec, &decLen, decCap) || crossCheck(t, 1, *enc, encLen, *dec, decLen))
+      return -1;
+   // Unframed block codes pad the end of every write, only framing gives the exact length back
+   if (decLen<t->size || (framed && decLen != t->size) || memcmp(*dec, msg, t->size))
+      t->failures++;
+   return 0;
+}
+
+/** @brief Sends t->batch messages round the loop with one ENC_IOC_SUBMIT_BATCH and one
+ *  DEC_IOC_SUBMIT_BATCH call
+ */
+static int roundTripBatch(struct bench_thread *t, const uint8_t *msg, uint8_t *enc, size_t encCap, uint8_t *dec, size_t decCap, struct uart_batch_rec *recs){
+   struct uart_batch b = { .recs = (uintptr_t)recs, .count = t->batch };
+   unsigned int k;
+
+   for (k = 0; k < t->batch; k++){
+      recs[k].in = (uintptr_t)(msg + k*t->size);
+      recs[k].in_len = t->size;
+      recs[k].out = (uintptr_t)(enc + k*encCap);
+      recs[k].out_cap = encCap;
+   }
+   if (ioctl(t->enc, ENC_IOC_SUBMIT_BATCH, &b))
+      return -1;
+   for (k = 0; k < t->batch; k++){
+      if (recs[k].status){
+         errno = -recs[k].status;
+         return -1;
+      }
+      if (fuzz)
+         damage(t, enc + k*encCap, recs[k].out_len);
+      recs[k].in = recs[k].out;
+      recs[k].in_len = recs[k].out_len;
+      recs[k].out = (uintptr_t)(dec + k*decCap);
+      recs[k].out_cap = decCap;
+   }
+   if (ioctl(t->dec, DEC_IOC_SUBMIT_BATCH, &b))
+      return -1;
+   for (k = 0; k < t->batch; k++)
+      if (recs[k].status || recs[k].out_len<t->size || (framed && recs[k].out_len != t->size)
+          || memcmp(dec + k*decCap, msg + k*t->size, t->size))
+         t->failures++;
+   return 0;
+}
+
+/** @brief Runs the iterations of one thread */
+static void *benchThread(void *arg){
+   struct bench_thread *t = arg;
+   unsigned int records = t->batch ? t->batch : 1;
+   size_t encCap = 3*t->size + 4*MAX_BLOCK, decCap = t->size + MAX_BLOCK;
+   uint8_t *msg = malloc(records*t->size);
+   uint8_t *enc = malloc(records*encCap);
+   uint8_t *dec = malloc(records*decCap);
+   struct uart_batch_rec *recs = calloc(records, sizeof(*recs));
+   unsigned int i;
+   size_t k;
+   uint64_t t0;
+   int ret;
+
+   if (!msg || !enc || !dec || !recs)
+      t->err = ENOMEM;
+   for (i = 0; i < iterations && !t->err; i++){
+      for (k = 0; k < records*t->size; k++)
+         msg[k] = rnd(t);
+      t0 = nowNs();
+      if (t->batch)
+         ret = roundTripBatch(t, msg, enc, encCap, dec, decCap, recs);
+      else
+         ret = roundTrip(t, msg, &enc, &encCap, &dec, &decCap);
+      t->lat[i] = nowNs() - t0;
+      if (ret)
+         t->err = errno;
+   }
+   free(msg);
+   free(enc);
+   free(dec);
+   free(recs);
+   return NULL;
+}
+
+/** @brief Opens both devices for a thread and switches them to the chosen codec
+ *  @return returns 0, or -1 with errno set
+ */
+static int openDevices(struct bench_thread *t){
+   uint32_t id;
+
+   t->enc = open(ENC_DEVICE, O_RDWR | O_NONBLOCK);
+   if (t->enc<0)
+      return -1;
+   t->dec = open(DEC_DEVICE, O_RDWR | O_NONBLOCK);
+   if (t->dec<0){
+      close(t->enc);
+      return -1;
+   }
+   id = codecId;
+   if ((codecId >= 0 && (ioctl(t->enc, UART_IOC_SET_CODEC, &id) || ioctl(t->dec, UART_IOC_SET_CODEC, &id)))
+       || ioctl(t->enc, UART_IOC_GET_CODEC, &t->codec)){
+      close(t->enc);
+      close(t->dec);
+      return -1;
+   }
+   return 0;
+}
+
+static int cmpU64(const void *a, const void *b){
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+   return x<y ? -1 : x>y;
+}
+
+/** @brief Runs one combination of threads, batch size and message size and prints its row
+ *  @return returns the number of failed messages, or -1 if a call failed
+ */
+static long runOne(unsigned int threads, unsigned int batch, size_t size, uint64_t *lat){
+   struct bench_thread t[threads];
+   unsigned int records = batch ? batch : 1;
+   unsigned long failures = 0;
+   uint64_t start, wall;
+   unsigned int k;
+   size_t n = (size_t)threads*iterations;
+   int err = 0;
+
+   memset(t, 0, sizeof(t));
+   for (k = 0; k < threads; k++){
+      t[k].batch = batch;
+      t[k].size = size;
+      t[k].rnd = nowNs() ^ (0x9e3779b97f4a7c15ULL*(k+1));
+      t[k].lat = lat + (size_t)k*iterations;
+      if (openDevices(&t[k])){
+         perror("open " ENC_DEVICE " / " DEC_DEVICE);
+         while (k--){
+            close(t[k].enc);
+            close(t[k].dec);
+         }
+         return -1;
+      }
+   }
+   start = nowNs();
+   for (k = 0; k < threads; k++)
+      pthread_create(&t[k].thread, NULL, benchThread, &t[k]);
+   for (k = 0; k < threads; k++)
+      pthread_join(t[k].thread, NULL);
+   wall = nowNs() - start;
+   for (k = 0; k < threads; k++){
+      close(t[k].enc);
+      close(t[k].dec);
+      failures += t[k].failures + t[k].mismatches;
+      if (t[k].err)
+         err = t[k].err;
+   }
+   if (err){
+      fprintf(stderr, "size %zu batch %u: %s\n", size, batch, strerror(err));
+      return -1;
+   }
+   qsort(lat, n, sizeof(*lat), cmpU64);
+   printf("%-9s %7u %5u %8zu %10.1f %10.1f %10.2f %8lu\n", codecNames[t[0].codec], threads, batch, size,
+          lat[n/2]/1000.0, lat[n*99/100]/1000.0, (double)n*records*size*1000.0/wall, failures);
+   return failures;
+}
+
+static void usage(const char *prog){
+   fprintf(stderr, "Usage: %s [-c codec] [-t threads] [-b batch] [-s size] [-n iterations] [-f] [-x]\n"
+           "  -c  repeat3, repeat3i, hamming74, secded84 or rs255 (default what the modules use)\n"
+           "  -t  sweep 1 to this many threads (default 1)\n"
+           "  -b  sweep batches of 1 to this many records through the batch ioctls (default plain read/write)\n"
+           "  -s  sweep messages of 1 to this many bytes (default the encoder's fifo_size/3)\n"
+           "  -n  round trips per thread and combination (default 200)\n"
+           "  -f  damage the encoded bytes within what the codec can correct and check they come back\n"
+           "  -x  check the bytes of plain reads and writes against libuartcodec, counted as failures\n", prog);
+   exit(2);
+}
+
+/** @brief Returns the powers of two from 1 up to max, and max itself, one after another */
+static size_t nextStep(size_t cur, size_t max){
+   return cur<max && 2*cur>max ? max : 2*cur;
+}
+
+int main(int argc, char **argv){
+   char buf[64];
+   unsigned int threads, batch;
+   size_t size;
+   uint64_t *lat;
+   long ret;
+   int opt, failed = 0;
+
+   while ((opt = getopt(argc, argv, "c:t:b:s:n:fx")) != -1){
+      switch (opt){
+      case 'c':
+         for (codecId = 0; codecId < (int)(sizeof(codecNames)/sizeof(codecNames[0])); codecId++)
+            if (!strcmp(optarg, codecNames[codecId]))
+               break;
+         if (codecId == sizeof(codecNames)/sizeof(codecNames[0]))
+            usage(argv[0]);
+         break;
+      case 't': maxThreads = strtoul(optarg, NULL, 0); break;
+      case 'b': maxBatch = strtoul(optarg, NULL, 0); break;
+      case 's': maxSize = strtoul(optarg, NULL, 0); break;
+      case 'n': iterations = strtoul(optarg, NULL, 0); break;
+      case 'f': fuzz = 1; break;
+      case 'x': cross = 1; break;
+      default: usage(argv[0]);
+      }
+   }
+   if (!maxThreads || !iterations || maxBatch>UART_BATCH_MAX)
+      usage(argv[0]);
+   if (readParam("encode", "framed", buf, sizeof(buf)) == 'Y')
+      framed = 1;
+   if (!maxSize)
+      maxSize = readParam("encode", "fifo_size", buf, sizeof(buf)) > 0 ? strtoul(buf, NULL, 0)/3 : 16384;
+   if (framed && maxBatch && maxSize>UART_FRAME_MAXLEN)
+      maxSize = UART_FRAME_MAXLEN;            // a batch record is one frame
+   if (readParam("uartcodec", "repeat_block", buf, sizeof(buf)) > 0)
+      repeatBlock = strtoul(buf, NULL, 0);
+   if (readParam("uartcodec", "rs_depth", buf, sizeof(buf)) > 0)
+      rsDepth = strtoul(buf, NULL, 0);
+   if (cross && uc_set_repeat_block(repeatBlock)){
+      perror("uc_set_repeat_block");
+      return 1;
+   }
+
+   lat = malloc((size_t)maxThreads*iterations*sizeof(*lat));
+   if (!lat)
+      return 1;
+   printf("%-9s %7s %5s %8s %10s %10s %10s %8s\n", "codec", "threads", "batch", "size", "p50 us", "p99 us", "MB/s", "failures");
+   for (threads = 1; threads <= maxThreads; threads = nextStep(threads, maxThreads))
+      for (batch = maxBatch ? 1 : 0; batch <= maxBatch; batch = batch ? nextStep(batch, maxBatch) : 1)
+         for (size = 1; size <= maxSize; size = nextStep(size, maxSize)){
+            ret = runOne(threads, batch, size, lat);
+            if (ret<0){
+               free(lat);
+               return 1;
+            }
+            failed |= ret>0;
+         }
+   free(lat);
+   if (failed)
+      fprintf(stderr, "Some messages did not come back as sent\n");
+   return failed;
+}
@@ -0,0 +1,273 @@
+/**
+ * @file   codec.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   A module holding the coding kernels used by the encode and decode modules, so that
+ * both share one tuned copy, and the list of codecs they can choose from. It has to be loaded
+ * before either of them.
+ */
+
+#include <linux/init.h>           // Macros used to mark up functions e.g. __init __exit
+#include <linux/module.h>         // Core header for loading LKMs into the kernel
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/string.h>         // sysfs_streq(), memcpy()
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>             // kernel_neon_begin() and kernel_neon_end()
+#include <asm/simd.h>             // may_use_simd()
+#endif
+#include "uartcodec.h"            // UART_CODEC_* codes
+#include "codec.h"
+#define CREATE_TRACE_POINTS
+#include "codec_trace.h"          // The tracepoints are created here and used by the other modules
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(encode_write);
+EXPORT_TRACEPOINT_SYMBOL_GPL(decode_write);
+
+MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
+MODULE_AUTHOR("Matthew Callahan");    ///< The author -- visible when you use modinfo
+MODULE_DESCRIPTION("Coding kernels shared by the UART encode and decode modules");  ///< The description -- see modinfo
+MODULE_VERSION("0.1");            ///< A version number to inform users
+
+#define NEON_MIN_BYTES 64         ///< Below this many plaintext bytes saving the NEON state costs more than it gains
+
+static bool simd = true;          ///< Lets the NEON kernels be switched off to compare against the C ones
+module_param(simd, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(simd, "Use the NEON kernels when the CPU supports them (default 1)");
+
+static unsigned int repeat_block = 128; ///< Bytes sent together by the interleaved repetition code
+module_param(repeat_block, uint, S_IRUGO);
+MODULE_PARM_DESC(repeat_block, "Block size in bytes of the repeat3i codec, 1 to 341 (default 128)");
+
+static bool haveNeon;             ///< Set at load time if the CPU can run the NEON kernels
+
+/** @brief Returns whether a call coding n bytes of plaintext, encoded or decoded, should go through the NEON kernel */
+static bool useNeon(size_t n){
+#ifdef CONFIG_KERNEL_MODE_NEON
+   return simd && haveNeon && n >= NEON_MIN_BYTES && may_use_simd();
+#else
+   return false;
+#endif
+}
+
+/** @brief Tripples n bytes into 3*n bytes. NEON takes 16 bytes per step and the rest goes
+ *  through codec_repeat3_encode_c(), which libuartcodec shares.
+ *  @param dst Where the 3*n encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode
+ */
+void codec_repeat3_encode(u8 *dst, const u8 *src, size_t n){
+   size_t blocks;
+
+   if (useNeon(n)){
+      blocks = n & ~(size_t)15;
+      kernel_neon_begin();
+      codec_repeat3_encode_neon(dst, src, blocks);
+      kernel_neon_end();
+      dst += 3*blocks;
+      src += blocks;
+      n -= blocks;
+   }
+   codec_repeat3_encode_c(dst, src, n);
+}
+EXPORT_SYMBOL_GPL(codec_repeat3_encode);
+
+/** @brief Majority decodes n bytes from 3*n trippled bytes. NEON takes 16 bytes per step and
+ *  the rest goes through codec_repeat3_decode_c(), which libuartcodec shares.
+ *  @param dst Where the n decoded bytes go
+ *  @param src The 3*n encoded bytes
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL if nobody wants them
+ */
+void codec_repeat3_decode(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   size_t blocks;
+
+   if (useNeon(n)){
+      blocks = n & ~(size_t)15;
+      kernel_neon_begin();
+      codec_repeat3_decode_neon(dst, src, blocks, st);
+      kernel_neon_end();
+      dst += blocks;
+      src += 3*blocks;
+      n -= blocks;
+   }
+   codec_repeat3_decode_c(dst, src, n, st);
+}
+EXPORT_SYMBOL_GPL(codec_repeat3_decode);
+
+/** @brief Majority votes n bytes from three separate copies. NEON takes 16 bytes per step and
+ *  codec_majority3_c() a word.
+ *  @param dst Where the n decoded bytes go
+ *  @param a The first copy
+ *  @param b The second copy
+ *  @param c The third copy
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+static void majority3(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   size_t blocks;
+
+   if (useNeon(n)){
+      blocks = n & ~(size_t)15;
+      kernel_neon_begin();
+      codec_majority3_neon(dst, a, b, c, blocks, st);
+      kernel_neon_end();
+      dst += blocks;
+      a += blocks;
+      b += blocks;
+      c += blocks;
+      n -= blocks;
+   }
+   codec_majority3_c(dst, a, b, c, n, st);
+}
+
+/** @brief Encodes n bytes with the interleaved repetition code: every block of repeat_block bytes
+ *  is sent three times over, so the copies of a byte are a block apart on the line and a burst
+ *  shorter than a block only ever hits one of them.
+ *  @param dst Where the codec_encoded_len() encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode, the last block is padded with zeros
+ */
+static void encodeRepeat3i(u8 *dst, const u8 *src, size_t n){
+   size_t take;
+
+   while (n){
+      take = min(n, (size_t)repeat_block);
+      memcpy(dst, src, take);
+      memset(dst + take, 0, repeat_block - take);
+      memcpy(dst + repeat_block, dst, repeat_block);
+      memcpy(dst + 2*repeat_block, dst, repeat_block);
+      dst += 3*repeat_block;
+      src += take;
+      n -= take;
+   }
+}
+
+/** @brief Decodes whole blocks of the interleaved repetition code */
+static void decodeRepeat3i(u8 *dst, const u8 *src, size_t blocks, struct codec_stats *st){
+   for (; blocks; blocks--){
+      majority3(dst, src, src + repeat_block, src + 2*repeat_block, repeat_block, st);
+      src += 3*repeat_block;
+      dst += repeat_block;
+   }
+}
+
+/** @brief Decodes whole blocks of the interleaved repetition code with a mask of the bits not
+ *  voted for unanimously
+ */
+static void softRepeat3i(u8 *dst, u8 *mask, const u8 *src, size_t blocks, struct codec_stats *st){
+   for (; blocks; blocks--){
+      codec_majority3_soft(dst, mask, src, src + repeat_block, src + 2*repeat_block, repeat_block, st);
+      src += 3*repeat_block;
+      dst += repeat_block;
+      mask += repeat_block;
+   }
+}
+
+/** @brief The interleaved repetition code, block sizes set from repeat_block at load time */
+static struct uart_codec codecRepeat3i = {
+   .name = "repeat3i",
+   .id = UART_CODEC_REPEAT3I,
+   .encode = encodeRepeat3i,
+   .decode = decodeRepeat3i,
+   .soft = softRepeat3i,
+};
+
+/** @brief The three times repetition code in codec form */
+static const struct uart_codec codecRepeat3 = {
+   .name = "repeat3",
+   .id = UART_CODEC_REPEAT3,
+   .inBlock = 1,
+   .outBlock = 3,
+   .encode = codec_repeat3_encode,
+   .decode = codec_repeat3_decode,
+   .soft = codec_repeat3_soft,
+};
+
+/** @brief Every codec the devices can choose from */
+static const struct uart_codec *const codecs[] = {
+   &codecRepeat3,
+   &codecRepeat3i,
+   &codec_hamming74,
+   &codec_secded84,
+#if IS_ENABLED(CONFIG_REED_SOLOMON_ENC8) && IS_ENABLED(CONFIG_REED_SOLOMON_DEC8)
+   &codec_rs255,
+#endif
+};
+
+/** @brief Looks up a codec by the name given in a module parameter
+ *  @param name The codec's name, a trailing newline is ignored
+ *  @return returns the codec or NULL if there is none of that name
+ */
+const struct uart_codec *codec_find(const char *name){
+   size_t k;
+
+   for (k = 0; k < ARRAY_SIZE(codecs); k++)
+      if (sysfs_streq(name, codecs[k]->name))
+         return codecs[k];
+   return NULL;
+}
+EXPORT_SYMBOL_GPL(codec_find);
+
+/** @brief Looks up a codec by its UART_CODEC_* code
+ *  @param id The code passed to UART_IOC_SET_CODEC
+ *  @return returns the codec or NULL if the code is unknown
+ */
+const struct uart_codec *codec_get(u32 id){
+   size_t k;
+
+   for (k = 0; k < ARRAY_SIZE(codecs); k++)
+      if (codecs[k]->id == id)
+         return codecs[k];
+   return NULL;
+}
+EXPORT_SYMBOL_GPL(codec_get);
+
+/** @brief Encodes n bytes of any length, an incomplete last block padded with zeros
+ *  @param c The codec
+ *  @param dst Where the codec_encoded_len(c, n) encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode
+ *  @return returns the number of encoded bytes
+ */
+size_t codec_encode(const struct uart_codec *c, u8 *dst, const u8 *src, size_t n){
+   c->encode(dst, src, n);
+   return codec_encoded_len(c, n);
+}
+EXPORT_SYMBOL_GPL(codec_encode);
+
+/** @brief The LKM initialization function, it checks which kernels the CPU can run and
+ *  sets up the Reed-Solomon codec and the debugfs directory of the latency histograms
+ *  @return returns 0 if successful
+ */
+static int __init codecInit(void){
+   int err;
+
+#if defined(CONFIG_KERNEL_MODE_NEON) && defined(CONFIG_ARM)
+   haveNeon = cpu_has_neon();
+#elif defined(CONFIG_KERNEL_MODE_NEON)
+   haveNeon = true;
+#endif
+   if (repeat_block<1 || repeat_block>CODEC_MAX_BLOCK/3){
+      printk(KERN_ALERT "Codec: repeat_block must be 1 to %d\n", CODEC_MAX_BLOCK/3);
+      return -EINVAL;
+   }
+   codecRepeat3i.inBlock = repeat_block;
+   codecRepeat3i.outBlock = 3*repeat_block;
+   err = codec_rs_init();
+   if (err)
+      return err;
+   codec_latency_init();
+   printk(KERN_INFO "Codec: loaded, using %s kernels\n", haveNeon ? "NEON" : "generic");
+   return 0;
+}
+
+/** @brief The LKM cleanup function */
+static void __exit codecExit(void){
+   codec_latency_exit();
+   codec_rs_exit();
+   printk(KERN_INFO "Codec: Goodbye from the LKM!\n");
+}
+
+module_init(codecInit);
+module_exit(codecExit);
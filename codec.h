@@ -0,0 +1,148 @@
+/**
+ * @file   codec.h
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Kernel interface of the uartcodec module, which holds the coding kernels shared by
+ * the encode and decode modules. Each entry point picks a NEON implementation when the CPU has
+ * one and falls back to generic C otherwise. The codecs the devices can choose from are found by
+ * name or number through codec_find() and codec_get(). It also holds the in-kernel serial transport
+ * and the latency histograms of the link.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <linux/types.h>
+#include <linux/kfifo.h>          // codec_kfifo_to_iter()
+#include <linux/uio.h>            // struct iov_iter
+#include <linux/crc32.h>          // codec_frame_crc()
+#include <linux/percpu.h>         // codec_hist_add()
+#include <linux/log2.h>           // Its buckets
+#include "uartcodec.h"            // struct uart_frame_hdr
+#include "codec_kernels.h"        // struct codec_stats and the kernels shared with libuartcodec
+
+#define CODEC_MAX_BLOCK 1024      ///< No codec codes more bytes than this together
+
+struct file;
+struct tty_struct;
+struct tty_port;
+struct tty_port_client_operations;
+
+/** @brief A serial port driven from inside the kernel, see transport.c */
+struct codec_tty {
+   struct file *file;                ///< The open tty
+   struct tty_struct *tty;           ///< The tty behind file, referenced while the transport is open
+   loff_t txPos;                     ///< File position, ignored by ttys but required by the VFS
+   struct tty_port *port;            ///< The port whose received bytes go to receive, NULL if receiving is not started
+   const struct tty_port_client_operations *oldOps; ///< The port's own client operations, put back on close
+   void *oldData;                    ///< The port's own client data
+   size_t (*receive)(void *priv, const u8 *data, size_t n); ///< Called with every block received, returns the bytes taken
+   void *priv;                       ///< Passed back to receive
+};
+
+/** @brief A step of the rate ladder an adaptive link (adapt=1) moves along, see codec_ladder */
+struct codec_rate {
+   u32 codec;                        ///< The UART_CODEC_* code
+   unsigned int baud;                ///< The baud rate of both ports
+};
+
+#define CODEC_LADDER_LEN 8        ///< Steps of codec_ladder
+
+/** @brief An error correcting code. It turns every inBlock plaintext bytes into outBlock encoded
+ *  bytes on its own, so a stream can be coded in pieces of any number of whole blocks. Encoding
+ *  may end in an incomplete block, which the codec pads with zeros.
+ */
+struct uart_codec {
+   const char *name;                 ///< Name taken by the codec module parameters
+   u32 id;                           ///< The UART_CODEC_* code from uartcodec.h
+   unsigned int inBlock;             ///< Plaintext bytes coded together
+   unsigned int outBlock;            ///< Encoded bytes they become, at most CODEC_MAX_BLOCK
+   void (*encode)(u8 *dst, const u8 *src, size_t n);       ///< Encodes n bytes into codec_encoded_len() bytes
+   void (*decode)(u8 *dst, const u8 *src, size_t blocks, struct codec_stats *st); ///< Decodes whole blocks, st may be NULL
+   void (*soft)(u8 *dst, u8 *mask, const u8 *src, size_t blocks, struct codec_stats *st); ///< Decodes like decode and sets in mask the bits of every byte it is unsure of, NULL if the codec cannot tell
+};
+
+/** @brief Returns how many encoded bytes n plaintext bytes become, the last block padded */
+static inline size_t codec_encoded_len(const struct uart_codec *c, size_t n){
+   return (n + c->inBlock - 1) / c->inBlock * c->outBlock;
+}
+
+const struct uart_codec *codec_find(const char *name);
+const struct uart_codec *codec_get(u32 id);
+size_t codec_encode(const struct uart_codec *c, u8 *dst, const u8 *src, size_t n);
+
+void codec_repeat3_encode(u8 *dst, const u8 *src, size_t n);
+void codec_repeat3_decode(u8 *dst, const u8 *src, size_t n, struct codec_stats *st);
+
+/** @brief Moves as many bytes from a byte kfifo into an iterator as it has room for, straight out
+ *  of the ring's one or two linear spans. The caller holds the lock of the kfifo's reader.
+ *  @return returns the number of bytes moved, fewer than possible only on a fault
+ */
+static inline size_t codec_kfifo_to_iter(struct kfifo *fifo, struct iov_iter *to){
+   struct __kfifo *f = &fifo->kfifo;
+   unsigned int len = min_t(size_t, f->in - f->out, iov_iter_count(to));
+   unsigned int off = f->out & f->mask;
+   unsigned int first = min(len, f->mask + 1 - off);
+   size_t n = copy_to_iter((u8 *)f->data + off, first, to);
+
+   if (n == first && len > first)
+      n += copy_to_iter(f->data, len - first, to);
+   smp_store_release(&f->out, f->out + n);  // the bytes are copied before the writer may reuse them
+   return n;
+}
+
+/** @brief Returns the check of a UART_FRAME_CRC frame, crc32_le() using the CPU's CRC instructions
+ *  where the architecture has them
+ *  @param hdr The frame's header
+ *  @param payload Its payload
+ *  @param len The number of payload bytes
+ */
+static inline u32 codec_frame_crc(const struct uart_frame_hdr *hdr, const u8 *payload, size_t len){
+   return ~crc32_le(crc32_le(~0, (const u8 *)hdr, UART_FRAME_HDR_SIZE), payload, len);
+}
+
+#define CODEC_HIST_BUCKETS 32     ///< Buckets of a latency histogram, bucket i>0 counts 2^i to 2^(i+1)-1 ns
+
+/** @brief One CPU's counts of a latency histogram */
+struct codec_hist_cpu {
+   unsigned long n[CODEC_HIST_BUCKETS]; ///< Samples per bucket, the last one also counts everything longer
+};
+
+/** @brief A latency histogram shown in debugfs, see latency.c */
+struct codec_hist {
+   struct codec_hist_cpu __percpu *cpu; ///< The counts, per CPU so recording takes no lock
+   struct dentry *file;              ///< Its file in /sys/kernel/debug/uartcodec/
+};
+
+/** @brief Counts one sample of ns nanoseconds on this CPU. A histogram that was never set up,
+ *  because the feature measuring it is off, is left alone.
+ */
+static inline void codec_hist_add(struct codec_hist *h, u64 ns){
+   unsigned int b = ns ? min_t(unsigned int, ilog2(ns), CODEC_HIST_BUCKETS-1) : 0;
+
+   if (h->cpu)
+      this_cpu_inc(h->cpu->n[b]);
+}
+
+int  codec_hist_create(struct codec_hist *h, const char *name);
+void codec_hist_destroy(struct codec_hist *h);
+
+int  codec_tty_open(struct codec_tty *t, const char *path);
+int  codec_tty_write(struct codec_tty *t, const u8 *buf, size_t n);
+int  codec_tty_start_rx(struct codec_tty *t, size_t (*receive)(void *, const u8 *, size_t), void *priv);
+void codec_tty_rx_resume(struct codec_tty *t);
+void codec_tty_stop_rx(struct codec_tty *t);
+int  codec_tty_set_baud(struct codec_tty *t, unsigned int baud);
+void codec_tty_close(struct codec_tty *t);
+extern const struct codec_rate codec_ladder[CODEC_LADDER_LEN];
+
+// Codecs from the other files of the module
+extern const struct uart_codec codec_hamming74, codec_secded84;
+extern struct uart_codec codec_rs255;
+int  codec_rs_init(void);
+void codec_rs_exit(void);
+void codec_latency_init(void);
+void codec_latency_exit(void);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * @file   codec_hamming.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Hamming(7,4) and extended Hamming(8,4) SECDED codecs. Every byte is sent as two
+ * codewords, low nibble first, each in a byte of its own, so both cost 2x instead of the 3x of
+ * the repetition code. Encoding and decoding are table lookups, one per byte and one per
+ * codeword through the kernels of codec_kernels.h; gentables.c works the tables out from the
+ * parity equations at build time.
+ */
+
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include "uartcodec.h"            // UART_CODEC_* codes
+#include "codec.h"
+#include "codec_tables.h"         // Generated by gentables.c
+
+static void encodeHamming74(u8 *dst, const u8 *src, size_t n){
+   codec_hamming_encode(encode74, dst, src, n);
+}
+
+static void decodeHamming74(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   codec_hamming_decode(decode74Lo, decode74Hi, dst, src, n, st);
+}
+
+static void softHamming74(u8 *dst, u8 *mask, const u8 *src, size_t n, struct codec_stats *st){
+   codec_hamming_soft(decode74Lo, decode74Hi, dst, mask, src, n, st);
+}
+
+static void encodeSecded84(u8 *dst, const u8 *src, size_t n){
+   codec_hamming_encode(encode84, dst, src, n);
+}
+
+static void decodeSecded84(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   codec_hamming_decode(decode84Lo, decode84Hi, dst, src, n, st);
+}
+
+static void softSecded84(u8 *dst, u8 *mask, const u8 *src, size_t n, struct codec_stats *st){
+   codec_hamming_soft(decode84Lo, decode84Hi, dst, mask, src, n, st);
+}
+
+const struct uart_codec codec_hamming74 = {
+   .name = "hamming74",
+   .id = UART_CODEC_HAMMING74,
+   .inBlock = 1,
+   .outBlock = 2,
+   .encode = encodeHamming74,
+   .decode = decodeHamming74,
+   .soft = softHamming74,
+};
+
+const struct uart_codec codec_secded84 = {
+   .name = "secded84",
+   .id = UART_CODEC_SECDED84,
+   .inBlock = 1,
+   .outBlock = 2,
+   .encode = encodeSecded84,
+   .decode = decodeSecded84,
+   .soft = softSecded84,
+};
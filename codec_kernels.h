@@ -0,0 +1,288 @@
+/**
+ * @file   codec_kernels.h
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   The portable C coding kernels, shared by the uartcodec module and the userspace
+ * libuartcodec so both produce the same bytes and the same counts. Everything here is static
+ * inline and only needs the fixed width types, which come from the kernel headers in the kernel
+ * and from <stdint.h> elsewhere. The SIMD kernels of either side handle whole 16 byte steps and
+ * leave the rest to these.
+ */
+
+#ifndef CODEC_KERNELS_H
+#define CODEC_KERNELS_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/bitops.h>         // hweight8() and hweight32()
+#include <asm/unaligned.h>        // get_unaligned_le32() and put_unaligned_le32()
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#define hweight8(x)  __builtin_popcount((u8)(x))
+#define hweight32(x) __builtin_popcount((u32)(x))
+
+static inline u32 get_unaligned_le32(const void *p){
+   const u8 *b = p;
+
+   return b[0] | b[1] << 8 | b[2] << 16 | (u32)b[3] << 24;
+}
+
+static inline void put_unaligned_le32(u32 v, void *p){
+   u8 *b = p;
+
+   b[0] = v;
+   b[1] = v >> 8;
+   b[2] = v >> 16;
+   b[3] = v >> 24;
+}
+
+static inline void put_unaligned_le16(u16 v, void *p){
+   u8 *b = p;
+
+   b[0] = v;
+   b[1] = v >> 8;
+}
+#endif
+
+#define CODEC_HAM_FIXED_SHIFT 8   ///< Codewords put right, 0 to 2, in the sum of a byte's two Hamming decode entries
+#define CODEC_HAM_BAD_SHIFT   10  ///< Codewords beyond repair, 0 to 2, in that sum
+
+/** @brief What a decoder found while decoding, added to by every call that is given one */
+struct codec_stats {
+   u64 corrected;                    ///< Bits put right, e.g. where one copy disagreed and was outvoted
+   u64 disagree;                     ///< Blocks seen damaged beyond repair, e.g. triplets whose three copies all differ
+};
+
+/** @brief The three input majority vote on whole words, one result bit per input bit */
+static inline u32 codec_maj32(u32 a, u32 b, u32 c){
+   return (a & b) | (c & (a | b));
+}
+
+/** @brief Returns whether the three copies of a byte are all different */
+static inline bool codec_disagree3(u8 a, u8 b, u8 c){
+   return a != b && b != c && a != c;
+}
+
+/** @brief Tripples n bytes into 3*n bytes, building the 12 output bytes of every 4 input bytes
+ *  as three words using multiplies to repeat a byte
+ *  @param dst Where the 3*n encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode
+ */
+static inline void codec_repeat3_encode_c(u8 *dst, const u8 *src, size_t n){
+   u32 x;
+
+   for (; n >= 4; n -= 4){
+      x = get_unaligned_le32(src);         // b0 b1 b2 b3
+      put_unaligned_le32((x & 0xff)*0x010101 | (x & 0xff00) << 16, dst);                     // b0 b0 b0 b1
+      put_unaligned_le32((x >> 8 & 0xff)*0x0101 | (x >> 16 & 0xff)*0x01010000, dst + 4);  // b1 b1 b2 b2
+      put_unaligned_le32((x >> 16 & 0xff) | (x >> 24)*0x01010100, dst + 8);                // b2 b3 b3 b3
+      src += 4;
+      dst += 12;
+   }
+   for (; n; n--){
+      dst[2] = dst[1] = dst[0] = *src++;
+      dst += 3;
+   }
+}
+
+/** @brief Majority decodes n bytes from 3*n trippled bytes, voting on 12 input bytes at once as
+ *  three words, where the stream shifted by one and two bytes lines up the copies of every fourth
+ *  byte. In every bit position at most one copy can disagree with the vote, so the corrected bits
+ *  are the positions where the copies are not all equal.
+ *  @param dst Where the n decoded bytes go
+ *  @param src The 3*n encoded bytes
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL if nobody wants them
+ */
+static inline void codec_repeat3_decode_c(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   u32 w0, w1, w2, s0, s1, t0, t1, m0, m1, m2;
+   unsigned int k;
+
+   for (; n >= 4; n -= 4){
+      w0 = get_unaligned_le32(src);        // a0 b0 c0 a1
+      w1 = get_unaligned_le32(src + 4);    // b1 c1 a2 b2
+      w2 = get_unaligned_le32(src + 8);    // c2 a3 b3 c3
+      s0 = (w0 >> 8) | (w1 << 24);
+      t0 = (w0 >> 16) | (w1 << 16);
+      s1 = (w1 >> 8) | (w2 << 24);
+      t1 = (w1 >> 16) | (w2 << 16);
+      m0 = codec_maj32(w0, s0, t0);
+      m1 = codec_maj32(w1, s1, t1);
+      m2 = codec_maj32(w2, w2 >> 8, w2 >> 16);
+      put_unaligned_le32((m0 & 0xff) | (m0 >> 24 << 8) | ((m1 >> 16 & 0xff) << 16) | ((m2 >> 8 & 0xff) << 24), dst);
+      if (st){
+         st->corrected += hweight32(((w0 ^ s0) | (s0 ^ t0)) & 0xff0000ff) +
+                          hweight32(((w1 ^ s1) | (s1 ^ t1)) & 0x00ff0000) +
+                          hweight32(((w2 ^ (w2 >> 8)) | ((w2 >> 8) ^ (w2 >> 16))) & 0x0000ff00);
+         for (k = 0; k < 12; k += 3)
+            st->disagree += codec_disagree3(src[k], src[k+1], src[k+2]);
+      }
+      src += 12;
+      dst += 4;
+   }
+   for (; n; n--){
+      *dst++ = codec_maj32(src[0], src[1], src[2]);
+      if (st){
+         st->corrected += hweight8((src[0] ^ src[1]) | (src[1] ^ src[2]));
+         st->disagree += codec_disagree3(src[0], src[1], src[2]);
+      }
+      src += 3;
+   }
+}
+
+/** @brief Majority votes n bytes from three separate copies a word at a time, the bytes of the
+ *  copies being lined up already
+ *  @param dst Where the n decoded bytes go
+ *  @param a The first copy
+ *  @param b The second copy
+ *  @param c The third copy
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+static inline void codec_majority3_c(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   u32 x, y, z;
+   unsigned int k;
+
+   for (; n >= 4; n -= 4){
+      x = get_unaligned_le32(a);
+      y = get_unaligned_le32(b);
+      z = get_unaligned_le32(c);
+      put_unaligned_le32(codec_maj32(x, y, z), dst);
+      if (st){
+         st->corrected += hweight32((x ^ y) | (y ^ z));
+         for (k = 0; k < 4; k++)
+            st->disagree += codec_disagree3(a[k], b[k], c[k]);
+      }
+      a += 4;
+      b += 4;
+      c += 4;
+      dst += 4;
+   }
+   for (; n; n--){
+      *dst = codec_maj32(*a, *b, *c);
+      if (st){
+         st->corrected += hweight8((*a ^ *b) | (*b ^ *c));
+         st->disagree += codec_disagree3(*a, *b, *c);
+      }
+      a++;
+      b++;
+      c++;
+      dst++;
+   }
+}
+
+/** @brief Encodes n bytes into 2*n Hamming or SECDED codewords with one of the encode tables of
+ *  codec_tables.h, one lookup and one 16-bit store per byte
+ */
+static inline void codec_hamming_encode(const u16 *table, u8 *dst, const u8 *src, size_t n){
+   for (; n; n--){
+      put_unaligned_le16(table[*src++], dst);
+      dst += 2;
+   }
+}
+
+/** @brief Decodes 2*n codewords into n bytes with a pair of decode tables of codec_tables.h. The
+ *  entries of a byte's two codewords add up to the byte, with the counts of fixed and bad
+ *  codewords above it.
+ *  @param lo The decode table of the low nibble's codeword
+ *  @param hi The decode table of the high nibble's codeword
+ *  @param dst Where the n decoded bytes go
+ *  @param src The 2*n received codewords
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+static inline void codec_hamming_decode(const u16 *lo, const u16 *hi, u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   u64 fixed = 0, bad = 0;
+   unsigned int v;
+
+   for (; n; n--){
+      v = lo[src[0]] + hi[src[1]];
+      *dst++ = v;
+      fixed += v >> CODEC_HAM_FIXED_SHIFT & 3;
+      bad += v >> CODEC_HAM_BAD_SHIFT & 3;
+      src += 2;
+   }
+   if (st){
+      st->corrected += fixed;
+      st->disagree += bad;
+   }
+}
+
+/** @brief Majority votes n bytes from three separate copies like codec_majority3_c(), also
+ *  giving every decoded byte a mask of the bits that were not voted for unanimously. The soft
+ *  decoders are for the few callers that want the mask, so they go a byte at a time.
+ *  @param dst Where the n decoded bytes go
+ *  @param mask Where the n masks go
+ *  @param a The first copy
+ *  @param b The second copy
+ *  @param c The third copy
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+static inline void codec_majority3_soft(u8 *dst, u8 *mask, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   size_t k;
+   u8 m;
+
+   for (k = 0; k < n; k++){
+      dst[k] = codec_maj32(a[k], b[k], c[k]);
+      m = (a[k] ^ b[k]) | (b[k] ^ c[k]);
+      mask[k] = m;
+      if (st){
+         st->corrected += hweight8(m);
+         st->disagree += codec_disagree3(a[k], b[k], c[k]);
+      }
+   }
+}
+
+/** @brief Majority decodes n bytes from 3*n trippled bytes with a mask, see codec_majority3_soft() */
+static inline void codec_repeat3_soft(u8 *dst, u8 *mask, const u8 *src, size_t n, struct codec_stats *st){
+   size_t k;
+
+   for (k = 0; k < n; k++, src += 3)
+      codec_majority3_soft(dst + k, mask + k, src, src + 1, src + 2, 1, st);
+}
+
+/** @brief Decodes 2*n codewords like codec_hamming_decode(), also setting the four mask bits of
+ *  every nibble whose codeword was put right or found beyond repair. Either may be wrong after
+ *  all, a repaired codeword being a miscorrected double error for Hamming(7,4).
+ */
+static inline void codec_hamming_soft(const u16 *lo, const u16 *hi, u8 *dst, u8 *mask, const u8 *src, size_t n, struct codec_stats *st){
+   unsigned int l, h;
+
+   for (; n; n--){
+      l = lo[src[0]];
+      h = hi[src[1]];
+      *dst++ = l + h;
+      *mask++ = (l >> CODEC_HAM_FIXED_SHIFT ? 0x0f : 0) | (h >> CODEC_HAM_FIXED_SHIFT ? 0xf0 : 0);
+      if (st){
+         st->corrected += (l + h) >> CODEC_HAM_FIXED_SHIFT & 3;
+         st->disagree += (l + h) >> CODEC_HAM_BAD_SHIFT & 3;
+      }
+      src += 2;
+   }
+}
+
+// NEON kernels from codec_neon.c, in the kernel only called between kernel_neon_begin() and kernel_neon_end()
+void codec_repeat3_encode_neon(u8 *dst, const u8 *src, size_t n);
+void codec_repeat3_decode_neon(u8 *dst, const u8 *src, size_t n, struct codec_stats *st);
+void codec_majority3_neon(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st);
+
+#ifndef __KERNEL__
+// SSSE3 and AVX2 kernels from codec_x86.c, only in libuartcodec, taking multiples of 16 and 32 bytes
+void codec_repeat3_encode_ssse3(u8 *dst, const u8 *src, size_t n);
+void codec_repeat3_decode_ssse3(u8 *dst, const u8 *src, size_t n, struct codec_stats *st);
+void codec_majority3_ssse3(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st);
+void codec_repeat3_encode_avx2(u8 *dst, const u8 *src, size_t n);
+void codec_repeat3_decode_avx2(u8 *dst, const u8 *src, size_t n, struct codec_stats *st);
+void codec_majority3_avx2(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st);
+#endif
+
+#endif
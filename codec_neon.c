@@ -0,0 +1,119 @@
+/**
+ * @file   codec_neon.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   NEON versions of the coding kernels. This file is built with the NEON compiler flags,
+ * so it must contain nothing but the kernels themselves; codec.c decides when they may run. The
+ * same file is built into libuartcodec on ARM hosts.
+ */
+
+#if defined(__KERNEL__) && defined(CONFIG_ARM64)
+#include <asm/neon-intrinsics.h>  // NEON intrinsics on arm64
+#else
+#include <arm_neon.h>             // NEON intrinsics on the Cortex-A8, and in userspace
+#endif
+#include "codec_kernels.h"        // Integer types and struct codec_stats
+
+/** @brief Tripples n bytes, n a multiple of 16, into 3*n bytes. vst3 of the same register three
+ *  times interleaves it with itself, which is exactly the repeat code.
+ *  @param dst Where the 3*n encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode
+ */
+void codec_repeat3_encode_neon(u8 *dst, const u8 *src, size_t n){
+   uint8x16x3_t v;
+
+   for (; n >= 16; n -= 16){
+      v.val[0] = v.val[1] = v.val[2] = vld1q_u8(src);
+      vst3q_u8(dst, v);
+      src += 16;
+      dst += 48;
+   }
+}
+
+/** @brief Adds up the eight 16-bit counters of a NEON register */
+static u64 sum16(uint16x8_t v){
+   uint64x2_t w = vpaddlq_u32(vpaddlq_u16(v));
+
+   return vgetq_lane_u64(w, 0) + vgetq_lane_u64(w, 1);
+}
+
+/** @brief What the NEON decoders have counted so far, in 16-bit lanes that are emptied into a
+ *  struct codec_stats before they can overflow.
+ */
+struct neon_count {
+   uint16x8_t bits;                  ///< Bits where the copies differ
+   uint16x8_t all;                   ///< Bytes whose three copies all differ
+   unsigned int run;                 ///< Steps since the lanes were last emptied
+};
+
+/** @brief Empties the lanes into st */
+static void countFlush(struct neon_count *nc, struct codec_stats *st){
+   st->corrected += sum16(nc->bits);
+   st->disagree += sum16(nc->all);
+   nc->bits = nc->all = vdupq_n_u16(0);
+   nc->run = 0;
+}
+
+/** @brief Majority votes 16 bytes. Where the first two copies differ the third one decides, so
+ *  the vote is a bit select. With st the bits where the copies differ are counted with vcnt.
+ */
+static inline uint8x16_t vote(uint8x16_t a, uint8x16_t b, uint8x16_t c, struct neon_count *nc, struct codec_stats *st){
+   uint8x16_t ab = veorq_u8(a, b);
+   uint8x16_t bc, ca;
+
+   if (st){
+      bc = veorq_u8(b, c);
+      ca = veorq_u8(c, a);
+      nc->bits = vpadalq_u8(nc->bits, vcntq_u8(vorrq_u8(ab, bc)));
+      nc->all = vpadalq_u8(nc->all, vshrq_n_u8(vandq_u8(vandq_u8(vtstq_u8(ab, ab), vtstq_u8(bc, bc)), vtstq_u8(ca, ca)), 7));
+      if (++nc->run == 2048)               // at most 16 per lane and step
+         countFlush(nc, st);
+   }
+   return vbslq_u8(ab, c, a);
+}
+
+/** @brief Majority decodes n bytes, n a multiple of 16, from 3*n trippled bytes. vld3 splits
+ *  the triplets into three registers holding the first, second and third copies.
+ *  @param dst Where the n decoded bytes go
+ *  @param src The 3*n encoded bytes
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+void codec_repeat3_decode_neon(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   struct neon_count nc = { vdupq_n_u16(0), vdupq_n_u16(0), 0 };
+   uint8x16x3_t v;
+
+   for (; n >= 16; n -= 16){
+      v = vld3q_u8(src);
+      vst1q_u8(dst, vote(v.val[0], v.val[1], v.val[2], &nc, st));
+      src += 48;
+      dst += 16;
+   }
+   if (st)
+      countFlush(&nc, st);
+}
+
+/** @brief Majority votes n bytes, n a multiple of 16, from three separate copies, as sent by the
+ *  interleaved repetition code. Every copy is a plain sequential load.
+ *  @param dst Where the n decoded bytes go
+ *  @param a The first copy
+ *  @param b The second copy
+ *  @param c The third copy
+ *  @param n The number of bytes to decode
+ *  @param st Statistics to add to, or NULL
+ */
+void codec_majority3_neon(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   struct neon_count nc = { vdupq_n_u16(0), vdupq_n_u16(0), 0 };
+
+   for (; n >= 16; n -= 16){
+      vst1q_u8(dst, vote(vld1q_u8(a), vld1q_u8(b), vld1q_u8(c), &nc, st));
+      a += 16;
+      b += 16;
+      c += 16;
+      dst += 16;
+   }
+   if (st)
+      countFlush(&nc, st);
+}
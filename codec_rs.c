@@ -0,0 +1,148 @@
+/**
+ * @file   codec_rs.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Reed-Solomon RS(255,223) codec built on the kernel's lib/reed_solomon. Each codeword
+ * corrects up to 16 wrong bytes wherever they are, at 14% overhead. rs_depth codewords are
+ * interleaved byte by byte, so a burst on the line is spread over all of them and up to
+ * 16*rs_depth consecutive bytes can be lost. The code is systematic: the plaintext goes out
+ * unchanged, followed by the interleaved parity.
+ */
+
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/module.h>         // module_param()
+#include <linux/init.h>           // __init
+#include <linux/mutex.h>          // The decoder's buffers are shared
+#include <linux/string.h>         // memcpy()
+#include "uartcodec.h"            // UART_CODEC_* codes
+#include "codec.h"
+
+#if IS_ENABLED(CONFIG_REED_SOLOMON_ENC8) && IS_ENABLED(CONFIG_REED_SOLOMON_DEC8)
+#include <linux/rslib.h>          // init_rs(), encode_rs8(), decode_rs8()
+
+#define RS_N      255             ///< Bytes in a codeword
+#define RS_K      223             ///< Data bytes in a codeword
+#define RS_ROOTS  (RS_N - RS_K)   ///< Parity bytes, twice the number of errors corrected
+#define RS_MAXDEPTH (CODEC_MAX_BLOCK / RS_N) ///< Deepest interleave a block can hold
+
+static unsigned int rs_depth = 1; ///< Codewords interleaved in a block
+module_param(rs_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(rs_depth, "Reed-Solomon codewords interleaved per block, 1 to 4 (default 1)");
+
+static struct rs_control *rs;     ///< The code over GF(256), from init_rs()
+static DEFINE_MUTEX(rsLock);      ///< decode_rs8() works in buffers of rs, one caller at a time
+
+/** @brief Encodes n bytes into whole interleaved blocks. The data bytes keep their order, since
+ *  column j of a block is data byte j of codeword j%rs_depth, so only the parity is worked out
+ *  one codeword at a time and scattered behind it.
+ *  @param dst Where the codec_encoded_len() encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode, the last block is padded with zeros
+ */
+static void encodeRs(u8 *dst, const u8 *src, size_t n){
+   size_t dataLen = RS_K*rs_depth;
+   size_t take;
+   unsigned int j, k;
+   u8 data[RS_K];
+   u16 par[RS_ROOTS];
+
+   while (n){
+      take = min(n, dataLen);
+      memcpy(dst, src, take);
+      memset(dst + take, 0, dataLen - take);
+      for (j = 0; j < rs_depth; j++){
+         for (k = 0; k < RS_K; k++)
+            data[k] = dst[k*rs_depth + j];
+         memset(par, 0, sizeof(par));
+         encode_rs8(rs, data, RS_K, par, 0);
+         for (k = 0; k < RS_ROOTS; k++)
+            dst[(RS_K + k)*rs_depth + j] = par[k];
+      }
+      dst += RS_N*rs_depth;
+      src += take;
+      n -= take;
+   }
+}
+
+/** @brief Decodes whole interleaved blocks. A codeword with more errors than it can correct is
+ *  passed on as received and counted in st->disagree.
+ *  @param dst Where the decoded bytes go
+ *  @param src The received blocks
+ *  @param blocks The number of blocks
+ *  @param st Statistics to add to, or NULL
+ */
+static void decodeRs(u8 *dst, const u8 *src, size_t blocks, struct codec_stats *st){
+   unsigned int j, k;
+   u8 data[RS_K];
+   u16 par[RS_ROOTS];
+   u64 fixed = 0, bad = 0;
+   int ret;
+
+   mutex_lock(&rsLock);
+   for (; blocks; blocks--){
+      for (j = 0; j < rs_depth; j++){
+         for (k = 0; k < RS_K; k++)
+            data[k] = src[k*rs_depth + j];
+         for (k = 0; k < RS_ROOTS; k++)
+            par[k] = src[(RS_K + k)*rs_depth + j];
+         ret = decode_rs8(rs, data, par, RS_K, NULL, 0, NULL, 0, NULL);
+         if (ret<0)
+            bad++;
+         else if (ret && st){
+            for (k = 0; k < RS_K; k++)
+               fixed += hweight8(data[k] ^ src[k*rs_depth + j]);
+            for (k = 0; k < RS_ROOTS; k++)
+               fixed += hweight8(par[k] ^ src[(RS_K + k)*rs_depth + j]);
+         }
+         for (k = 0; k < RS_K; k++)
+            dst[k*rs_depth + j] = data[k];
+      }
+      src += RS_N*rs_depth;
+      dst += RS_K*rs_depth;
+   }
+   mutex_unlock(&rsLock);
+   if (st){
+      st->corrected += fixed;
+      st->disagree += bad;
+   }
+}
+
+struct uart_codec codec_rs255 = {
+   .name = "rs255",
+   .id = UART_CODEC_RS255,
+   .encode = encodeRs,
+   .decode = decodeRs,
+};
+
+/** @brief Sets up the code and the block sizes for rs_depth
+ *  @return returns 0 if successful
+ */
+int __init codec_rs_init(void){
+   if (rs_depth<1 || rs_depth>RS_MAXDEPTH){
+      printk(KERN_ALERT "Codec: rs_depth must be 1 to %d\n", RS_MAXDEPTH);
+      return -EINVAL;
+   }
+   rs = init_rs(8, 0x11d, 0, 1, RS_ROOTS);  // x^8+x^4+x^3+x^2+1, the usual RS(255,223) field
+   if (!rs)
+      return -ENOMEM;
+   codec_rs255.inBlock = RS_K*rs_depth;
+   codec_rs255.outBlock = RS_N*rs_depth;
+   return 0;
+}
+
+/** @brief Frees the code */
+void codec_rs_exit(void){
+   free_rs(rs);
+}
+
+#else
+
+int __init codec_rs_init(void){
+   return 0;                      // lib/reed_solomon is not there, the codec is left out
+}
+
+void codec_rs_exit(void){
+}
+
+#endif
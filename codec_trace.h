@@ -0,0 +1,57 @@
+/**
+ * @file   codec_trace.h
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Tracepoints of the encode and decode hot paths. They are defined once in the uartcodec
+ * module and cost a patched-out branch unless enabled, e.g. with
+ * "echo 1 > /sys/kernel/tracing/events/uartcodec/enable".
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uartcodec
+
+#if !defined(CODEC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CODEC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/** @brief Plaintext bytes taken by the encoder and encoded bytes it produced, per write() or kick */
+TRACE_EVENT(encode_write,
+   TP_PROTO(size_t in, size_t out),
+   TP_ARGS(in, out),
+   TP_STRUCT__entry(
+      __field(size_t, in)
+      __field(size_t, out)
+   ),
+   TP_fast_assign(
+      __entry->in = in;
+      __entry->out = out;
+   ),
+   TP_printk("in=%zu out=%zu", __entry->in, __entry->out)
+);
+
+/** @brief Encoded bytes taken by the decoder, decoded bytes produced and bits the vote corrected */
+TRACE_EVENT(decode_write,
+   TP_PROTO(size_t in, size_t out, unsigned int corrected),
+   TP_ARGS(in, out, corrected),
+   TP_STRUCT__entry(
+      __field(size_t, in)
+      __field(size_t, out)
+      __field(unsigned int, corrected)
+   ),
+   TP_fast_assign(
+      __entry->in = in;
+      __entry->out = out;
+      __entry->corrected = corrected;
+   ),
+   TP_printk("in=%zu out=%zu corrected=%u", __entry->in, __entry->out, __entry->corrected)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE codec_trace
+#include <trace/define_trace.h>
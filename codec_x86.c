@@ -0,0 +1,222 @@
+/**
+ * @file   codec_x86.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   SSSE3 and AVX2 versions of the repetition code kernels for libuartcodec, the x86
+ * counterparts of codec_neon.c. x86 has no vld3/vst3, so the three copies of 16 bytes are pulled
+ * out of 48 interleaved ones with pshufb, three shuffles per copy, and put back together the same
+ * way. AVX2 works through two such groups at once, one per 128-bit lane, as its shuffles do not
+ * cross lanes. The counts are worked out like the C kernels work them out, so they are the same
+ * whichever kernel ran. Each function is compiled for its own instruction set and libuartcodec.c
+ * only calls the ones the CPU has.
+ */
+
+#include <immintrin.h>
+#include "codec_kernels.h"        // Integer types, struct codec_stats and the prototypes
+
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2  __attribute__((target("avx2")))
+#define Z     -128               ///< A pshufb index that gives a zero byte
+
+/** @brief Where byte k of each of the three 16 byte outputs comes from in the 16 input bytes */
+static const signed char encIdx[3][16] = {
+   { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+   { 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9,10,10 },
+   {10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15 },
+};
+
+/** @brief Where copy c of the 16 bytes comes from in each of the three 16 byte inputs, [c][input] */
+static const signed char decIdx[3][3][16] = {
+   { { 0, 3, 6, 9,12,15, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, Z, 2, 5, 8,11,14, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 1, 4, 7,10,13 } },
+   { { 1, 4, 7,10,13, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, 0, 3, 6, 9,12,15, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 2, 5, 8,11,14 } },
+   { { 2, 5, 8,11,14, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, 1, 4, 7,10,13, Z, Z, Z, Z, Z, Z },
+     { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 0, 3, 6, 9,12,15 } },
+};
+
+/** @brief Set bits of every nibble value, for pshufb */
+static const signed char nibbleBits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+/** @brief Returns the set bits of a vector as two 64-bit sums, the low and high eight bytes */
+static SSSE3 __m128i popcnt128(__m128i v){
+   const __m128i lut = _mm_loadu_si128((const __m128i *)nibbleBits);
+   const __m128i low = _mm_set1_epi8(0x0f);
+   __m128i n = _mm_add_epi8(_mm_shuffle_epi8(lut, _mm_and_si128(v, low)),
+                            _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), low)));
+
+   return _mm_sad_epu8(n, _mm_setzero_si128());
+}
+
+static SSSE3 u64 sum64x2(__m128i v){
+   return (u64)_mm_cvtsi128_si64(v) + (u64)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+}
+
+/** @brief Votes on three lined up copies and adds up the counts of the C kernels */
+static SSSE3 __m128i vote128(__m128i a, __m128i b, __m128i c, __m128i *bits, u64 *disagree){
+   __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)), _mm_cmpeq_epi8(a, c));
+
+   *bits = _mm_add_epi64(*bits, popcnt128(_mm_or_si128(_mm_xor_si128(a, b), _mm_xor_si128(b, c))));
+   *disagree += 16 - __builtin_popcount(_mm_movemask_epi8(eq));
+   return _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, _mm_or_si128(a, b)));
+}
+
+/** @brief Tripples n bytes, n a multiple of 16, into 3*n bytes */
+SSSE3 void codec_repeat3_encode_ssse3(u8 *dst, const u8 *src, size_t n){
+   const __m128i i0 = _mm_loadu_si128((const __m128i *)encIdx[0]);
+   const __m128i i1 = _mm_loadu_si128((const __m128i *)encIdx[1]);
+   const __m128i i2 = _mm_loadu_si128((const __m128i *)encIdx[2]);
+   __m128i v;
+
+   for (; n >= 16; n -= 16){
+      v = _mm_loadu_si128((const __m128i *)src);
+      _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, i0));
+      _mm_storeu_si128((__m128i *)(dst + 16), _mm_shuffle_epi8(v, i1));
+      _mm_storeu_si128((__m128i *)(dst + 32), _mm_shuffle_epi8(v, i2));
+      src += 16;
+      dst += 48;
+   }
+}
+
+/** @brief Pulls copy c of 16 bytes out of the three inputs holding 48 interleaved bytes */
+static SSSE3 __m128i copy128(int c, __m128i x0, __m128i x1, __m128i x2){
+   return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(x0, _mm_loadu_si128((const __m128i *)decIdx[c][0])),
+                                    _mm_shuffle_epi8(x1, _mm_loadu_si128((const __m128i *)decIdx[c][1]))),
+                       _mm_shuffle_epi8(x2, _mm_loadu_si128((const __m128i *)decIdx[c][2])));
+}
+
+/** @brief Majority decodes n bytes, n a multiple of 16, from 3*n trippled bytes */
+SSSE3 void codec_repeat3_decode_ssse3(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   __m128i x0, x1, x2, bits = _mm_setzero_si128();
+   u64 disagree = 0;
+
+   for (; n >= 16; n -= 16){
+      x0 = _mm_loadu_si128((const __m128i *)src);
+      x1 = _mm_loadu_si128((const __m128i *)(src + 16));
+      x2 = _mm_loadu_si128((const __m128i *)(src + 32));
+      _mm_storeu_si128((__m128i *)dst, vote128(copy128(0, x0, x1, x2), copy128(1, x0, x1, x2),
+                                               copy128(2, x0, x1, x2), &bits, &disagree));
+      src += 48;
+      dst += 16;
+   }
+   if (st){
+      st->corrected += sum64x2(bits);
+      st->disagree += disagree;
+   }
+}
+
+/** @brief Majority votes n bytes, n a multiple of 16, from three separate copies */
+SSSE3 void codec_majority3_ssse3(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   __m128i bits = _mm_setzero_si128();
+   u64 disagree = 0;
+   size_t k;
+
+   for (k = 0; k+16 <= n; k += 16)
+      _mm_storeu_si128((__m128i *)(dst + k), vote128(_mm_loadu_si128((const __m128i *)(a + k)),
+                                                     _mm_loadu_si128((const __m128i *)(b + k)),
+                                                     _mm_loadu_si128((const __m128i *)(c + k)), &bits, &disagree));
+   if (st){
+      st->corrected += sum64x2(bits);
+      st->disagree += disagree;
+   }
+}
+
+/** @brief The 256-bit popcount, four 64-bit sums */
+static AVX2 __m256i popcnt256(__m256i v){
+   const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)nibbleBits));
+   const __m256i low = _mm256_set1_epi8(0x0f);
+   __m256i n = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                               _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+
+   return _mm256_sad_epu8(n, _mm256_setzero_si256());
+}
+
+static AVX2 u64 sum64x4(__m256i v){
+   __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+
+   return (u64)_mm_cvtsi128_si64(s) + (u64)_mm_extract_epi64(s, 1);
+}
+
+static AVX2 __m256i vote256(__m256i a, __m256i b, __m256i c, __m256i *bits, u64 *disagree){
+   __m256i eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, b), _mm256_cmpeq_epi8(b, c)), _mm256_cmpeq_epi8(a, c));
+
+   *bits = _mm256_add_epi64(*bits, popcnt256(_mm256_or_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(b, c))));
+   *disagree += 32 - __builtin_popcount((u32)_mm256_movemask_epi8(eq));
+   return _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+}
+
+static AVX2 __m256i idx256(const signed char *idx){
+   return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)idx));
+}
+
+/** @brief Tripples n bytes, n a multiple of 32, into 3*n bytes. The lanes hold the outputs of
+ *  both halves, which are put in order across lanes before storing.
+ */
+AVX2 void codec_repeat3_encode_avx2(u8 *dst, const u8 *src, size_t n){
+   const __m256i i0 = idx256(encIdx[0]), i1 = idx256(encIdx[1]), i2 = idx256(encIdx[2]);
+   __m256i v, o0, o1, o2;
+
+   for (; n >= 32; n -= 32){
+      v = _mm256_loadu_si256((const __m256i *)src);
+      o0 = _mm256_shuffle_epi8(v, i0);
+      o1 = _mm256_shuffle_epi8(v, i1);
+      o2 = _mm256_shuffle_epi8(v, i2);
+      _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(o0, o1, 0x20));
+      _mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(o2, o0, 0x30));
+      _mm256_storeu_si256((__m256i *)(dst + 64), _mm256_permute2x128_si256(o1, o2, 0x31));
+      src += 32;
+      dst += 96;
+   }
+}
+
+/** @brief Loads 16 bytes of the first 48 byte group into the low lane and of the second into the high one */
+static AVX2 __m256i load2(const u8 *lo, const u8 *hi){
+   return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                  _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+static AVX2 __m256i copy256(int c, __m256i x0, __m256i x1, __m256i x2){
+   return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(x0, idx256(decIdx[c][0])),
+                                          _mm256_shuffle_epi8(x1, idx256(decIdx[c][1]))),
+                          _mm256_shuffle_epi8(x2, idx256(decIdx[c][2])));
+}
+
+/** @brief Majority decodes n bytes, n a multiple of 32, from 3*n trippled bytes */
+AVX2 void codec_repeat3_decode_avx2(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   __m256i x0, x1, x2, bits = _mm256_setzero_si256();
+   u64 disagree = 0;
+
+   for (; n >= 32; n -= 32){
+      x0 = load2(src, src + 48);
+      x1 = load2(src + 16, src + 64);
+      x2 = load2(src + 32, src + 80);
+      _mm256_storeu_si256((__m256i *)dst, vote256(copy256(0, x0, x1, x2), copy256(1, x0, x1, x2),
+                                                  copy256(2, x0, x1, x2), &bits, &disagree));
+      src += 96;
+      dst += 32;
+   }
+   if (st){
+      st->corrected += sum64x4(bits);
+      st->disagree += disagree;
+   }
+}
+
+/** @brief Majority votes n bytes, n a multiple of 32, from three separate copies */
+AVX2 void codec_majority3_avx2(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   __m256i bits = _mm256_setzero_si256();
+   u64 disagree = 0;
+   size_t k;
+
+   for (k = 0; k+32 <= n; k += 32)
+      _mm256_storeu_si256((__m256i *)(dst + k), vote256(_mm256_loadu_si256((const __m256i *)(a + k)),
+                                                        _mm256_loadu_si256((const __m256i *)(b + k)),
+                                                        _mm256_loadu_si256((const __m256i *)(c + k)), &bits, &disagree));
+   if (st){
+      st->corrected += sum64x4(bits);
+      st->disagree += disagree;
+   }
+}
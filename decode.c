@@ -3,7 +3,7 @@
  * @author Matthew Callahan from Derek Molloy
  * @date   11 November 2021
  * @version 0.1
- * @brief   A module to decode a three-repeat code 
+ * @brief   A module to decode a three-repeat code or another error correcting code
  * based on introductory code from Derek Molloy.
  * @see http://www.derekmolloy.ie/ for a full description and follow-up descriptions.
  */
@@ -14,6 +14,23 @@
 #include <linux/kernel.h>         // Contains types, macros, functions for the kernel
 #include <linux/fs.h>             // Header for the Linux file system support
 #include <linux/uaccess.h>          // Required for the copy to user function
+#include <linux/kfifo.h>          // Ring buffer holding the decoded stream
+#include <linux/mutex.h>          // Serializes writers and readers of the ring buffer
+#include <linux/slab.h>           // Per open file state and the caches of batch and frame buffers
+#include <linux/mempool.h>        // Batch and frame buffers set aside at load time
+#include <linux/wait.h>           // Wait queues for blocking reads and writes
+#include <linux/poll.h>           // poll/select support
+#include <linux/percpu.h>         // Per-CPU error correction counters
+#include <linux/u64_stats_sync.h> // Consistent 64-bit counters on 32-bit CPUs
+#include <linux/ktime.h>          // Time base of the throughput attribute
+#include <linux/math64.h>         // 64-bit division
+#include <linux/mm.h>             // kvzalloc() for the reorder buffer
+#include <linux/workqueue.h>      // Giving up on a lost frame of the bonded stream, the control frames of adapt
+#include <linux/lz4.h>            // Decompressing UART_FRAME_LZ4 frames
+#include <asm/unaligned.h>        // The CRC and acknowledgement fields
+#include "uartcodec.h"            // Frame format shared with the encoder
+#include "codec.h"                // Codecs from the uartcodec module
+#include "codec_trace.h"          // Tracepoints of the hot path
 
 
 #define  DEVICE_NAME "UARTdecode"    ///< The device will appear at /dev/UARTdecode using this value
@@ -24,34 +41,260 @@ MODULE_LICENSE("GPL");            ///< The license type -- this affects availabl
 MODULE_AUTHOR("Matthew Callahan");    ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A device to decode repeat code messages");  ///< The description -- see modinfo
 MODULE_VERSION("0.1");            ///< A version number to inform users
-#define IN_BUFF_SIZE 769
+#define IN_BUFF_SIZE 768                   ///< Encoded bytes copied from userspace and decoded per pass, a multiple of three
+#define MAX_CHANNELS 4                     ///< Most UARTs one module drives, one minor number each
+#define BOND_MINOR   MAX_CHANNELS          ///< Minor number of /dev/UARTbondrx0
+#define BOND_WINDOW  16                    ///< Frames of the bonded stream that may arrive ahead of the next one delivered
+#define BOND_CHUNK   1024                  ///< Largest payload of a bonded frame, the encoder's IN_CHUNK
+#define ADAPT_TIMEOUT 4                    ///< Intervals without a valid frame before falling back to level 0
+#define ADAPT_CLEAN  8                     ///< Clean intervals in a row before asking for the next level up
+#define ADAPT_MIN_BYTES 256                ///< Bytes an interval must have decoded to count as clean
+#define ARQ_WINDOW   32                    ///< Frames the encoder sends ahead of the first one not acknowledged
+
+static unsigned int fifo_size = 65536;      ///< Size in bytes of the decoded stream buffer, rounded up to a power of two
+module_param(fifo_size, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_size, "Size in bytes of the decoded output ring buffer (default 65536)");
+static bool framed = false;                 ///< Expect the length/sequence framed stream from the encoder
+module_param(framed, bool, S_IRUGO);
+MODULE_PARM_DESC(framed, "Parse length-prefixed frames and deliver only their payload bytes (default 0)");
+
+static char  *codec = "repeat3";            ///< Name of the code streams start out with
+module_param(codec, charp, S_IRUGO);
+MODULE_PARM_DESC(codec, "Error correcting code, repeat3, repeat3i, hamming74, secded84 or rs255 (default repeat3)");
+
+static char  *tty = "";                     ///< Serial port the encoded stream is received from, empty to write it to the device instead
+module_param(tty, charp, S_IRUGO);
+MODULE_PARM_DESC(tty, "Serial port to receive the encoded stream from, e.g. /dev/ttyS5 (default none)");
+static char  *ttys[MAX_CHANNELS];           ///< Serial ports of the channels, ttys[0] overriding tty
+static int    numTtys;                      ///< Number of entries given in ttys
+module_param_array(ttys, charp, &numTtys, S_IRUGO);
+MODULE_PARM_DESC(ttys, "Serial ports of channels 0, 1, ... e.g. /dev/ttyS5,/dev/ttyS2, empty for a channel written through its device (default tty for channel 0)");
+static unsigned int channels = 1;           ///< Number of devices, at least one per entry of ttys
+module_param(channels, uint, S_IRUGO);
+MODULE_PARM_DESC(channels, "Number of channels, /dev/UARTdecode then /dev/UARTdecode1 and up (default 1, or as many as ttys lists)");
+static bool bond = false;                   ///< Reassemble the bonded stream into /dev/UARTbondrx0
+module_param(bond, bool, S_IRUGO);
+MODULE_PARM_DESC(bond, "Reassemble the frames of the bonded stream from all channels in /dev/UARTbondrx0, needs framed=1 (default 0)");
+static unsigned int bond_timeout = 100;     ///< Milliseconds to wait for a missing frame of the bonded stream
+module_param(bond_timeout, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bond_timeout, "Milliseconds to wait for a missing frame of the bonded stream before skipping it (default 100)");
+static bool adapt = false;                  ///< Ask the encoder for the code and baud rate the error rate allows
+module_param(adapt, bool, S_IRUGO);
+MODULE_PARM_DESC(adapt, "Report the corrected error rate of every serial port back to the encoder, which moves the link along the rate ladder, needs framed=1 (default 0)");
+static unsigned int adapt_max = CODEC_LADDER_LEN-1; ///< Highest level of the rate ladder to ask for
+module_param(adapt_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adapt_max, "Highest level of the rate ladder to ask for, 0 to 7 (default 7, rs255 at 3686400 baud)");
+static unsigned int adapt_interval = 250;   ///< Milliseconds between reports
+module_param(adapt_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(adapt_interval, "Milliseconds between reports to the encoder, the same on both ends (default 250)");
+static unsigned int adapt_up_ppm = 10;      ///< Corrected bits per million decoded below which an interval is clean
+module_param(adapt_up_ppm, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adapt_up_ppm, "Corrected bits per million decoded bits below which the link may step up (default 10)");
+static unsigned int adapt_down_ppm = 1000;  ///< Corrected bits per million decoded above which the link steps down
+module_param(adapt_down_ppm, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adapt_down_ppm, "Corrected bits per million decoded bits above which the link steps down, as does any uncorrectable block (default 1000)");
+static bool arq = false;                    ///< Acknowledge the frames of every serial port and put them back in order
+module_param(arq, bool, S_IRUGO);
+MODULE_PARM_DESC(arq, "Acknowledge the frames received on every serial port so the encoder sends lost ones again, and deliver them in order, needs framed=1 (default 0)");
+static unsigned int frame_pool = 2*ARQ_WINDOW; ///< Buffers for frames held out of order allocated at load time
+module_param(frame_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(frame_pool, "Buffers for frames held behind a missing one with arq allocated at load time, so receiving does not depend on free memory (default 64)");
+static unsigned int batch_pool = 2;         ///< Scratch buffers of DEC_IOC_SUBMIT_BATCH allocated at load time
+module_param(batch_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(batch_pool, "Scratch buffers for DEC_IOC_SUBMIT_BATCH allocated at load time, batches beyond that many at once wait for one (default 2)");
+
+/** @brief The state of one decoded stream, kept in filep->private_data. Every open file has one
+ *  of its own, except in tty mode where all readers share the one fed by the serial port.
+ */
+struct decode_ctx {
+   struct mutex lock;                ///< Protects everything below
+   struct kfifo fifo;                ///< Decoded bytes waiting to be read
+   wait_queue_head_t readWait;       ///< Where readers sleep while fifo is empty
+   wait_queue_head_t writeWait;      ///< Where writers and the receive thread wait for readers to make room in fifo
+   const struct uart_codec *codec;   ///< The code the stream is decoded with, see UART_IOC_SET_CODEC
+   u8 temp[IN_BUFF_SIZE+CODEC_MAX_BLOCK]; ///< Buffer for converting down the decoding, starts with any carried bytes
+   unsigned int carryLen;            ///< Bytes of an incomplete codec block kept at the start of temp between writes, or one whole block after deframe() stopped
+   unsigned int carryDone;           ///< Decoded bytes of such a whole block deframe() has been through already
+   bool full;                        ///< deframe() stopped at a frame the stream buffer has no room for yet
+   u8 message[IN_BUFF_SIZE+CODEC_MAX_BLOCK]; ///< One decoded chunk on its way into fifo
+   u8 hdrBuf[UART_FRAME_HDR_SIZE];   ///< Frame header bytes collected so far
+   unsigned int hdrLen;              ///< Number of valid bytes in hdrBuf
+   unsigned int payloadLeft;         ///< Payload bytes of the current frame still to be delivered
+   u16 nextSeq;                      ///< Sequence number expected on the next frame
+   bool seqValid;                    ///< Whether nextSeq has been set by a first frame
+   bool stalled;                     ///< The serial port holds bytes ttyReceive had no room for
+   u64 rxTime;                       ///< When the serial port last passed bytes to ttyReceive, 0 for a file's own stream
+   struct codec_tty *port;           ///< The serial port feeding the stream, NULL for a file's own
+   bool bondFrame;                   ///< The current frame belongs to the bonded stream
+   bool held;                        ///< The current frame is collected in bondBuf and looked at before it is handed on
+   struct uart_frame_hdr frameHdr;   ///< Its header
+   u16 bondSeq;                      ///< Its sequence number
+   unsigned int bondLen;             ///< Payload bytes and CRC of a held frame collected so far
+   u8 bondBuf[BOND_CHUNK+UART_FRAME_STAMP_SIZE+UART_FRAME_CRC_SIZE]; ///< That payload and its trailer, handed on by frameDone() once complete
+   u8 lz4Buf[BOND_CHUNK];            ///< What the payload of a UART_FRAME_LZ4 frame decompresses to
+   struct arq_rx *arq;               ///< Frames waiting for those before them with arq, NULL for a file's own stream
+   unsigned int adaptLevel;          ///< Level of the rate ladder the stream is at with adapt
+   bool adaptSeen;                   ///< A valid frame has arrived since the last report
+   u64 adaptBytes;                   ///< Bytes decoded since the last report
+   u64 adaptBits;                    ///< Bits corrected since the last report
+   u64 adaptBad;                     ///< Blocks found damaged beyond repair since the last report
+};
+
+/** @brief Scratch space of a DEC_IOC_SUBMIT_BATCH or DEC_IOC_SUBMIT_SOFT call, which leaves the file's stream alone, taken from batchPool */
+struct decode_batch {
+   u8 in[IN_BUFF_SIZE+CODEC_MAX_BLOCK];  ///< Encoded bytes copied from userspace
+   u8 out[IN_BUFF_SIZE+CODEC_MAX_BLOCK]; ///< What they decode to
+   u8 mask[IN_BUFF_SIZE+CODEC_MAX_BLOCK]; ///< Their masks with DEC_IOC_SUBMIT_SOFT
+};
+
+/** @brief A frame of a link with arq that arrived ahead of one missing before it */
+struct arq_slot {
+   u16 len;                          ///< Payload bytes in data
+   u8 *data;                         ///< The payload, a buffer of framePool
+};
+
+/** @brief The receiving side of a link with arq. A frame is kept in the slot of its sequence
+ *  number modulo ARQ_WINDOW until all before it are delivered, which the encoder's window makes
+ *  sure is never more than ARQ_WINDOW frames away. The next frame goes straight into the stream
+ *  buffer if there is room, so only frames behind a gap take a buffer. Protected by the lock of
+ *  the stream.
+ */
+struct arq_rx {
+   u16 next;                         ///< Sequence number of the next frame to deliver
+   u32 held;                         ///< Bit i set if frame next+i waits in its slot
+   struct arq_slot slots[ARQ_WINDOW]; ///< The frames
+};
+
+/** @brief A frame of the bonded stream waiting for those before it */
+struct bond_slot {
+   bool used;                        ///< Whether the slot holds a frame
+   u16 len;                          ///< Payload bytes in data
+   u8 data[BOND_CHUNK];              ///< The payload
+};
+
+/** @brief The bonded stream, put back in order from the frames of every channel. Frames are kept
+ *  in the slot of their sequence number modulo BOND_WINDOW until all before them have arrived; a
+ *  missing one is given up on after bond_timeout ms, or as soon as a frame too far ahead to be
+ *  kept arrives.
+ */
+struct bond_rx {
+   struct mutex lock;                ///< Protects everything below
+   struct kfifo fifo;                ///< Bytes delivered in order, waiting to be read
+   wait_queue_head_t readWait;       ///< Where readers sleep while fifo is empty
+   struct delayed_work skip;         ///< Skips a missing frame once bond_timeout has passed
+   u16 nextSeq;                      ///< Sequence number of the next frame to deliver
+   bool seqValid;                    ///< Whether nextSeq has been set by a first frame
+   unsigned long lost;               ///< Frames given up on
+   unsigned long dropped;            ///< Bytes lost because readers did not keep up
+   struct bond_slot slots[BOND_WINDOW]; ///< Frames that arrived early
+};
+
+/** @brief One channel: a minor number, its device and, in tty mode, the serial port feeding it */
+struct decode_channel {
+   unsigned int index;               ///< The minor number
+   const char *ttyPath;              ///< The serial port, empty if the channel is written through its device
+   struct device *dev;               ///< The channel's device
+   struct decode_ctx *ttyCtx;        ///< The stream fed by the serial port, NULL without one
+   struct codec_tty tty;             ///< The serial port
+   struct delayed_work adaptWork;    ///< Reports to the encoder every adapt_interval with adapt
+   unsigned int baudLevel;           ///< Level whose baud rate the port is set to
+   unsigned int adaptWant;           ///< Level asked for in the reports
+   int adaptClean;                   ///< Clean intervals in a row, negative while holding off after a step down
+   unsigned int adaptQuiet;          ///< Intervals in a row without a valid frame
+   struct work_struct ackWork;       ///< Sends an acknowledgement with arq
+   struct mutex backLock;            ///< Serializes reports and acknowledgements sent back to the encoder
+};
+
+/** @brief What has been decoded on one CPU. Only that CPU writes it, so the hot path takes no
+ *  shared lock; the sysfs attributes add up all CPUs.
+ */
+struct decode_stats {
+   u64 bytes;                        ///< Decoded bytes produced
+   u64 bits;                         ///< Bits corrected by the majority vote
+   u64 disagree;                     ///< Triplets whose three copies were all different
+   u64 crcErrors;                    ///< Frames dropped because their CRC did not match
+   struct u64_stats_sync syncp;      ///< Lets readers on 32-bit CPUs see whole values
+};
+
 static int    majorNumber;                  ///< Stores the device number -- determined automatically
-static char   message[256] = {0};           ///< Memory for the string that is passed from userspace
-static char temp[IN_BUFF_SIZE]={0}; //buffer for converting down the decoding
-static short  messageSize;              ///< Used to remember the size of the string stored
-static int    numberOpens = 0;              ///< Counts the number of times the device is opened
+static const struct uart_codec *defaultCodec; ///< The codec named by the codec parameter
+static struct decode_stats __percpu *decodeStats; ///< The counters of every CPU
+static struct kmem_cache *batchCache;       ///< Scratch buffers of DEC_IOC_SUBMIT_BATCH, see struct decode_batch
+static mempool_t *batchPool;               ///< At least batch_pool of them, set aside at load time
+static struct kmem_cache *frameCache;       ///< Buffers of BOND_CHUNK bytes for frames held with arq
+static mempool_t *framePool;               ///< At least frame_pool of them, set aside at load time with arq
+static struct codec_hist histWire;          ///< From the encoder encoding a time stamped frame to the serial port passing on its end
+static struct codec_hist histDecode;        ///< From there to the frame being decoded and delivered
+static struct codec_hist histTotal;         ///< From the write to the encoder to the frame being delivered
+static struct decode_stats statsBase;      ///< Sums at the last reset, subtracted from what is shown
+static ktime_t statsSince;                 ///< When the counters were last reset
+static DEFINE_SPINLOCK(statsLock);         ///< Protects statsBase and statsSince
+static struct decode_channel *decodeChannels; ///< The channels, numChannels of them
+static unsigned int numChannels;            ///< Number of channels and devices
+static atomic_t numberOpens = ATOMIC_INIT(0); ///< Counts the number of times the device is opened
 static struct class*  decodeClass  = NULL; ///< The device-driver class struct pointer
-static struct device* decodeDevice = NULL; ///< The device-driver device struct pointer
+static struct bond_rx *bondRx;              ///< The bonded stream when bond is set
+static struct device* bondDevice = NULL;    ///< /dev/UARTbondrx0
 
 
 // The prototype functions for the character driver -- must come before the struct definition
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static size_t  ttyReceive(void *, const u8 *, size_t);
+static size_t  room(struct decode_ctx *);
+static size_t  decodeTemp(struct decode_ctx *, size_t);
+static struct decode_ctx *ctxAlloc(void);
+static void    ctxFree(struct decode_ctx *);
+static int     channelInit(struct decode_channel *);
+static void    channelExit(struct decode_channel *);
+static bool    iocbNonblock(struct kiocb *);
+static int     bondInit(void);
+static void    bondExit(void);
+static void    bondSkipWork(struct work_struct *);
+static void    adaptWork(struct work_struct *);
+static void    ackWork(struct work_struct *);
+static bool    arqFlush(struct decode_ctx *);
+static void    arqDrop(struct arq_rx *);
+static int     poolInit(void);
+static void    poolExit(void);
+static void    histExit(void);
+static ssize_t bond_read_iter(struct kiocb *, struct iov_iter *);
+static __poll_t bond_poll(struct file *, poll_table *);
+static const struct attribute_group *decodeGroups[];
 
 /** @brief Devices are represented as file structure in the kernel. The file_operations structure from
  *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
- *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+ *  using a C99 syntax structure. char devices usually implement open, read, write and release calls.
+ *  The iov_iter versions of read and write also serve readv/writev, and splice goes through them.
  */
 static struct file_operations fops =
 {
    .open = dev_open,
-   .read = dev_read,
-   .write = dev_write,
+   .read_iter = dev_read_iter,
+   .write_iter = dev_write_iter,
+   .splice_read = generic_file_splice_read,
+   .splice_write = iter_file_splice_write,
+   .poll = dev_poll,
+   .unlocked_ioctl = dev_ioctl,
+   .compat_ioctl = compat_ptr_ioctl,
    .release = dev_release,
 };
 
+/** @brief The operations of /dev/UARTbondrx0, which dev_open() switches a file to. It is only read,
+ *  the channels feed it.
+ */
+static const struct file_operations bondFops =
+{
+   .owner = THIS_MODULE,
+   .read_iter = bond_read_iter,
+   .splice_read = generic_file_splice_read,
+   .poll = bond_poll,
+};
+
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
@@ -59,11 +302,72 @@ static struct file_operations fops =
  *  @return returns 0 if successful
  */
 static int __init decodeInit(void){
+   unsigned int k;
+
    printk(KERN_INFO "Decode: Initializing the Decoding module\n");
 
+   defaultCodec = codec_find(codec);
+   if (!defaultCodec){
+      printk(KERN_ALERT "Decode: unknown codec %s\n", codec);
+      return -EINVAL;
+   }
+   if (fifo_size<BOND_CHUNK+2*CODEC_MAX_BLOCK){   // a decompressed frame and a block before and after it, see room()
+      printk(KERN_ALERT "Decode: fifo_size must be at least %d\n", BOND_CHUNK+2*CODEC_MAX_BLOCK);
+      return -EINVAL;
+   }
+   if (bond && !framed){
+      printk(KERN_ALERT "Decode: bond needs framed=1\n");
+      return -EINVAL;
+   }
+   if (adapt && !framed){
+      printk(KERN_ALERT "Decode: adapt needs framed=1\n");
+      return -EINVAL;
+   }
+   if (arq && !framed){
+      printk(KERN_ALERT "Decode: arq needs framed=1\n");
+      return -EINVAL;
+   }
+
+   numChannels = max_t(unsigned int, channels, numTtys);
+   if (!numChannels || numChannels>MAX_CHANNELS){
+      printk(KERN_ALERT "Decode: channels must be 1 to %d\n", MAX_CHANNELS);
+      return -EINVAL;
+   }
+   decodeChannels = kcalloc(numChannels, sizeof(*decodeChannels), GFP_KERNEL);
+   if (!decodeChannels)
+      return -ENOMEM;
+   for (k = 0; k < numChannels; k++){
+      decodeChannels[k].index = k;
+      decodeChannels[k].ttyPath = k<numTtys ? ttys[k] : (k ? "" : tty);
+   }
+
+   decodeStats = alloc_percpu(struct decode_stats);
+   if (!decodeStats){
+      kfree(decodeChannels);
+      return -ENOMEM;
+   }
+   statsSince = ktime_get();
+   if (poolInit()){
+      kfree(decodeChannels);
+      free_percpu(decodeStats);
+      return -ENOMEM;
+   }
+   if (codec_hist_create(&histWire, "dec_wire") || codec_hist_create(&histDecode, "dec_decode") ||
+       codec_hist_create(&histTotal, "dec_total")){
+      histExit();
+      poolExit();
+      kfree(decodeChannels);
+      free_percpu(decodeStats);
+      return -ENOMEM;
+   }
+
    // Try to dynamically allocate a major number for the device -- more difficult but worth it
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
+      kfree(decodeChannels);
+      histExit();
+      poolExit();
+      free_percpu(decodeStats);
       printk(KERN_ALERT "Decode failed to register a major number\n");
       return majorNumber;
    }
@@ -73,21 +377,47 @@ static int __init decodeInit(void){
    decodeClass = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(decodeClass)){                // Check for error and clean up if there is
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      kfree(decodeChannels);
+      histExit();
+      poolExit();
+      free_percpu(decodeStats);
       printk(KERN_ALERT "Failed to register device class\n");
       return PTR_ERR(decodeClass);          // Correct way to return an error on a pointer
    }
    printk(KERN_INFO "Decode: device class registered correctly\n");
 
-   // Register the device driver
-   decodeDevice = device_create(decodeClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(decodeDevice)){               // Clean up if there is an error
-      class_destroy(decodeClass);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to create the device\n");
-      return PTR_ERR(decodeDevice);
+   // Register a device per channel, taking the stream straight from the serial port where one was given
+   for (k = 0; k < numChannels; k++){
+      int err = channelInit(&decodeChannels[k]);
+      if (err){
+         while (k--)
+            channelExit(&decodeChannels[k]);
+         class_destroy(decodeClass);           // Repeated code but the alternative is goto statements
+         unregister_chrdev(majorNumber, DEVICE_NAME);
+         kfree(decodeChannels);
+         histExit();
+         poolExit();
+         free_percpu(decodeStats);
+         return err;
+      }
    }
-   printk(KERN_INFO "Decode: device class created correctly\n"); // Made it! device was initialized
-   return 0;
+   printk(KERN_INFO "Decode: %u device(s) created correctly\n", numChannels);
+
+   if (bond){
+      int err = bondInit();
+      if (err){
+         for (k = 0; k < numChannels; k++)
+            channelExit(&decodeChannels[k]);
+         class_destroy(decodeClass);
+         unregister_chrdev(majorNumber, DEVICE_NAME);
+         kfree(decodeChannels);
+         histExit();
+         poolExit();
+         free_percpu(decodeStats);
+         return err;
+      }
+   }
+   return 0;                                // Made it! device was initialized
 }
 
 /** @brief The LKM cleanup function
@@ -95,89 +425,1259 @@ static int __init decodeInit(void){
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit decodeExit(void){   
-   device_destroy(decodeClass, MKDEV(majorNumber, 0));     // remove the device
+   unsigned int k;
+
+   for (k = 0; k < numChannels; k++)
+      channelExit(&decodeChannels[k]);                     // remove the devices and stop receiving
+   if (bondRx)
+      bondExit();                                          // nothing feeds it any more
    class_unregister(decodeClass);                          // unregister the device class
    class_destroy(decodeClass);                             // remove the device class
    unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   kfree(decodeChannels);
+   histExit();
+   poolExit();                                             // every stream is freed, so every buffer is back
+   free_percpu(decodeStats);                               // after the attributes are gone
    printk(KERN_INFO "Decode: Goodbye from the LKM!\n");
 }
 
+/** @brief Creates the caches and pools of batch scratch buffers and, with arq, of frame buffers.
+ *  Each pool allocates its minimum at once and keeps it; more only come from the cache while
+ *  all of those are in use.
+ *  @return returns 0 if successful
+ */
+static int poolInit(void){
+   batchCache = kmem_cache_create("uartdec_batch", sizeof(struct decode_batch), 0, 0, NULL);
+   if (!batchCache)
+      return -ENOMEM;
+   batchPool = mempool_create_slab_pool(max(batch_pool, 1U), batchCache);
+   if (!batchPool){
+      kmem_cache_destroy(batchCache);
+      return -ENOMEM;
+   }
+   if (!arq)
+      return 0;
+   frameCache = kmem_cache_create("uartdec_frame", BOND_CHUNK, 0, 0, NULL);
+   if (frameCache)
+      framePool = mempool_create_slab_pool(max(frame_pool, 1U), frameCache);
+   if (!framePool){
+      kmem_cache_destroy(frameCache);
+      mempool_destroy(batchPool);
+      kmem_cache_destroy(batchCache);
+      return -ENOMEM;
+   }
+   return 0;
+}
+
+/** @brief Releases the pools and caches of poolInit() */
+static void poolExit(void){
+   mempool_destroy(framePool);
+   kmem_cache_destroy(frameCache);
+   mempool_destroy(batchPool);
+   kmem_cache_destroy(batchCache);
+}
+
+/** @brief Removes the latency histograms */
+static void histExit(void){
+   codec_hist_destroy(&histWire);
+   codec_hist_destroy(&histDecode);
+   codec_hist_destroy(&histTotal);
+}
+
+/** @brief Creates the device of a channel, /dev/UARTdecode for channel 0 and /dev/UARTdecodeN for
+ *  the others, and starts receiving from its serial port if it has one. The statistics cover all
+ *  channels and are attached to channel 0.
+ *  @param ch The channel, with index and ttyPath set
+ *  @return returns 0 if successful
+ */
+static int channelInit(struct decode_channel *ch){
+   int err = -ENOMEM;
+
+   mutex_init(&ch->backLock);
+   if (ch->index)
+      ch->dev = device_create(decodeClass, NULL, MKDEV(majorNumber, ch->index), NULL, DEVICE_NAME "%u", ch->index);
+   else
+      ch->dev = device_create_with_groups(decodeClass, NULL, MKDEV(majorNumber, 0), NULL, decodeGroups, DEVICE_NAME);
+   if (IS_ERR(ch->dev)){
+      printk(KERN_ALERT "Failed to create the device\n");
+      return PTR_ERR(ch->dev);
+   }
+   if (!ch->ttyPath[0])
+      return 0;
+   ch->ttyCtx = ctxAlloc();
+   if (ch->ttyCtx && arq){
+      ch->ttyCtx->arq = kzalloc(sizeof(*ch->ttyCtx->arq), GFP_KERNEL);
+      INIT_WORK(&ch->ackWork, ackWork);
+   }
+   if (ch->ttyCtx && (!arq || ch->ttyCtx->arq)){
+      ch->ttyCtx->port = &ch->tty;
+      err = codec_tty_open(&ch->tty, ch->ttyPath);
+   }
+   if (!err && adapt){
+      ch->ttyCtx->codec = codec_get(codec_ladder[0].codec); // an adaptive link starts at level 0
+      err = codec_tty_set_baud(&ch->tty, codec_ladder[0].baud);
+      if (err)
+         codec_tty_close(&ch->tty);
+   }
+   if (!err){
+      err = codec_tty_start_rx(&ch->tty, ttyReceive, ch->ttyCtx);
+      if (err)
+         codec_tty_close(&ch->tty);
+   }
+   if (err){
+      if (ch->ttyCtx)
+         ctxFree(ch->ttyCtx);
+      ch->ttyCtx = NULL;
+      device_destroy(decodeClass, MKDEV(majorNumber, ch->index));
+      return err;
+   }
+   if (adapt){
+      INIT_DELAYED_WORK(&ch->adaptWork, adaptWork);
+      schedule_delayed_work(&ch->adaptWork, msecs_to_jiffies(adapt_interval));
+   }
+   printk(KERN_INFO "Decode: channel %u receiving the encoded stream from %s\n", ch->index, ch->ttyPath);
+   return 0;
+}
+
+/** @brief Stops receiving on a channel and removes its device */
+static void channelExit(struct decode_channel *ch){
+   if (ch->ttyCtx){
+      codec_tty_stop_rx(&ch->tty);                         // a frame would queue the work items again
+      if (adapt)
+         cancel_delayed_work_sync(&ch->adaptWork);
+      if (arq)
+         cancel_work_sync(&ch->ackWork);
+      codec_tty_close(&ch->tty);                           // stop receiving before the buffers go away
+      ctxFree(ch->ttyCtx);
+   }
+   device_destroy(decodeClass, MKDEV(majorNumber, ch->index));
+}
+
+/** @brief Sets up the bonded stream and creates /dev/UARTbondrx0
+ *  @return returns 0 if successful
+ */
+static int bondInit(void){
+   bondRx = kvzalloc(sizeof(*bondRx), GFP_KERNEL);
+   if (!bondRx)
+      return -ENOMEM;
+   if (kfifo_alloc(&bondRx->fifo, fifo_size, GFP_KERNEL)){
+      kvfree(bondRx);
+      bondRx = NULL;
+      return -ENOMEM;
+   }
+   mutex_init(&bondRx->lock);
+   init_waitqueue_head(&bondRx->readWait);
+   INIT_DELAYED_WORK(&bondRx->skip, bondSkipWork);
+   bondDevice = device_create(decodeClass, NULL, MKDEV(majorNumber, BOND_MINOR), NULL, "UARTbondrx0");
+   if (IS_ERR(bondDevice)){
+      kfifo_free(&bondRx->fifo);
+      kvfree(bondRx);
+      bondRx = NULL;
+      printk(KERN_ALERT "Failed to create the bond device\n");
+      return PTR_ERR(bondDevice);
+   }
+   return 0;
+}
+
+/** @brief Removes /dev/UARTbondrx0 and frees the bonded stream */
+static void bondExit(void){
+   device_destroy(decodeClass, MKDEV(majorNumber, BOND_MINOR));
+   cancel_delayed_work_sync(&bondRx->skip);
+   if (bondRx->lost || bondRx->dropped)
+      printk(KERN_INFO "Decode: bonded stream lost %lu frames and dropped %lu bytes\n", bondRx->lost, bondRx->dropped);
+   kfifo_free(&bondRx->fifo);
+   kvfree(bondRx);
+   bondRx = NULL;
+}
+
+/** @brief Returns whether any frame is held back waiting for a missing one before it */
+static bool bondHeld(struct bond_rx *b){
+   unsigned int k;
+
+   for (k = 0; k < BOND_WINDOW; k++)
+      if (b->slots[k].used)
+         return true;
+   return false;
+}
+
+/** @brief Delivers the frames at the head of the window that have all arrived, then arms the
+ *  timeout if any are still held back by a missing one. Called with the stream locked.
+ */
+static void bondFlush(struct bond_rx *b){
+   struct bond_slot *slot = &b->slots[b->nextSeq % BOND_WINDOW];
+   bool delivered = false;
+
+   while (slot->used){
+      b->dropped += slot->len - kfifo_in(&b->fifo, slot->data, slot->len);
+      slot->used = false;
+      delivered = true;
+      slot = &b->slots[++b->nextSeq % BOND_WINDOW];
+   }
+   if (bondHeld(b))
+      mod_delayed_work(system_wq, &b->skip, msecs_to_jiffies(READ_ONCE(bond_timeout)));
+   if (delivered)
+      wake_up_interruptible(&b->readWait);
+}
+
+/** @brief Gives up on the missing frame at the head of the window. Called with the stream locked. */
+static void bondSkip(struct bond_rx *b){
+   b->nextSeq++;
+   b->lost++;
+   bondFlush(b);
+}
+
+/** @brief Takes in a complete frame of the bonded stream from any channel
+ *  @param seq Its sequence number
+ *  @param data Its payload
+ *  @param len The number of payload bytes, at most BOND_CHUNK
+ */
+static void bondReceive(u16 seq, const u8 *data, size_t len){
+   struct bond_rx *b = bondRx;
+   struct bond_slot *slot;
+
+   if (!b)
+      return;                         // bonding is off here, the frame has nowhere to go
+   mutex_lock(&b->lock);
+   if (!b->seqValid){
+      b->nextSeq = seq;
+      b->seqValid = true;
+   }
+   if ((u16)(seq - b->nextSeq) >= 0x8000){
+      mutex_unlock(&b->lock);         // behind the window: a duplicate, or a frame already skipped
+      return;
+   }
+   while ((u16)(seq - b->nextSeq) >= BOND_WINDOW)
+      bondSkip(b);                    // too far ahead, the frames in between are taken as lost
+   slot = &b->slots[seq % BOND_WINDOW];
+   slot->used = true;
+   slot->len = len;
+   memcpy(slot->data, data, len);
+   bondFlush(b);
+   mutex_unlock(&b->lock);
+}
+
+/** @brief Runs bond_timeout after a frame was held back and skips the frames still missing before
+ *  the first one that has arrived
+ *  @param work The skip work of bondRx
+ */
+static void bondSkipWork(struct work_struct *work){
+   struct bond_rx *b = container_of(to_delayed_work(work), struct bond_rx, skip);
+
+   mutex_lock(&b->lock);
+   if (bondHeld(b)){
+      while (!b->slots[b->nextSeq % BOND_WINDOW].used){
+         b->nextSeq++;
+         b->lost++;
+      }
+      bondFlush(b);
+   }
+   mutex_unlock(&b->lock);
+}
+
+/** @brief Reads the bonded stream, sleeping until bytes arrive unless the file is non-blocking
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param to Where the bytes go
+ */
+static ssize_t bond_read_iter(struct kiocb *iocb, struct iov_iter *to){
+   struct bond_rx *b = bondRx;
+   size_t copied;
+
+   if (!iov_iter_count(to))
+      return 0;
+   if (mutex_lock_interruptible(&b->lock))
+      return -ERESTARTSYS;
+   while (kfifo_is_empty(&b->fifo)){
+      mutex_unlock(&b->lock);
+      if (iocbNonblock(iocb))
+         return -EAGAIN;
+      if (wait_event_interruptible(b->readWait, !kfifo_is_empty(&b->fifo)))
+         return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&b->lock))
+         return -ERESTARTSYS;
+   }
+   copied = codec_kfifo_to_iter(&b->fifo, to);
+   mutex_unlock(&b->lock);
+   return copied ? copied : -EFAULT;
+}
+
+/** @brief The bonded stream is readable when bytes have been delivered in order */
+static __poll_t bond_poll(struct file *filep, poll_table *wait){
+   poll_wait(filep, &bondRx->readWait, wait);
+   return kfifo_is_empty(&bondRx->fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+/** @brief Allocates an empty stream with a fifo_size buffer
+ *  @return returns the new stream or NULL if there is no memory
+ */
+static struct decode_ctx *ctxAlloc(void){
+   struct decode_ctx *ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+
+   if (!ctx)
+      return NULL;
+   if (kfifo_alloc(&ctx->fifo, fifo_size, GFP_KERNEL)){
+      kfree(ctx);
+      return NULL;
+   }
+   mutex_init(&ctx->lock);
+   init_waitqueue_head(&ctx->readWait);
+   init_waitqueue_head(&ctx->writeWait);
+   ctx->codec = defaultCodec;
+   return ctx;
+}
+
+/** @brief Releases a stream allocated by ctxAlloc() */
+static void ctxFree(struct decode_ctx *ctx){
+   if (ctx->arq)
+      arqDrop(ctx->arq);
+   kfree(ctx->arq);
+   kfifo_free(&ctx->fifo);
+   kfree(ctx);
+}
+
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  It gives the new file a decoded stream of its own, or the shared one of its channel in tty mode.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep){
-   numberOpens++;
+   struct decode_ctx *ctx;
+   int opens;
+
+   if (iminor(inodep)==BOND_MINOR && bondRx){
+      replace_fops(filep, fops_get(&bondFops)); // a reader of the bonded stream, no state of its own
+      return 0;
+   }
+   if (iminor(inodep)>=numChannels)
+      return -ENODEV;
+   ctx = decodeChannels[iminor(inodep)].ttyCtx;
+   if (!ctx)
+      ctx = ctxAlloc();
+   if (!ctx)
+      return -ENOMEM;
+   filep->private_data = ctx;
 
-   printk(KERN_INFO "Decode: Device has been opened %d time(s)\n", numberOpens);
+   opens = atomic_inc_return(&numberOpens);
+   pr_debug("Decode: Device has been opened %d time(s)\n", opens);
    return 0;
 }
 
+/** @brief Returns whether a read or write must not sleep */
+static bool iocbNonblock(struct kiocb *iocb){
+   return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
 /** @brief This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- *  @param buffer The pointer to the buffer to which this function writes the data
- *  @param len The length of the b
- *  @param offset The offset if required
- */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, messageSize);
-   int sendLength=messageSize;
-   messageSize=0;
-   if (error_count==0){            // if true then have success
-      printk(KERN_INFO "Decode: Sent %d characters to the user\n", messageSize);
-      return (sendLength);  // clear the position to the start and return 0
+ *  being sent from the device to the user. It drains as many decoded bytes from the file's
+ *  stream buffer as the iterator has room for, and then goes on decoding a frame that was waiting
+ *  for that room. If there is nothing yet it sleeps until decoded data arrives, or fails with
+ *  EAGAIN if the file is non-blocking.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param to Where the bytes go, user buffers for read and readv or a pipe for splice
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to){
+   struct decode_ctx *ctx = iocb->ki_filp->private_data;
+   size_t copied;
+
+   if (!iov_iter_count(to))
+      return 0;
+   if (mutex_lock_interruptible(&ctx->lock))
+      return -ERESTARTSYS;
+   while (kfifo_is_empty(&ctx->fifo)){
+      mutex_unlock(&ctx->lock);
+      if (iocbNonblock(iocb))
+         return -EAGAIN;
+      if (wait_event_interruptible(ctx->readWait, !kfifo_is_empty(&ctx->fifo)))
+         return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
    }
-   else {
-      printk(KERN_INFO "Decode: Failed to send %d characters to the user\n", error_count);
+   copied = codec_kfifo_to_iter(&ctx->fifo, to);
+   if (ctx->arq && copied && arqFlush(ctx))
+      queue_work(system_wq, &container_of(ctx->port, struct decode_channel, tty)->ackWork);
+   if (ctx->carryLen>=ctx->codec->outBlock && copied && room(ctx))
+      decodeTemp(ctx, ctx->carryLen);        // go on with a frame that had to wait for this room
+   if (ctx->stalled && copied){
+      ctx->stalled = false;
+      codec_tty_rx_resume(ctx->port);        // the serial port has been holding bytes for us
+   }
+   mutex_unlock(&ctx->lock);
+   if (!copied){
+      pr_debug("Decode: Failed to send characters to the user\n");
       return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
    }
+   wake_up_interruptible(&ctx->writeWait);
+   pr_debug("Decode: Sent %zu characters to the user\n", copied);
+   return copied;
+}
+
+/** @brief Acts on a complete control frame from the encoder. On a switch the stream changes to
+ *  the new level's code right away, since the encoder codes everything after the frame with it,
+ *  and adaptWork is run at once to follow with the baud rate. Streams not fed by an adaptive
+ *  serial port ignore control frames.
+ *  @param ctx The stream, locked
+ *  @return returns true if the code changed
+ */
+static bool ctrlReceive(struct decode_ctx *ctx){
+   const struct uart_ctrl *msg = (const struct uart_ctrl *)ctx->bondBuf;
+
+   if (!adapt || !ctx->port || !uart_ctrl_valid(msg) || msg->type!=UART_CTRL_SWITCH || msg->level>=CODEC_LADDER_LEN)
+      return false;
+   ctx->adaptLevel = msg->level;
+   ctx->codec = codec_get(codec_ladder[msg->level].codec);
+   mod_delayed_work(system_wq, &container_of(ctx->port, struct decode_channel, tty)->adaptWork, 0);
+   return true;
+}
+
+/** @brief Delivers the frames of a link with arq that are next in order, as far as there is room
+ *  for them in the stream buffer. Called with the stream locked.
+ *  @return returns true if any were delivered
+ */
+static bool arqFlush(struct decode_ctx *ctx){
+   struct arq_rx *a = ctx->arq;
+   struct arq_slot *slot = &a->slots[a->next%ARQ_WINDOW];
+   bool delivered = false;
+
+   while ((a->held & 1) && kfifo_avail(&ctx->fifo)>=slot->len){
+      kfifo_in(&ctx->fifo, slot->data, slot->len);
+      mempool_free(slot->data, framePool);
+      a->held >>= 1;
+      slot = &a->slots[++a->next%ARQ_WINDOW];
+      delivered = true;
+   }
+   return delivered;
+}
+
+/** @brief Gives the buffers of all frames held behind a gap back to framePool */
+static void arqDrop(struct arq_rx *a){
+   unsigned int i;
+
+   for (i = 0; i<ARQ_WINDOW; i++)
+      if (a->held & BIT(i))
+         mempool_free(a->slots[(u16)(a->next + i)%ARQ_WINDOW].data, framePool);
+   a->held = 0;
+}
+
+/** @brief Takes in a data frame of a link with arq. Frames already delivered are only
+ *  acknowledged again, as the last acknowledgement did not get through. A frame no encoder can
+ *  have sent with its window means the encoder was reloaded, and the stream starts over from it.
+ *  A frame behind a gap that finds framePool empty is left for the encoder to send again.
+ *  @param ctx The stream, locked
+ *  @param seq The frame's sequence number
+ *  @param data Its payload
+ *  @param len The number of payload bytes, at most BOND_CHUNK
+ */
+static void arqReceive(struct decode_ctx *ctx, u16 seq, const u8 *data, size_t len){
+   struct arq_rx *a = ctx->arq;
+   struct arq_slot *slot = &a->slots[seq%ARQ_WINDOW];
+   u16 d = seq - a->next;
+
+   if (d>=ARQ_WINDOW && (u16)(a->next - seq)>ARQ_WINDOW){
+      arqDrop(a);
+      a->next = seq;
+      d = 0;
+   }
+   if (!d && !(a->held & 1) && kfifo_avail(&ctx->fifo)>=len){   // the next one, straight through
+      kfifo_in(&ctx->fifo, data, len);
+      a->held >>= 1;
+      a->next++;
+      arqFlush(ctx);
+   }
+   else if (d<ARQ_WINDOW && !(a->held & BIT(d)) && (slot->data = mempool_alloc(framePool, GFP_NOWAIT | __GFP_NOWARN))){
+      slot->len = len;
+      memcpy(slot->data, data, len);
+      a->held |= BIT(d);
+   }
+   queue_work(system_wq, &container_of(ctx->port, struct decode_channel, tty)->ackWork);
+}
+
+/** @brief Warns about a gap in the sequence numbers of a link's frames */
+static void seqCheck(struct decode_ctx *ctx, u16 seq){
+   if (ctx->seqValid && seq!=ctx->nextSeq)
+      printk_ratelimited(KERN_INFO "Decode: expected frame %u but got %u\n", ctx->nextSeq, seq);
+   ctx->nextSeq = seq + 1;
+   ctx->seqValid = true;
+}
+
+/** @brief Counts a frame dropped for its CRC on this CPU */
+static void statsCrc(void){
+   struct decode_stats *st = get_cpu_ptr(decodeStats);
+
+   u64_stats_update_begin(&st->syncp);
+   st->crcErrors++;
+   u64_stats_update_end(&st->syncp);
+   put_cpu_ptr(decodeStats);
+}
+
+/** @brief Records the latencies of a time stamped frame that has just been delivered. Bytes the
+ *  serial port passed on are decoded at once, so the wire stage ends when the push holding the
+ *  frame's end arrived. Times that run backwards come from an encoder on another machine and are
+ *  not counted.
+ *  @param ctx The stream
+ *  @param st The frame's trailer
+ */
+static void frameLatency(struct decode_ctx *ctx, const u8 *st){
+   u64 written = get_unaligned_le64(st + offsetof(struct uart_stamp, written));
+   u64 encoded = get_unaligned_le64(st + offsetof(struct uart_stamp, encoded));
+   u64 now = ktime_get_ns();
+
+   if (written>encoded || encoded>now)
+      return;
+   if (ctx->rxTime>=encoded){
+      codec_hist_add(&histWire, ctx->rxTime - encoded);
+      codec_hist_add(&histDecode, now - ctx->rxTime);
+   }
+   codec_hist_add(&histTotal, now - written);
+}
+
+/** @brief Decompresses the payload of a UART_FRAME_LZ4 frame in bondBuf into lz4Buf
+ *  @param ctx The stream, locked
+ *  @param len The number of compressed bytes
+ *  @return returns the number of bytes it decompressed to, or a negative error if it is damaged
+ *  or the kernel has no LZ4
+ */
+static int lz4Unpack(struct decode_ctx *ctx, size_t len){
+#if IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+   return LZ4_decompress_safe(ctx->bondBuf, ctx->lz4Buf, len, BOND_CHUNK);
+#else
+   return -EOPNOTSUPP;
+#endif
+}
+
+/** @brief Returns whether the stream buffer has room for what the held frame delivers once it is
+ *  complete, a whole chunk if it is compressed. Frames for ctrlReceive(), the bonded stream and
+ *  arq do not go there.
+ *  @param ctx The stream, locked
+ */
+static bool frameFits(struct decode_ctx *ctx){
+   const struct uart_frame_hdr *hdr = &ctx->frameHdr;
+
+   if ((hdr->flags & (UART_FRAME_CTRL | UART_FRAME_BOND)) || ctx->arq)
+      return true;
+   return kfifo_avail(&ctx->fifo)>=(hdr->flags & UART_FRAME_LZ4 ? BOND_CHUNK : uart_frame_len(hdr));
+}
+
+/** @brief Hands on a held frame once all of it is in bondBuf. A frame whose CRC does not match is
+ *  dropped and counted, which on an adaptive link also weighs like a block beyond repair. A
+ *  compressed one is decompressed first. The others go to ctrlReceive(), the bonded stream, the
+ *  reorder window of arq or the stream buffer.
+ *  @param ctx The stream, locked
+ *  @return returns true if a control frame switched the stream to another code
+ */
+static bool frameDone(struct decode_ctx *ctx){
+   const struct uart_frame_hdr *hdr = &ctx->frameHdr;
+   size_t len = uart_frame_len(hdr);
+   size_t n = hdr->flags & UART_FRAME_TIME ? len + UART_FRAME_STAMP_SIZE : len;
+   u16 seq = uart_frame_seq(hdr);
+   const u8 *data = ctx->bondBuf;
+   size_t size = len;
+   int unpacked;
+
+   ctx->bondLen = 0;   // handed on now, room() no longer has to keep space for it
+   if ((hdr->flags & UART_FRAME_CRC) && get_unaligned_le32(ctx->bondBuf + n)!=codec_frame_crc(hdr, ctx->bondBuf, n)){
+      statsCrc();
+      ctx->adaptBad++;
+      return false;
+   }
+   if (hdr->flags & UART_FRAME_CTRL)
+      return len==sizeof(struct uart_ctrl) && ctrlReceive(ctx);
+   if (len>BOND_CHUNK)
+      return false;   // not from our encoder
+   if (hdr->flags & UART_FRAME_LZ4){
+      unpacked = lz4Unpack(ctx, len);
+      if (unpacked<0){
+         printk_ratelimited(KERN_INFO "Decode: dropped frame %u, its payload does not decompress (%d)\n", seq, unpacked);
+         ctx->adaptBad++;
+         return false;
+      }
+      data = ctx->lz4Buf;
+      size = unpacked;
+   }
+   if (hdr->flags & UART_FRAME_BOND)   // numbered across all links, the link's own numbering does not see it
+      bondReceive(seq, data, size);
+   else if (ctx->arq)
+      arqReceive(ctx, seq, data, size);
+   else {
+      seqCheck(ctx, seq);
+      kfifo_in(&ctx->fifo, data, size);   // deframe() made sure of the room, see frameFits()
+   }
+   if (hdr->flags & UART_FRAME_TIME)
+      frameLatency(ctx, ctx->bondBuf + len);
+   return false;
+}
+
+/** @brief Feeds decoded bytes through the frame parser. Bytes are skipped until a valid header is
+ *  found, then exactly the number of payload bytes it announces go into the stream buffer. A header
+ *  that fails its check is rescanned from its second byte so a stray magic byte costs nothing.
+ *  Frames with any flag, and all of them with arq, are held in bondBuf until frameDone() has
+ *  looked at them. The last byte of a held frame is only taken once what the frame delivers fits
+ *  in the stream buffer, and payload bytes only as far as they fit, so frames that decompress to
+ *  more than they came in never overfill it.
+ *  @param ctx The stream, locked
+ *  @param data The decoded bytes
+ *  @param n The number of decoded bytes
+ *  @return returns n, or where a control frame ended that switched the stream to another code,
+ *  as the bytes after it were decoded with the wrong one, or where it stopped at a frame that
+ *  does not fit yet
+ */
+static size_t deframe(struct decode_ctx *ctx, const u8 *data, size_t n){
+   struct uart_frame_hdr *hdr = (struct uart_frame_hdr *)ctx->hdrBuf;
+   u8 rescan[UART_FRAME_HDR_SIZE - 1];
+   size_t total = n;
+   size_t take;
+
+   while (n){
+      if (ctx->payloadLeft){
+         take = min(n, (size_t)ctx->payloadLeft);
+         if (!ctx->held)
+            take = min(take, (size_t)kfifo_avail(&ctx->fifo));   // a frame decompressed before may have used the room
+         else if (take==ctx->payloadLeft && !frameFits(ctx))
+            take--;   // the last byte waits for readers to make room
+         if (!take){
+            ctx->full = true;
+            return total - n;
+         }
+         if (!ctx->held)
+            kfifo_in(&ctx->fifo, data, take);
+         else {
+            memcpy(ctx->bondBuf + ctx->bondLen, data, take);
+            ctx->bondLen += take;
+         }
+         ctx->payloadLeft -= take;
+         data += take;
+         n -= take;
+         if (ctx->held && !ctx->payloadLeft && frameDone(ctx))
+            return total - n;
+         continue;
+      }
+      if (!ctx->hdrLen && *data!=UART_FRAME_MAGIC){   // hunt for the start of a frame
+         data++;
+         n--;
+         continue;
+      }
+      ctx->hdrBuf[ctx->hdrLen++] = *data++;
+      n--;
+      if (ctx->hdrLen<UART_FRAME_HDR_SIZE)
+         continue;
+      ctx->hdrLen = 0;
+      if (!uart_frame_valid(hdr)){
+         // can not complete another header from these bytes, so this does not recurse again
+         memcpy(rescan, ctx->hdrBuf + 1, sizeof(rescan));
+         deframe(ctx, rescan, sizeof(rescan));
+         continue;
+      }
+      ctx->payloadLeft = uart_frame_len(hdr);
+      ctx->adaptSeen = true;
+      ctx->held = hdr->flags || ctx->arq;
+      if (ctx->held){
+         ctx->frameHdr = *hdr;
+         ctx->bondLen = 0;
+         if (hdr->flags & UART_FRAME_TIME)
+            ctx->payloadLeft += UART_FRAME_STAMP_SIZE;
+         if (hdr->flags & UART_FRAME_CRC)
+            ctx->payloadLeft += UART_FRAME_CRC_SIZE;
+         if (ctx->payloadLeft>sizeof(ctx->bondBuf)){
+            ctx->payloadLeft = 0;   // not from our encoder, rescan for the next frame
+            ctx->held = false;
+         }
+         else if (!ctx->payloadLeft && frameDone(ctx))
+            return total - n;
+         continue;
+      }
+      seqCheck(ctx, uart_frame_seq(hdr));
+   }
+   return total;
+}
+
+/** @brief Adds what one decoding pass did to this CPU's counters and reports it to the tracepoint
+ *  @param in The encoded bytes taken
+ *  @param out The decoded bytes produced
+ *  @param cs What the codec found
+ */
+static void statsAdd(size_t in, size_t out, const struct codec_stats *cs){
+   struct decode_stats *st;
+
+   trace_decode_write(in, out, cs->corrected);
+   st = get_cpu_ptr(decodeStats);
+   u64_stats_update_begin(&st->syncp);
+   st->bytes += out;
+   st->bits += cs->corrected;
+   st->disagree += cs->disagree;
+   u64_stats_update_end(&st->syncp);
+   put_cpu_ptr(decodeStats);
+}
+
+/** @brief Decodes the have bytes at the start of ctx->temp. Every complete codec block is
+ *  decoded, zeros included, and an incomplete one at the end is kept at the start of temp for next
+ *  time. The decoded bytes go to the stream buffer directly or through the frame parser in framed
+ *  mode, and what the codec corrected is added to this CPU's counters. When the parser stops at a
+ *  frame that does not fit, the block it stopped in is kept instead, with how far into it the
+ *  parser got, and the bytes after it are given back. Called with the stream locked and with room
+ *  in its buffer for what the complete blocks decode to, see room().
+ *  @param ctx The stream
+ *  @param have The number of bytes in temp, carried bytes included
+ *  @return returns how many of the last of the have bytes were not taken, for the caller to give
+ *  back to where they came from
+ */
+static size_t decodeTemp(struct decode_ctx *ctx, size_t have){
+   const struct uart_codec *c = ctx->codec;
+   size_t blocks = have/c->outBlock;
+   size_t i = blocks*c->outBlock, out = blocks*c->inBlock;
+   struct codec_stats cs = {0}, again = {0};
+   size_t first = 0, skip = 0, used = out;
+   size_t counted, k, n;
+   bool stop;
+
+   if (ctx->carryLen>=c->outBlock){   // kept by a stop and counted then
+      c->decode(ctx->message, ctx->temp, 1, &again);
+      first = 1;
+      skip = ctx->carryDone;
+   }
+   c->decode(ctx->message + first*c->inBlock, ctx->temp + first*c->outBlock, blocks - first, &cs);   // decode every complete block
+   if (!framed)
+      kfifo_in(&ctx->fifo, ctx->message, out);
+   else
+      used = skip + deframe(ctx, ctx->message + skip, out - skip);
+   stop = ctx->full;
+   ctx->full = false;
+   counted = blocks - first;
+   if (stop){
+      // stopped at a frame that does not fit: the block it stopped in is kept to pick up from the
+      // same byte next time, the blocks after it are given back and not counted
+      k = used/c->inBlock;
+      again = (struct codec_stats){0};
+      c->decode(ctx->message, ctx->temp + (k+1)*c->outBlock, blocks - k - 1, &again);
+      cs.corrected -= again.corrected;
+      cs.disagree -= again.disagree;
+      counted = k + 1 - first;
+   }
+   statsAdd(counted*c->outBlock, counted*c->inBlock, &cs);
+   ctx->adaptBytes += counted*c->inBlock;
+   ctx->adaptBits += cs.corrected;
+   ctx->adaptBad += cs.disagree;
+   if (stop){
+      memmove(ctx->temp, ctx->temp + k*c->outBlock, c->outBlock);
+      ctx->carryLen = c->outBlock;
+      ctx->carryDone = used - k*c->inBlock;
+      return have - (k+1)*c->outBlock;
+   }
+   if (used<out){
+      // a switch ends in its own block, decode the blocks after it again with the new code, as
+      // far as they fit; the rest was never taken
+      i = DIV_ROUND_UP(used, c->inBlock)*c->outBlock;
+      memmove(ctx->temp, ctx->temp + i, have - i);
+      ctx->carryLen = 0;
+      n = min(have - i, room(ctx));
+      return have - i - n + decodeTemp(ctx, n);
+   }
+   ctx->carryLen = have - i;   // keep a split block for the next write
+   memmove(ctx->temp, ctx->temp + i, ctx->carryLen);
+   return 0;
+}
+
+/** @brief Returns how many more encoded bytes a stream can take without overfilling its buffer
+ *  once decoded. Carried bytes that fall short of a block do not add a block of output, a whole
+ *  block kept by decodeTemp() adds what the parser has not been through yet. Called with the
+ *  stream locked.
+ */
+static size_t room(struct decode_ctx *ctx){
+   const struct uart_codec *c = ctx->codec;
+   size_t avail = kfifo_avail(&ctx->fifo);
+   size_t held = ctx->bondLen;
+
+   if (ctx->held && ctx->payloadLeft && (ctx->frameHdr.flags & UART_FRAME_LZ4))
+      held = BOND_CHUNK;   // may decompress to a whole chunk
+   if (ctx->carryLen>=c->outBlock)
+      held += c->inBlock - ctx->carryDone;
+   avail -= min(avail, held);   // a held frame may still go into fifo
+   return avail/c->inBlock*c->outBlock;
 }
 
 /** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is tripple bytewise into the message[] array
- *  LKM using the sprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The data is decoded by decodeTemp() in IN_BUFF_SIZE
+ *  pieces into the file's own stream. While its buffer is full the write sleeps until a reader
+ *  drains it, unless the file is non-blocking in which case it returns what was taken or fails
+ *  with EAGAIN. When the stream comes from the serial port instead, writes are refused.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param from The encoded bytes, user buffers for write and writev or a pipe for splice
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct decode_ctx *ctx = iocb->ki_filp->private_data;
+   size_t len = iov_iter_count(from);
+   size_t done = 0;
+   size_t chunk, left;
+
+   if (ctx->port)
+      return -EBUSY;
+   if (mutex_lock_interruptible(&ctx->lock))
+      return -ERESTARTSYS;
+   while (done<len){
+      // don't overfill the buffer
+      chunk = min3(len - done, (size_t)IN_BUFF_SIZE, room(ctx));
+      if (!chunk){
+         mutex_unlock(&ctx->lock);
+         if (done)
+            wake_up_interruptible(&ctx->readWait);
+         if (iocbNonblock(iocb))
+            return done ? done : -EAGAIN;
+         if (wait_event_interruptible(ctx->writeWait, room(ctx)))   // looked at unlocked, checked again below
+            return done ? done : -ERESTARTSYS;
+         if (mutex_lock_interruptible(&ctx->lock))
+            return done ? done : -ERESTARTSYS;
+         continue;
+      }
+      if (copy_from_iter(ctx->temp + ctx->carryLen, chunk, from)!=chunk){
+         mutex_unlock(&ctx->lock);
+         return done ? done : -EFAULT;   // a partly copied chunk is dropped with the fault
+      }
+      left = decodeTemp(ctx, ctx->carryLen + chunk);
+      iov_iter_revert(from, left);   // not taken after all
+      done += chunk - left;
+   }
+   mutex_unlock(&ctx->lock);
+   wake_up_interruptible(&ctx->readWait);
+   pr_debug("Decode: prepared %zu bytes from UART\n", done);
+   return done;
+}
+
+/** @brief Called from the serial port's receive path every time the driver pushes what its DMA
+ *  or FIFO has received. The bytes are decoded right away, with a split block carried in temp to
+ *  the next call, and readers are woken as soon as they are in the stream buffer. When readers
+ *  fall behind only what fits is taken, also after a switch of code has to decode bytes again;
+ *  the tty layer holds on to the rest and dev_read_iter() asks for it again once it has made room.
+ *  @param priv The shared stream of the channel
+ *  @param data The received bytes
+ *  @param n The number of received bytes
+ *  @return returns the number of bytes taken
+ */
+static size_t ttyReceive(void *priv, const u8 *data, size_t n){
+   struct decode_ctx *ctx = priv;
+   size_t done = 0;
+   size_t chunk, left;
+
+   mutex_lock(&ctx->lock);
+   ctx->rxTime = ktime_get_ns();
+   while (done<n){
+      chunk = min3(n - done, (size_t)IN_BUFF_SIZE, room(ctx));
+      if (!chunk){
+         ctx->stalled = true;
+         break;
+      }
+      memcpy(ctx->temp + ctx->carryLen, data + done, chunk);
+      left = decodeTemp(ctx, ctx->carryLen + chunk);
+      done += chunk - left;
+      if (left){
+         ctx->stalled = true;   // the tty layer passes the rest again once readers made room
+         break;
+      }
+   }
+   mutex_unlock(&ctx->lock);
+   if (done)
+      wake_up_interruptible(&ctx->readWait);
+   return done;
+}
+
+/** @brief Runs every adapt_interval on a channel of an adaptive link, and at once after a switch.
+ *  It follows a switch with the port's baud rate, falls back to level 0 when no valid frame has
+ *  arrived for ADAPT_TIMEOUT intervals, and otherwise judges the interval by the corrected error
+ *  rate: an uncorrectable block or more than adapt_down_ppm asks for the level below, and after
+ *  ADAPT_CLEAN intervals with traffic below adapt_up_ppm it asks for the one above. After a step
+ *  down it holds off four times as long before trying that level again. The result goes back to
+ *  the encoder in a UART_CTRL_REPORT frame.
+ *  @param work The adaptWork of a channel
+ */
+static void adaptWork(struct work_struct *work){
+   struct decode_channel *ch = container_of(to_delayed_work(work), struct decode_channel, adaptWork);
+   struct decode_ctx *ctx = ch->ttyCtx;
+   u8 frame[UART_FRAME_HDR_SIZE + sizeof(struct uart_ctrl)];
+   u64 bytes, bits, bad;
+   unsigned int level;
+   bool seen;
+
+   mutex_lock(&ctx->lock);
+   bytes = ctx->adaptBytes;
+   bits = ctx->adaptBits;
+   bad = ctx->adaptBad;
+   seen = ctx->adaptSeen;
+   ctx->adaptBytes = ctx->adaptBits = ctx->adaptBad = 0;
+   ctx->adaptSeen = false;
+   ch->adaptQuiet = seen ? 0 : ch->adaptQuiet + 1;
+   if (ctx->adaptLevel && ch->adaptQuiet>=ADAPT_TIMEOUT){   // the encoder gives up on us at the same time
+      ctx->adaptLevel = 0;
+      ctx->codec = codec_get(codec_ladder[0].codec);
+      ctx->carryLen = 0;
+      ch->adaptClean = -3*ADAPT_CLEAN;
+   }
+   level = ctx->adaptLevel;
+   mutex_unlock(&ctx->lock);
+
+   if (level!=ch->baudLevel){   // the counters are from both levels, judge the next interval instead
+      ch->baudLevel = level;
+      ch->adaptWant = level;
+      ch->adaptQuiet = 0;
+      codec_tty_set_baud(&ch->tty, codec_ladder[level].baud);
+      printk(KERN_INFO "Decode: channel %u now at level %u, %s at %u baud\n", ch->index, level,
+             ctx->codec->name, codec_ladder[level].baud);
+   }
+   else if (bad || bits*1000000>(u64)READ_ONCE(adapt_down_ppm)*bytes*8){
+      ch->adaptClean = -3*ADAPT_CLEAN;
+      ch->adaptWant = level ? level - 1 : 0;
+   }
+   else if (ch->adaptWant==level && bytes>=ADAPT_MIN_BYTES && bits*1000000<=(u64)READ_ONCE(adapt_up_ppm)*bytes*8 &&
+            ++ch->adaptClean>=ADAPT_CLEAN){
+      ch->adaptClean = 0;
+      if (level<READ_ONCE(adapt_max) && level + 1<CODEC_LADDER_LEN)
+         ch->adaptWant = level + 1;
+   }
+
+   uart_frame_init((struct uart_frame_hdr *)frame, UART_FRAME_CTRL, 0, sizeof(struct uart_ctrl));
+   uart_ctrl_init((struct uart_ctrl *)(frame + UART_FRAME_HDR_SIZE), UART_CTRL_REPORT, level, ch->adaptWant);
+   mutex_lock(&ch->backLock);
+   codec_tty_write(&ch->tty, frame, sizeof(frame));
+   mutex_unlock(&ch->backLock);
+   schedule_delayed_work(&ch->adaptWork, msecs_to_jiffies(adapt_interval));
+}
+
+/** @brief Sends the encoder of a link with arq an acknowledgement of everything delivered and
+ *  of the frames waiting behind a missing one. Queued for every data frame that arrives, so one
+ *  acknowledgement covers as many as arrived while the last was sent.
+ *  @param work The ackWork of a channel
+ */
+static void ackWork(struct work_struct *work){
+   struct decode_channel *ch = container_of(work, struct decode_channel, ackWork);
+   struct decode_ctx *ctx = ch->ttyCtx;
+   u8 frame[UART_FRAME_HDR_SIZE + sizeof(struct uart_ack) + UART_FRAME_CRC_SIZE];
+   struct uart_frame_hdr *hdr = (struct uart_frame_hdr *)frame;
+   struct uart_ack *ack = (struct uart_ack *)(frame + UART_FRAME_HDR_SIZE);
+
+   mutex_lock(&ctx->lock);
+   put_unaligned_le16(ctx->arq->next, ack->next);
+   put_unaligned_le32(ctx->arq->held>>1, ack->mask);
+   mutex_unlock(&ctx->lock);
+   uart_frame_init(hdr, UART_FRAME_ACK | UART_FRAME_CRC, 0, sizeof(*ack));
+   put_unaligned_le32(codec_frame_crc(hdr, (u8 *)ack, sizeof(*ack)), frame + UART_FRAME_HDR_SIZE + sizeof(*ack));
+   mutex_lock(&ch->backLock);
+   codec_tty_write(&ch->tty, frame, sizeof(frame));
+   mutex_unlock(&ch->backLock);
+}
+
+/** @brief Called by poll, select and epoll. The file is readable when decoded bytes are waiting
+ *  and writable when its stream buffer has room, which also tells an event loop when the serial
+ *  port has delivered something.
  *  @param filep A pointer to a file object
- *  @param buffer The buffer to that contains the string to write to the device
- *  @param len The length of the array of data that is being passed in the const char buffer
- *  @param offset The offset if required
- */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
-  //don't overfill the buffer
-  if(len>IN_BUFF_SIZE)
-    len=IN_BUFF_SIZE;
-  unsigned long ret;
-  ret=copy_from_user(temp,buffer,len);
-  temp[len-1]='\0';//ensure there is an end on the string
-  short i=0;
-  char first,second,third;//prealocate variables
-  
-  while(temp[i]){//go until null termination
-    first=temp[i];
-    second=temp[i+1];
-    third=temp[i+2];
-    message[i/3]=(first&second&third)|((~first)&second&third)|(first&(~second)&third)|(first&second&(~third));
-    i+=3;
-  }
-  messageSize=i/3;//length is decreased by factor of three
-  printk(KERN_INFO "Decode: prepared message from UART");
-  return len;
+ *  @param wait The poll table to register the wait queues with
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait){
+   struct decode_ctx *ctx = filep->private_data;
+   __poll_t mask = 0;
+
+   poll_wait(filep, &ctx->readWait, wait);
+   poll_wait(filep, &ctx->writeWait, wait);
+   if (!kfifo_is_empty(&ctx->fifo))
+      mask |= EPOLLIN | EPOLLRDNORM;
+   if (!ctx->port && room(ctx))
+      mask |= EPOLLOUT | EPOLLWRNORM;
+   return mask;
+}
+
+/** @brief Decodes one record of a batch straight into its output buffer. In framed mode the record
+ *  has to be one frame as ENC_IOC_SUBMIT_BATCH makes it, a run of blocks starting with the header,
+ *  and only its payload is delivered; otherwise every whole codec block of it is decoded.
+ *  @param c The codec
+ *  @param rec The record, out_len and status are filled in
+ *  @param mask Where the masks of the delivered bytes go with DEC_IOC_SUBMIT_SOFT, or NULL
+ *  @param sc Scratch space
+ *  @param cs Statistics to add to
+ *  @return returns 0, or -EFAULT if an address in the record was bad
+ */
+static int batchDecode(const struct uart_codec *c, struct uart_batch_rec *rec, u8 __user *mask, struct decode_batch *sc, struct codec_stats *cs){
+   const u8 __user *in = u64_to_user_ptr(rec->in);
+   u8 __user *out = u64_to_user_ptr(rec->out);
+   size_t step = sizeof(sc->in)/c->outBlock*c->outBlock;
+   size_t left = rec->in_len;
+   size_t want, chunk, blocks, n, skip = 0;
+   struct uart_frame_hdr hdr;
+
+   rec->out_len = 0;
+   rec->status = 0;
+   if (framed){
+      n = codec_encoded_len(c, UART_FRAME_HDR_SIZE);
+      if (left<n){
+         rec->status = -EBADMSG;
+         return 0;
+      }
+      if (copy_from_user(sc->in, in, n))
+         return -EFAULT;
+      c->decode(sc->out, sc->in, n/c->outBlock, NULL);   // a look at the header, decoded again below
+      memcpy(&hdr, sc->out, sizeof(hdr));
+      want = uart_frame_len(&hdr);
+      if (!uart_frame_valid(&hdr) || codec_encoded_len(c, UART_FRAME_HDR_SIZE + want)>left){
+         rec->status = -EBADMSG;
+         return 0;
+      }
+      left = codec_encoded_len(c, UART_FRAME_HDR_SIZE + want);
+      skip = UART_FRAME_HDR_SIZE;
+   }
+   else {
+      left -= left%c->outBlock;
+      want = left/c->outBlock*c->inBlock;
+   }
+   if (want>rec->out_cap){
+      rec->out_len = want;
+      rec->status = -EMSGSIZE;
+      return 0;
+   }
+   while (left){
+      chunk = min(left, step);
+      if (copy_from_user(sc->in, in, chunk))
+         return -EFAULT;
+      blocks = chunk/c->outBlock;
+      if (mask)
+         c->soft(sc->out, sc->mask, sc->in, blocks, cs);
+      else
+         c->decode(sc->out, sc->in, blocks, cs);
+      n = min(blocks*c->inBlock - skip, want-rec->out_len);   // the padding of the last block is dropped
+      if (copy_to_user(out, sc->out + skip, n) || (mask && copy_to_user(mask, sc->mask + skip, n)))
+         return -EFAULT;
+      if (mask)
+         mask += n;
+      skip = 0;
+      in += chunk;
+      out += n;
+      left -= chunk;
+      rec->out_len += n;
+   }
+   return 0;
+}
+
+/** @brief Handles DEC_IOC_SUBMIT_BATCH and DEC_IOC_SUBMIT_SOFT: decodes every record of the batch
+ *  with the file's codec, writing the output length and status of each back into its descriptor.
+ *  The file's stream and any partial block carried by it are left alone, so no lock is needed.
+ *  @param ctx The file's state
+ *  @param b The batch, b->done is filled in
+ *  @param soft Whether the records are struct uart_soft_rec and want their masks
+ *  @return returns 0, or a negative error if not even the first record could be handled
+ */
+static long submitBatch(struct decode_ctx *ctx, struct uart_batch *b, bool soft){
+   struct uart_batch_rec __user *recs = u64_to_user_ptr(b->recs);
+   struct uart_soft_rec __user *softRecs = u64_to_user_ptr(b->recs);
+   const struct uart_codec *c = READ_ONCE(ctx->codec);
+   struct codec_stats cs = {0};
+   struct uart_batch_rec __user *r;
+   struct uart_soft_rec rec = {0};
+   struct decode_batch *sc;
+   size_t in = 0, out = 0;
+
+   if (soft && !c->soft)
+      return -EOPNOTSUPP;
+   sc = mempool_alloc(batchPool, GFP_KERNEL);          // waits for one rather than failing
+   for (b->done = 0; b->done<b->count; b->done++){
+      r = soft ? &softRecs[b->done].rec : recs+b->done;
+      if (copy_from_user(&rec.rec, r, sizeof(rec.rec)) || (soft && get_user(rec.mask, &softRecs[b->done].mask)))
+         break;
+      if (batchDecode(c, &rec.rec, soft ? u64_to_user_ptr(rec.mask) : NULL, sc, &cs))
+         break;
+      if (put_user(rec.rec.out_len, &r->out_len) || put_user(rec.rec.status, &r->status))
+         break;
+      if (!rec.rec.status){
+         in += rec.rec.in_len;
+         out += rec.rec.out_len;
+      }
+   }
+   mempool_free(sc, batchPool);
+   if (in)
+      statsAdd(in, out, &cs);
+   return b->done || !b->count ? 0 : -EFAULT;
+}
+
+/** @brief Handles the codec and batch ioctl calls defined in uartcodec.h. Switching codec drops the bytes
+ *  of an incomplete block of the old code; in tty mode it switches the shared stream.
+ *  @param filep A pointer to a file object
+ *  @param cmd The request
+ *  @param arg The request's argument, a user pointer
+ *  @return returns 0 if successful
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct decode_ctx *ctx = filep->private_data;
+   const struct uart_codec *c;
+   struct uart_batch batch;
+   long ret;
+   u32 id;
+
+   switch (cmd){
+   case UART_IOC_SET_CODEC:
+      if (get_user(id, (u32 __user *)arg))
+         return -EFAULT;
+      c = codec_get(id);
+      if (!c)
+         return -EINVAL;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      if (c != ctx->codec)
+         ctx->carryLen = 0;
+      WRITE_ONCE(ctx->codec, c);
+      mutex_unlock(&ctx->lock);
+      wake_up_interruptible(&ctx->writeWait);   // the room needed may have shrunk
+      return 0;
+   case UART_IOC_GET_CODEC:
+      return put_user(READ_ONCE(ctx->codec)->id, (u32 __user *)arg);
+   case DEC_IOC_SUBMIT_BATCH:
+   case DEC_IOC_SUBMIT_SOFT:
+      if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+         return -EFAULT;
+      if (batch.count>UART_BATCH_MAX)
+         return -EINVAL;
+      ret = submitBatch(ctx, &batch, cmd == DEC_IOC_SUBMIT_SOFT);
+      if (put_user(batch.done, &((struct uart_batch __user *)arg)->done))
+         ret = -EFAULT;
+      return ret;
+   default:
+      return -ENOTTY;
+   }
 }
 
 /** @brief The device release function that is called whenever the device is closed/released by
- *  the userspace program
+ *  the userspace program. A file's own stream goes away with it, the shared one stays.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep){
-   printk(KERN_INFO "Decode: Device successfully closed\n");
+   struct decode_ctx *ctx = filep->private_data;
+
+   if (!ctx->port)
+      ctxFree(ctx);
+   pr_debug("Decode: Device successfully closed\n");
    return 0;
 }
 
+/** @brief Adds up the counters of every CPU
+ *  @param sum Where the totals go
+ */
+static void statsSum(struct decode_stats *sum){
+   struct decode_stats *st;
+   u64 bytes, bits, disagree, crcErrors;
+   unsigned int start;
+   int cpu;
+
+   sum->bytes = sum->bits = sum->disagree = sum->crcErrors = 0;
+   for_each_possible_cpu(cpu){
+      st = per_cpu_ptr(decodeStats, cpu);
+      do {
+         start = u64_stats_fetch_begin(&st->syncp);
+         bytes = st->bytes;
+         bits = st->bits;
+         disagree = st->disagree;
+         crcErrors = st->crcErrors;
+      } while (u64_stats_fetch_retry(&st->syncp, start));
+      sum->bytes += bytes;
+      sum->bits += bits;
+      sum->disagree += disagree;
+      sum->crcErrors += crcErrors;
+   }
+}
+
+/** @brief Adds up the counters of every CPU since the last reset
+ *  @param sum Where the totals go
+ *  @return returns the nanoseconds since the last reset
+ */
+static u64 statsRead(struct decode_stats *sum){
+   u64 ns;
+
+   statsSum(sum);
+   spin_lock(&statsLock);
+   sum->bytes -= statsBase.bytes;
+   sum->bits -= statsBase.bits;
+   sum->disagree -= statsBase.disagree;
+   sum->crcErrors -= statsBase.crcErrors;
+   ns = ktime_to_ns(ktime_sub(ktime_get(), statsSince));
+   spin_unlock(&statsLock);
+   return ns;
+}
+
+/** @brief Shows the decoded bytes produced since the last reset */
+static ssize_t bytes_decoded_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct decode_stats sum;
+
+   statsRead(&sum);
+   return sysfs_emit(buf, "%llu\n", sum.bytes);
+}
+static DEVICE_ATTR_RO(bytes_decoded);
+
+/** @brief Shows the bits corrected since the last reset */
+static ssize_t bits_corrected_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct decode_stats sum;
+
+   statsRead(&sum);
+   return sysfs_emit(buf, "%llu\n", sum.bits);
+}
+static DEVICE_ATTR_RO(bits_corrected);
+
+/** @brief Shows the blocks damaged beyond repair, for the repetition code the triplets with three
+ *  different copies, which the vote may have got wrong
+ */
+static ssize_t triplets_disagree_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct decode_stats sum;
+
+   statsRead(&sum);
+   return sysfs_emit(buf, "%llu\n", sum.disagree);
+}
+static DEVICE_ATTR_RO(triplets_disagree);
+
+/** @brief Shows the number of frames dropped because their CRC did not match */
+static ssize_t crc_errors_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct decode_stats sum;
+
+   statsRead(&sum);
+   return sysfs_emit(buf, "%llu\n", sum.crcErrors);
+}
+static DEVICE_ATTR_RO(crc_errors);
+
+/** @brief Shows the average decoded bytes per second since the last reset */
+static ssize_t throughput_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct decode_stats sum;
+   u64 ns = statsRead(&sum);
+
+   return sysfs_emit(buf, "%llu\n", ns ? mul_u64_u64_div_u64(sum.bytes, NSEC_PER_SEC, ns) : 0);
+}
+static DEVICE_ATTR_RO(throughput);
+
+/** @brief Starts the counters again from zero when anything is written. The per-CPU counters are
+ *  left alone, which would race with the decoders, and the current sums are remembered instead.
+ */
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct decode_stats sum;
+
+   statsSum(&sum);
+   spin_lock(&statsLock);
+   statsBase.bytes = sum.bytes;
+   statsBase.bits = sum.bits;
+   statsBase.disagree = sum.disagree;
+   statsBase.crcErrors = sum.crcErrors;
+   statsSince = ktime_get();
+   spin_unlock(&statsLock);
+   return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *statsAttrs[] = {
+   &dev_attr_bytes_decoded.attr,
+   &dev_attr_bits_corrected.attr,
+   &dev_attr_triplets_disagree.attr,
+   &dev_attr_crc_errors.attr,
+   &dev_attr_throughput.attr,
+   &dev_attr_reset.attr,
+   NULL,
+};
+
+static const struct attribute_group statsGroup = {
+   .name = "stats",                  // /sys/class/dec/UARTdecode/stats/
+   .attrs = statsAttrs,
+};
+
+static const struct attribute_group *decodeGroups[] = {
+   &statsGroup,
+   NULL,
+};
+
 /** @brief A module must use the module_init() module_exit() macros from linux/init.h, which
  *  identify the initialization function at insertion time and the cleanup function (as
  *  listed above)
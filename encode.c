@@ -3,7 +3,7 @@
  * @author Matthew Callahan from Derek Molloy
  * @date   11 November 2021
  * @version 0.1
- * @brief   A module to write to UART with a three repeat code 
+ * @brief   A module to write to UART with a three repeat code or another error correcting code
  * based on introductory code from Derek Molloy.
  * @see http://www.derekmolloy.ie/ for a full description and follow-up descriptions.
  */
@@ -14,10 +14,38 @@
 #include <linux/kernel.h>         // Contains types, macros, functions for the kernel
 #include <linux/fs.h>             // Header for the Linux file system support
 #include <linux/uaccess.h>          // Required for the copy to user function
+#include <linux/kfifo.h>          // Ring buffer holding the encoded stream
+#include <linux/mutex.h>          // Serializes writers and readers of the ring buffer
+#include <linux/slab.h>           // Per open file state and the cache of frame buffers
+#include <linux/mempool.h>        // Frame buffers set aside for arq
+#include <linux/vmalloc.h>        // Memory of the shared ring
+#include <linux/mm.h>             // Mapping the shared ring into userspace
+#include <linux/log2.h>           // is_power_of_2()
+#include <linux/kthread.h>        // Thread sending the stream to the serial port
+#include <linux/workqueue.h>      // Encoding for the serial port off the writers' path
+#include <linux/wait.h>           // Wait queues for blocking reads and writes
+#include <linux/poll.h>           // poll/select support
+#include <linux/delay.h>          // msleep() while the decoder follows a switch
+#include <linux/ktime.h>          // Time stamps of the frames with stamp
+#include <linux/lz4.h>            // Compressing the frames with compress
+#include <asm/unaligned.h>        // The CRC and acknowledgement fields
+#include "uartcodec.h"            // Frame format shared with the decoder
+#include "codec.h"                // Codecs from the uartcodec module
+#include "codec_trace.h"          // Tracepoints of the hot path
 
 
 #define  DEVICE_NAME "UARTencode"    ///< The device will appear at /dev/UARTencode using this value
 #define  CLASS_NAME  "enc"        ///< The device class -- this is a character device driver
+#define  IN_CHUNK    1024         ///< Plaintext bytes copied from userspace and encoded per pass
+#define  RING_MAX    (16 << 20)   ///< Largest region of a shared ring
+#define  TRAILER_SIZE (UART_FRAME_STAMP_SIZE+UART_FRAME_CRC_SIZE) ///< Room a payload needs after it for the time stamp and CRC
+#define  TX_BUF_SIZE (3*(UART_FRAME_HDR_SIZE+IN_CHUNK+TRAILER_SIZE)+2*CODEC_MAX_BLOCK) ///< Encoded bytes in each of the two buffers sent to the serial port, a chunk in the costliest code with padding
+#define  MAX_CHANNELS 4           ///< Most UARTs one module drives, one minor number each
+#define  BOND_MINOR  MAX_CHANNELS ///< Minor number of /dev/UARTbondtx0
+#define  ADAPT_TIMEOUT 4          ///< Intervals without a report from the decoder before falling back to level 0
+#define  ADAPT_GUARD 20           ///< Milliseconds to wait after switching levels, while the decoder follows
+#define  ARQ_WINDOW  32           ///< Frames sent and not yet acknowledged, the bits of an acknowledgement
+#define  ARQ_WARN    8            ///< Tries of a frame after which each one is logged
 
 
 MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
@@ -25,33 +53,256 @@ MODULE_AUTHOR("Matthew Callahan");    ///< The author -- visible when you use mo
 MODULE_DESCRIPTION("A device to encode repeat code messages with a character device");  ///< The description -- see modinfo
 MODULE_VERSION("0.1");            ///< A version number to inform users
 
+static unsigned int fifo_size = 65536;      ///< Size in bytes of the encoded stream buffer, rounded up to a power of two
+module_param(fifo_size, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_size, "Size in bytes of the encoded output ring buffer (default 65536)");
+static bool framed = false;                 ///< Put a length/sequence header in front of every chunk
+module_param(framed, bool, S_IRUGO);
+MODULE_PARM_DESC(framed, "Send each write as length-prefixed frames for byte exact binary data (default 0)");
+
+static char  *codec = "repeat3";            ///< Name of the code files start out with
+module_param(codec, charp, S_IRUGO);
+MODULE_PARM_DESC(codec, "Error correcting code, repeat3, repeat3i, hamming74, secded84 or rs255 (default repeat3)");
+
+static char  *tty = "";                     ///< Serial port the encoded stream is sent to, empty to read it from the device instead
+module_param(tty, charp, S_IRUGO);
+MODULE_PARM_DESC(tty, "Serial port to send the encoded stream to, e.g. /dev/ttyS4 (default none)");
+static char  *ttys[MAX_CHANNELS];           ///< Serial ports of the channels, ttys[0] overriding tty
+static int    numTtys;                      ///< Number of entries given in ttys
+module_param_array(ttys, charp, &numTtys, S_IRUGO);
+MODULE_PARM_DESC(ttys, "Serial ports of channels 0, 1, ... e.g. /dev/ttyS4,/dev/ttyS1, empty for a channel read through its device (default tty for channel 0)");
+static unsigned int channels = 1;           ///< Number of devices, at least one per entry of ttys
+module_param(channels, uint, S_IRUGO);
+MODULE_PARM_DESC(channels, "Number of channels, /dev/UARTencode then /dev/UARTencode1 and up (default 1, or as many as ttys lists)");
+static bool bond = false;                   ///< Spread /dev/UARTbondtx0 over all channels with a serial port
+module_param(bond, bool, S_IRUGO);
+MODULE_PARM_DESC(bond, "Create /dev/UARTbondtx0, whose writes are spread over all channels with a serial port, needs framed=1 (default 0)");
+static bool adapt = false;                  ///< Let the decoder's reports pick the code and baud rate of every serial port
+module_param(adapt, bool, S_IRUGO);
+MODULE_PARM_DESC(adapt, "Step the serial ports' code and baud rate up and down as the decoder asks, needs framed=1 (default 0)");
+static unsigned int adapt_max = CODEC_LADDER_LEN-1; ///< Highest level of the rate ladder to go to
+module_param(adapt_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adapt_max, "Highest level of the rate ladder, 0 to 7 (default 7, rs255 at 3686400 baud)");
+static unsigned int adapt_interval = 250;   ///< Milliseconds between control frames
+module_param(adapt_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(adapt_interval, "Milliseconds between control frames, the same on both ends (default 250)");
+static bool crc = false;                    ///< Follow every frame sent to a serial port with a CRC32
+module_param(crc, bool, S_IRUGO);
+MODULE_PARM_DESC(crc, "Follow every frame sent to a serial port with a CRC32, so the decoder drops what the code could not repair, needs framed=1 (default 0)");
+static bool arq = false;                    ///< Send frames again until the decoder acknowledges them
+module_param(arq, bool, S_IRUGO);
+MODULE_PARM_DESC(arq, "Keep the frames sent to every serial port until the decoder acknowledges them and send lost ones again, sets crc (default 0)");
+static unsigned int arq_timeout = 1000;     ///< Milliseconds without an acknowledgement before sending everything unacknowledged again
+module_param(arq_timeout, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(arq_timeout, "Milliseconds without a new acknowledgement before all unacknowledged frames are sent again (default 1000)");
+static bool stamp = false;                  ///< Time stamp the frames sent to a serial port and record latencies
+module_param(stamp, bool, S_IRUGO);
+MODULE_PARM_DESC(stamp, "Send every frame to a serial port with the times it was written and encoded, and record the encoder's latencies in debugfs, needs framed=1 (default 0)");
+static bool compress = false;               ///< Files start out compressing the payload of every frame with LZ4
+module_param(compress, bool, S_IRUGO);
+MODULE_PARM_DESC(compress, "Compress the payload of every frame with LZ4 where that makes it smaller, files can change it with UART_IOC_SET_COMPRESS, needs framed=1 (default 0)");
+static unsigned int frame_pool = 2*ARQ_WINDOW; ///< Frame buffers allocated at load time for arq
+module_param(frame_pool, uint, S_IRUGO);
+MODULE_PARM_DESC(frame_pool, "Buffers for frames waiting for acknowledgement with arq allocated at load time, so sending does not depend on free memory (default 64)");
+
+/** @brief An encoded byte stream and everyone waiting on it. Every open file has one of its own,
+ *  except on a channel in tty mode where all of them feed the one its txTask sends to the serial
+ *  port. That one holds plaintext records instead, see struct tx_rec, which txWork encodes off
+ *  the writers' path.
+ */
+struct encode_stream {
+   struct kfifo fifo;                ///< Encoded bytes waiting to be read or sent, or plaintext records in tty mode
+   struct mutex lock;                ///< Protects fifo and seq
+   wait_queue_head_t readWait;       ///< Where readers (or txTask) sleep while fifo is empty
+   wait_queue_head_t writeWait;      ///< Where writers sleep while fifo is full
+   u16 seq;                          ///< Sequence number of the next frame in framed mode
+   u8 head[CODEC_MAX_BLOCK];         ///< A frame header and the payload bytes sharing its codec block, encoded under lock
+};
+
+struct encode_channel;
+
+/** @brief A ring shared with userspace through mmap, see struct uart_ring_ctrl. The module keeps
+ *  its own copy of the two indices it owns so a misbehaving process can only confuse itself.
+ */
+struct encode_ring {
+   void *area;                       ///< The whole mapping: control page, plaintext region, encoded region
+   struct uart_ring_ctrl *ctrl;      ///< Control block at the start of area
+   u8 *in, *out;                     ///< The plaintext and encoded regions
+   u32 inSize, outSize;              ///< Sizes of the regions, powers of two
+   u32 inTail, outHead;              ///< The indices owned by the module
+   u32 mapSize;                      ///< Size of area
+};
+
+/** @brief What LZ4 compression of a payload works in, allocated where frames may be compressed */
+struct lz4_scratch {
+   u8 mem[LZ4_MEM_COMPRESS];         ///< The compressor's hash table
+   u8 out[IN_CHUNK];                 ///< The compressed payload, kept only if it is shorter
+};
+
+/** @brief The state of one open file, kept in filep->private_data. Everything a write needs is
+ *  here, so writers on different files only meet when they share the tty stream.
+ */
+struct encode_ctx {
+   struct encode_channel *ch;        ///< The channel the file was opened on
+   struct encode_stream *out;        ///< Where the encoded bytes go, own or the channel's ttyStream
+   struct encode_stream own;         ///< This file's stream when not in tty mode
+   struct mutex lock;                ///< Serializes writers sharing this file, protects the scratch buffers and ring
+   struct encode_ring *ring;         ///< The shared ring once ENC_IOC_RING_SETUP has been called
+   const struct uart_codec *codec;   ///< The code writes are encoded with, see UART_IOC_SET_CODEC
+   bool compress;                    ///< Frames are LZ4 compressed, see UART_IOC_SET_COMPRESS
+   struct lz4_scratch *lz4;          ///< Compression scratch of the file's own stream, allocated when compress is first set
+   u8 temp[IN_CHUNK];                ///< One chunk of plaintext copied from userspace
+   u8 message[3*(UART_FRAME_HDR_SIZE+IN_CHUNK)]; ///< The encoded frame header and chunk, sized for the costliest code
+};
+
+/** @brief Header of a chunk of plaintext queued for the serial port, followed in the fifo by its
+ *  len bytes. Each chunk remembers the codec of the file it was written to and becomes one frame.
+ */
+struct tx_rec {
+   const struct uart_codec *codec;   ///< The code to encode the chunk with
+   u32 len;                          ///< Plaintext bytes that follow, at most IN_CHUNK
+   u64 written;                      ///< When the chunk was written, in ktime_get_ns() time, 0 for a control frame
+   u16 seq;                          ///< Sequence number of a bonded frame, the link numbers the others
+   u8 flags;                         ///< UART_FRAME_* flags of the frame header, UART_FRAME_LZ4 asking txWork to try compressing
+};
+
+/** @brief One of the two buffers between txWork and txTask. While txTask sends one, txWork
+ *  encodes into the other, so the codec runs while the line is busy.
+ */
+struct tx_buf {
+   u8 data[TX_BUF_SIZE];             ///< Encoded bytes
+   size_t len;                       ///< Number of bytes in data
+   int level;                        ///< Level of the rate ladder to switch to once data is sent, -1 for none
+   u64 ready;                        ///< When txWork handed it to txTask, with stamp
+};
+
+/** @brief A frame kept for sending again until it is acknowledged */
+struct arq_slot {
+   const struct uart_codec *codec;   ///< The code of the file it was written to
+   u16 len;                          ///< Payload bytes in data
+   u8 flags;                         ///< UART_FRAME_LZ4 if data is compressed
+   bool acked;                       ///< Acknowledged out of order, ahead of the window's start
+   bool resend;                      ///< Waiting for txWork to send it again
+   unsigned int tries;               ///< Times it has been sent
+   u64 written;                      ///< When it was written, sent along again with stamp
+   u8 *data;                         ///< The payload, with room for the trailer, a buffer of framePool
+};
+
+/** @brief The frames a channel with arq has sent and not had acknowledged yet, from base up to
+ *  but not including next. Frame seq is kept in slot seq % ARQ_WINDOW.
+ */
+struct arq_tx {
+   struct mutex lock;                ///< Protects everything below
+   u16 base;                         ///< Oldest frame not acknowledged
+   u16 next;                         ///< The frame after the last one kept
+   unsigned long heard;              ///< When frames were last acknowledged, or sent into an empty window, in jiffies
+   bool starved;                     ///< txWork found framePool empty, arqWork queues it again
+   struct arq_slot slots[ARQ_WINDOW]; ///< The frames
+};
+
+/** @brief One channel: a minor number, its device and, in tty mode, the serial port it sends to
+ *  with the transmit pipeline feeding it
+ */
+struct encode_channel {
+   unsigned int index;               ///< The minor number
+   const char *ttyPath;              ///< The serial port, empty if the channel is read through its device
+   struct device *dev;               ///< The channel's device
+   struct encode_stream ttyStream;   ///< The stream sent to the serial port
+   struct codec_tty tty;             ///< The serial port, tty.file is NULL without one
+   struct task_struct *txTask;       ///< Thread sending the filled buffers to the serial port
+   struct workqueue_struct *txWq;    ///< Runs txWork, one item at a time
+   struct work_struct txWork;        ///< Encodes the records in ttyStream into the free buffer
+   struct tx_buf txBufs[2];          ///< The double buffer, filled by txWork and sent by txTask
+   unsigned int txFill;              ///< The buffer txWork fills next, only touched by txWork
+   unsigned int txSend;              ///< The buffer txTask sends next, only touched by txTask
+   atomic_t txFull;                  ///< Buffers filled and not yet sent, 0 to 2
+   wait_queue_head_t txWait;         ///< Where txTask sleeps until a buffer is filled
+   u8 txTemp[IN_CHUNK+TRAILER_SIZE]; ///< One record's plaintext taken out of ttyStream by txWork, and its trailer
+   u8 txHead[CODEC_MAX_BLOCK];       ///< A frame's header and the plaintext sharing its block
+   struct lz4_scratch *lz4;          ///< Compression scratch of txWork, when framed and the kernel has LZ4
+   unsigned int txLevel;             ///< Level records are encoded at with adapt, only touched by txWork
+   struct delayed_work adaptWork;    ///< Sends a control frame every adapt_interval
+   unsigned int adaptLevel;          ///< Level last announced to the decoder
+   unsigned int adaptWant;           ///< Level the decoder last asked for
+   unsigned long adaptHeard;         ///< When the decoder last reported from adaptLevel, in jiffies
+   u8 ctrlBuf[UART_FRAME_HDR_SIZE+sizeof(struct uart_ack)+UART_FRAME_CRC_SIZE]; ///< A report or acknowledgement from the decoder being received
+   unsigned int ctrlLen;             ///< Number of valid bytes in ctrlBuf
+   unsigned int ctrlNeed;            ///< Size of the frame in ctrlBuf once its header is in
+   struct arq_tx *arq;               ///< The frames waiting for acknowledgement with arq, otherwise NULL
+   struct delayed_work arqTimer;     ///< Sends them again when acknowledgements stop coming
+};
+
 static int    majorNumber;                  ///< Stores the device number -- determined automatically
-static char   message[769] = {0};           ///< Memory for the string that is passed from userspace it accepts a 256 character string which it tripples
-static char temp[256]={0};
-static short  messageSize;              ///< Used to remember the size of the string stored
-static int    numberOpens = 0;              ///< Counts the number of times the device is opened for debugging purposes
+static const struct uart_codec *defaultCodec; ///< The codec named by the codec parameter
+static struct encode_channel *encodeChannels; ///< The channels, numChannels of them
+static unsigned int numChannels;            ///< Number of channels and devices
+static atomic_t numberOpens = ATOMIC_INIT(0); ///< Counts the number of times the device is opened for debugging purposes
 static struct class*  encodeClass  = NULL; ///< The device-driver class struct pointer
-static struct device* encodeDevice = NULL; ///< The device-driver device struct pointer
+static struct device* bondDevice = NULL;    ///< /dev/UARTbondtx0 when bond is set
+static DEFINE_MUTEX(bondLock);              ///< Serializes writers of the bonded stream, protects bondSeq and bondTemp
+static u16    bondSeq;                      ///< Sequence number of the next bonded frame
+static u8     bondTemp[IN_CHUNK];           ///< One chunk of a bonded write copied from userspace
+static struct kmem_cache *frameCache;       ///< Buffers of IN_CHUNK+TRAILER_SIZE bytes for frames in flight
+static mempool_t *framePool;               ///< At least frame_pool of them, set aside at load time with arq
+static struct codec_hist histQueue;         ///< With stamp, from a chunk's write to txWork encoding it
+static struct codec_hist histSend;          ///< With stamp, from txWork filling a buffer to txTask having written it to the tty
 
 
 // The prototype functions for the character driver -- must come before the struct definition
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
+static int     streamInit(struct encode_stream *, unsigned int);
+static void    streamFree(struct encode_stream *);
+static int     txThread(void *);
+static void    txEncode(struct work_struct *);
+static void    adaptWork(struct work_struct *);
+static void    arqWork(struct work_struct *);
+static int     poolInit(void);
+static void    poolExit(void);
+static void    histExit(void);
+static size_t  txBytes(const struct uart_codec *, size_t);
+static size_t  ctrlReceive(void *, const u8 *, size_t);
+static int     channelInit(struct encode_channel *);
+static void    channelExit(struct encode_channel *);
+static size_t  frameBytes(const struct uart_codec *, size_t);
+static ssize_t bond_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t bond_poll(struct file *, poll_table *);
 
 /** @brief Devices are represented as file structure in the kernel. The file_operations structure from
  *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
- *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+ *  using a C99 syntax structure. char devices usually implement open, read, write and release calls.
+ *  The iov_iter versions of read and write also serve readv/writev, and splice goes through them.
  */
 static struct file_operations fops =
 {
    .open = dev_open,
-   .read = dev_read,
-   .write = dev_write,
+   .read_iter = dev_read_iter,
+   .write_iter = dev_write_iter,
+   .splice_read = generic_file_splice_read,
+   .splice_write = iter_file_splice_write,
+   .poll = dev_poll,
+   .unlocked_ioctl = dev_ioctl,
+   .compat_ioctl = compat_ptr_ioctl,
+   .mmap = dev_mmap,
    .release = dev_release,
 };
 
+/** @brief The operations of /dev/UARTbondtx0, which dev_open() switches a file to. It is only
+ *  written, what goes in comes out of /dev/UARTbondrx0 on the other side.
+ */
+static const struct file_operations bondFops =
+{
+   .owner = THIS_MODULE,
+   .write_iter = bond_write_iter,
+   .splice_write = iter_file_splice_write,
+   .poll = bond_poll,
+};
+
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
@@ -59,11 +310,82 @@ static struct file_operations fops =
  *  @return returns 0 if successful
  */
 static int __init encodeInit(void){
+   unsigned int k;
+
    printk(KERN_INFO "Encode: Initializing the Encoding module\n");
 
+   defaultCodec = codec_find(codec);
+   if (!defaultCodec){
+      printk(KERN_ALERT "Encode: unknown codec %s\n", codec);
+      return -EINVAL;
+   }
+
+   // A stream buffer has to fit at least one encoded frame of one byte
+   if (fifo_size<frameBytes(defaultCodec, 1)){
+      printk(KERN_ALERT "Encode: fifo_size must be at least %zu\n", frameBytes(defaultCodec, 1));
+      return -EINVAL;
+   }
+   if (bond && !framed){
+      printk(KERN_ALERT "Encode: bond needs framed=1\n");
+      return -EINVAL;
+   }
+   if (adapt && !framed){
+      printk(KERN_ALERT "Encode: adapt needs framed=1\n");
+      return -EINVAL;
+   }
+   if (arq)
+      crc = true;                            // lost frames are only known as such by their CRC
+   if (crc && !framed){
+      printk(KERN_ALERT "Encode: crc and arq need framed=1\n");
+      return -EINVAL;
+   }
+   if (stamp && !framed){
+      printk(KERN_ALERT "Encode: stamp needs framed=1\n");
+      return -EINVAL;
+   }
+   if (compress && (!framed || !IS_ENABLED(CONFIG_LZ4_COMPRESS))){
+      printk(KERN_ALERT "Encode: compress needs framed=1 and a kernel with CONFIG_LZ4_COMPRESS\n");
+      return -EINVAL;
+   }
+   // Every level has to fit a whole chunk in a transmit buffer
+   for (k = 0; adapt && k < CODEC_LADDER_LEN; k++){
+      const struct uart_codec *c = codec_get(codec_ladder[k].codec);
+      if (!c || txBytes(c, IN_CHUNK)>TX_BUF_SIZE){
+         printk(KERN_ALERT "Encode: level %u of the rate ladder can not be used\n", k);
+         return -EINVAL;
+      }
+   }
+
+   numChannels = max_t(unsigned int, channels, numTtys);
+   if (!numChannels || numChannels>MAX_CHANNELS){
+      printk(KERN_ALERT "Encode: channels must be 1 to %d\n", MAX_CHANNELS);
+      return -EINVAL;
+   }
+   encodeChannels = kcalloc(numChannels, sizeof(*encodeChannels), GFP_KERNEL);
+   if (!encodeChannels)
+      return -ENOMEM;
+   for (k = 0; k < numChannels; k++){
+      encodeChannels[k].index = k;
+      encodeChannels[k].ttyPath = k<numTtys ? ttys[k] : (k ? "" : tty);
+   }
+
+   if (arq && poolInit()){
+      kfree(encodeChannels);
+      return -ENOMEM;
+   }
+   if (stamp && (codec_hist_create(&histQueue, "enc_queue") || codec_hist_create(&histSend, "enc_send"))){
+      histExit();
+      poolExit();
+      kfree(encodeChannels);
+      return -ENOMEM;
+   }
+
    // Try to dynamically allocate a major number for the device -- more difficult but worth it
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
+      histExit();
+      poolExit();
+      kfree(encodeChannels);
       printk(KERN_ALERT "Encode failed to register a major number\n");
       return majorNumber;
    }
@@ -73,21 +395,51 @@ static int __init encodeInit(void){
    encodeClass = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(encodeClass)){                // Check for error and clean up if there is
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      histExit();
+      poolExit();
+      kfree(encodeChannels);
       printk(KERN_ALERT "Failed to register device class\n");
       return PTR_ERR(encodeClass);          // Correct way to return an error on a pointer
    }
    printk(KERN_INFO "Encode: device class registered correctly\n");
 
-   // Register the device driver
-   encodeDevice = device_create(encodeClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(encodeDevice)){               // Clean up if there is an error
-      class_destroy(encodeClass);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to create the device\n");
-      return PTR_ERR(encodeDevice);
+   // Register a device per channel, sending the stream straight to the serial port where one was given
+   for (k = 0; k < numChannels; k++){
+      int err = channelInit(&encodeChannels[k]);
+      if (err){
+         while (k--)
+            channelExit(&encodeChannels[k]);
+         class_destroy(encodeClass);           // Repeated code but the alternative is goto statements
+         unregister_chrdev(majorNumber, DEVICE_NAME);
+         histExit();
+         poolExit();
+         kfree(encodeChannels);
+         return err;
+      }
    }
-   printk(KERN_INFO "Encode: device class created correctly\n"); // Made it! device was initialized
-   return 0;
+   printk(KERN_INFO "Encode: %u device(s) created correctly\n", numChannels);
+
+   // The bonded stream goes out over every channel with a serial port
+   if (bond){
+      for (k = 0; k < numChannels && !encodeChannels[k].tty.file; k++)
+         ;
+      if (k<numChannels)
+         bondDevice = device_create(encodeClass, NULL, MKDEV(majorNumber, BOND_MINOR), NULL, "UARTbondtx0");
+      if (k==numChannels || IS_ERR(bondDevice)){
+         int err = k==numChannels ? -EINVAL : PTR_ERR(bondDevice);
+         bondDevice = NULL;
+         printk(KERN_ALERT "Encode: bond needs a channel with a serial port\n");
+         for (k = 0; k < numChannels; k++)
+            channelExit(&encodeChannels[k]);
+         class_destroy(encodeClass);
+         unregister_chrdev(majorNumber, DEVICE_NAME);
+         histExit();
+         poolExit();
+         kfree(encodeChannels);
+         return err;
+      }
+   }
+   return 0;                                // Made it! device was initialized
 }
 
 /** @brief The LKM cleanup function
@@ -95,84 +447,1303 @@ static int __init encodeInit(void){
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit encodeExit(void){  
-   device_destroy(encodeClass, MKDEV(majorNumber, 0));     // remove the device
+   unsigned int k;
+
+   if (bondDevice)
+      device_destroy(encodeClass, MKDEV(majorNumber, BOND_MINOR));
+   for (k = 0; k < numChannels; k++)
+      channelExit(&encodeChannels[k]);                     // remove the devices and stop sending
    class_unregister(encodeClass);                          // unregister the device class
    class_destroy(encodeClass);                             // remove the device class
    unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   histExit();
+   poolExit();                                             // every frame buffer is back
+   kfree(encodeChannels);
    printk(KERN_INFO "Encode: Goodbye from the LKM!\n");
 }
 
+/** @brief Creates the cache and pool of frame buffers for arq. The pool allocates frame_pool of
+ *  them at once and keeps them for the frames of every channel; more only come from the cache
+ *  when all of those are in flight.
+ *  @return returns 0 if successful
+ */
+static int poolInit(void){
+   frameCache = kmem_cache_create("uartenc_frame", IN_CHUNK+TRAILER_SIZE, 0, 0, NULL);
+   if (!frameCache)
+      return -ENOMEM;
+   framePool = mempool_create_slab_pool(max(frame_pool, 1U), frameCache);
+   if (!framePool){
+      kmem_cache_destroy(frameCache);
+      frameCache = NULL;
+      return -ENOMEM;
+   }
+   return 0;
+}
+
+/** @brief Releases the pool and cache of poolInit(), if it was called */
+static void poolExit(void){
+   mempool_destroy(framePool);
+   kmem_cache_destroy(frameCache);
+}
+
+/** @brief Removes the latency histograms, if stamp created them */
+static void histExit(void){
+   codec_hist_destroy(&histQueue);
+   codec_hist_destroy(&histSend);
+}
+
+/** @brief Gives the buffers of every frame still in flight back to framePool */
+static void arqFree(struct arq_tx *a){
+   u16 seq;
+
+   for (seq = a->base; seq != a->next; seq++)
+      mempool_free(a->slots[seq % ARQ_WINDOW].data, framePool);
+}
+
+/** @brief Creates the device of a channel, /dev/UARTencode for channel 0 and /dev/UARTencodeN for
+ *  the others. If the channel has a serial port, writers only queue their plaintext, which txWork
+ *  encodes into one buffer while txTask sends the other.
+ *  @param ch The channel, with index and ttyPath set
+ *  @return returns 0 if successful
+ */
+static int channelInit(struct encode_channel *ch){
+   int err;
+
+   if (ch->index)
+      ch->dev = device_create(encodeClass, NULL, MKDEV(majorNumber, ch->index), NULL, DEVICE_NAME "%u", ch->index);
+   else
+      ch->dev = device_create(encodeClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
+   if (IS_ERR(ch->dev)){
+      printk(KERN_ALERT "Failed to create the device\n");
+      return PTR_ERR(ch->dev);
+   }
+   if (!ch->ttyPath[0])
+      return 0;
+   if (framed && IS_ENABLED(CONFIG_LZ4_COMPRESS)){
+      ch->lz4 = kvmalloc(sizeof(*ch->lz4), GFP_KERNEL);   // any file may turn compression on
+      if (!ch->lz4){
+         device_destroy(encodeClass, MKDEV(majorNumber, ch->index));
+         return -ENOMEM;
+      }
+   }
+   atomic_set(&ch->txFull, 0);
+   init_waitqueue_head(&ch->txWait);
+   err = streamInit(&ch->ttyStream, max_t(unsigned int, fifo_size, sizeof(struct tx_rec)+IN_CHUNK));
+   if (!err){
+      INIT_WORK(&ch->txWork, txEncode);
+      ch->txWq = alloc_ordered_workqueue(DEVICE_NAME "%u-enc", 0, ch->index);
+      if (!ch->txWq){
+         err = -ENOMEM;
+         streamFree(&ch->ttyStream);
+      }
+   }
+   if (!err){
+      err = codec_tty_open(&ch->tty, ch->ttyPath);
+      if (err){
+         destroy_workqueue(ch->txWq);
+         streamFree(&ch->ttyStream);
+      }
+   }
+   // An adaptive link starts at level 0; the decoder's reports and acknowledgements come back on the same port
+   if (!err && (adapt || arq)){
+      if (arq){
+         ch->arq = kzalloc(sizeof(*ch->arq), GFP_KERNEL);
+         err = ch->arq ? 0 : -ENOMEM;
+      }
+      if (!err && adapt)
+         err = codec_tty_set_baud(&ch->tty, codec_ladder[0].baud);
+      if (!err && arq)
+         mutex_init(&ch->arq->lock);
+      if (!err)
+         err = codec_tty_start_rx(&ch->tty, ctrlReceive, ch);
+      if (err){
+         kfree(ch->arq);
+         ch->arq = NULL;
+         codec_tty_close(&ch->tty);
+         destroy_workqueue(ch->txWq);
+         streamFree(&ch->ttyStream);
+      }
+   }
+   if (!err){
+      ch->txTask = kthread_run(txThread, ch, DEVICE_NAME "%u-tx", ch->index);
+      if (IS_ERR(ch->txTask)){
+         err = PTR_ERR(ch->txTask);
+         ch->txTask = NULL;
+         codec_tty_close(&ch->tty);
+         kfree(ch->arq);
+         ch->arq = NULL;
+         destroy_workqueue(ch->txWq);
+         streamFree(&ch->ttyStream);
+      }
+   }
+   if (err){
+      kvfree(ch->lz4);
+      ch->lz4 = NULL;
+      device_destroy(encodeClass, MKDEV(majorNumber, ch->index));
+      return err;
+   }
+   if (adapt){
+      ch->adaptHeard = jiffies;
+      INIT_DELAYED_WORK(&ch->adaptWork, adaptWork);
+      schedule_delayed_work(&ch->adaptWork, msecs_to_jiffies(adapt_interval));
+   }
+   if (arq){
+      INIT_DELAYED_WORK(&ch->arqTimer, arqWork);
+      schedule_delayed_work(&ch->arqTimer, msecs_to_jiffies(arq_timeout));
+   }
+   printk(KERN_INFO "Encode: channel %u sending the encoded stream to %s\n", ch->index, ch->ttyPath);
+   return 0;
+}
+
+/** @brief Stops sending on a channel and removes its device */
+static void channelExit(struct encode_channel *ch){
+   if (ch->txTask){
+      if (adapt)
+         cancel_delayed_work_sync(&ch->adaptWork);         // no more control frames for txWork
+      codec_tty_stop_rx(&ch->tty);                         // nor acknowledgements
+      if (ch->arq)
+         cancel_delayed_work_sync(&ch->arqTimer);
+      kthread_stop(ch->txTask);                            // stop sending before the port goes away
+      destroy_workqueue(ch->txWq);                         // txTask no longer queues txWork
+      codec_tty_close(&ch->tty);
+      streamFree(&ch->ttyStream);
+      if (ch->arq)
+         arqFree(ch->arq);
+      kfree(ch->arq);
+      kvfree(ch->lz4);
+   }
+   device_destroy(encodeClass, MKDEV(majorNumber, ch->index));
+}
+
+/** @brief Sets up an empty stream
+ *  @param s The stream
+ *  @param size Size of its buffer in bytes, rounded up to a power of two
+ *  @return returns 0 if successful
+ */
+static int streamInit(struct encode_stream *s, unsigned int size){
+   if (kfifo_alloc(&s->fifo, size, GFP_KERNEL))
+      return -ENOMEM;
+   mutex_init(&s->lock);
+   init_waitqueue_head(&s->readWait);
+   init_waitqueue_head(&s->writeWait);
+   s->seq = 0;
+   return 0;
+}
+
+/** @brief Releases the buffer of a stream set up by streamInit() */
+static void streamFree(struct encode_stream *s){
+   kfifo_free(&s->fifo);
+}
+
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  It sets up the state of the new file, which gets its own encoded stream unless the module is
+ *  sending to a serial port.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep){
-   numberOpens++;
+   struct encode_ctx *ctx;
+   struct encode_channel *ch;
+   int opens;
 
-   printk(KERN_INFO "Encode: Device has been opened %d time(s)\n", numberOpens);
+   if (iminor(inodep)==BOND_MINOR && bondDevice){
+      replace_fops(filep, fops_get(&bondFops)); // a writer of the bonded stream, no state of its own
+      return 0;
+   }
+   if (iminor(inodep)>=numChannels)
+      return -ENODEV;
+   ch = &encodeChannels[iminor(inodep)];
+   ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+   if (!ctx)
+      return -ENOMEM;
+   ctx->ch = ch;
+   if (ch->tty.file)
+      ctx->out = &ch->ttyStream;
+   else {
+      if (streamInit(&ctx->own, fifo_size)){
+         kfree(ctx);
+         return -ENOMEM;
+      }
+      ctx->out = &ctx->own;
+   }
+   mutex_init(&ctx->lock);
+   ctx->codec = defaultCodec;
+   ctx->compress = compress;
+   if (compress && !ch->tty.file){
+      ctx->lz4 = kvmalloc(sizeof(*ctx->lz4), GFP_KERNEL);
+      if (!ctx->lz4){
+         streamFree(&ctx->own);
+         kfree(ctx);
+         return -ENOMEM;
+      }
+   }
+   filep->private_data = ctx;
+
+   opens = atomic_inc_return(&numberOpens);
+   pr_debug("Encode: Device has been opened %d time(s)\n", opens);
    return 0;
 }
 
+/** @brief Returns whether a read or write must not sleep */
+static bool iocbNonblock(struct kiocb *iocb){
+   return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
 /** @brief This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- *  @param buffer The pointer to the buffer to which this function writes the data
- *  @param len The length of the b
- *  @param offset The offset if required
- */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, messageSize);
-   int sendLength=messageSize;//store true message length so cat works
-   messageSize=0;//zero message length so message is not repeated
-   if (error_count==0){            // if true then have success
-      printk(KERN_INFO "Encode: Sent %d characters to the user\n",sendLength);
-      return (sendLength);  // clear the position to the start and return 0
+ *  being sent from the device to the user. It drains as many bytes as the iterator has room for,
+ *  encoded by writes to the same file, so a large read returns everything written so far. If
+ *  there is nothing yet it sleeps until a write arrives, or fails with EAGAIN if the file is
+ *  non-blocking.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param to Where the bytes go, user buffers for read and readv or a pipe for splice
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to){
+   struct encode_ctx *ctx = iocb->ki_filp->private_data;
+   struct encode_stream *s = ctx->out;
+   size_t copied;
+
+   if (ctx->ch->tty.file)
+      return -EBUSY;               // the stream is going to the serial port instead
+   if (!iov_iter_count(to))
+      return 0;
+   if (mutex_lock_interruptible(&s->lock))
+      return -ERESTARTSYS;
+   while (kfifo_is_empty(&s->fifo)){
+      mutex_unlock(&s->lock);
+      if (iocbNonblock(iocb))
+         return -EAGAIN;
+      if (wait_event_interruptible(s->readWait, !kfifo_is_empty(&s->fifo)))
+         return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&s->lock))
+         return -ERESTARTSYS;
    }
-   else {
-      printk(KERN_INFO "Eencode: Failed to send %d characters to the user\n", error_count);
+   copied = codec_kfifo_to_iter(&s->fifo, to);
+   mutex_unlock(&s->lock);
+   if (!copied){
+      pr_debug("Encode: Failed to send characters to the user\n");
       return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
    }
+   wake_up_interruptible(&s->writeWait);
+   pr_debug("Encode: Sent %zu characters to the user\n", copied);
+   return copied;
+}
+
+/** @brief Returns how many bytes at the start of a chunk's payload are coded in the same codec
+ *  block as the frame header, which fills it up. A frame is one run of blocks, header and payload
+ *  together, so only its last block is padded. 0 when not framed.
+ */
+static size_t hdrShare(const struct uart_codec *c, size_t chunk){
+   return framed ? min_t(size_t, chunk, roundup(UART_FRAME_HDR_SIZE, c->inBlock) - UART_FRAME_HDR_SIZE) : 0;
+}
+
+/** @brief Returns the size of the encoded blocks holding a frame header, 0 when not framed */
+static size_t hdrBytes(const struct uart_codec *c, size_t chunk){
+   return framed ? codec_encoded_len(c, UART_FRAME_HDR_SIZE + hdrShare(c, chunk)) : 0;
+}
+
+/** @brief Returns how many encoded bytes a chunk of plaintext becomes, header included */
+static size_t frameBytes(const struct uart_codec *c, size_t chunk){
+   return codec_encoded_len(c, (framed ? UART_FRAME_HDR_SIZE : 0) + chunk);
+}
+
+/** @brief Returns how many encoded bytes a chunk becomes as a frame sent to a serial port, which
+ *  carries a CRC when crc is set
+ */
+static size_t txBytes(const struct uart_codec *c, size_t chunk){
+   return frameBytes(c, chunk + (crc ? UART_FRAME_CRC_SIZE : 0) + (stamp ? UART_FRAME_STAMP_SIZE : 0));
+}
+
+/** @brief Returns the largest chunk of the len bytes left that fits in room encoded bytes and in
+ *  temp. Only the last chunk may end in a partial codec block, any other is cut so that it ends
+ *  on a block boundary, the header of its frame included.
+ */
+static size_t chunkFor(const struct uart_codec *c, size_t len, size_t room){
+   size_t hdrSize = framed ? UART_FRAME_HDR_SIZE : 0;
+   size_t most = min(room/c->outBlock, (hdrSize + IN_CHUNK)/c->inBlock)*c->inBlock;
+
+   return most<hdrSize ? 0 : min(len, most - hdrSize);
+}
+
+/** @brief Puts a frame header and the payload bytes sharing its codec block together in head
+ *  @return returns the number of bytes in head, which has to have room for a codec block
+ */
+static size_t frameHead(const struct uart_codec *c, u8 *head, const struct uart_frame_hdr *hdr, const u8 *src, size_t chunk){
+   size_t k = hdrShare(c, chunk);
+
+   memcpy(head, hdr, UART_FRAME_HDR_SIZE);
+   memcpy(head + UART_FRAME_HDR_SIZE, src, k);
+   return UART_FRAME_HDR_SIZE + k;
+}
+
+/** @brief Encodes the payload of a chunk after the blocks holding its frame header, leaving room
+ *  for those at the start of message; without framing that is the whole chunk.
+ */
+static void payloadEncode(const struct uart_codec *c, u8 *message, const u8 *src, size_t chunk){
+   size_t k = hdrShare(c, chunk);
+
+   codec_encode(c, message + hdrBytes(c, chunk), src + k, chunk - k);
+}
+
+/** @brief Compresses the payload of a frame with LZ4 in place, if that makes it any shorter
+ *  @param z Scratch space
+ *  @param buf The payload, replaced by the compressed one
+ *  @param len The number of payload bytes, at most IN_CHUNK
+ *  @return returns the compressed length, or 0 if the payload is to go as it is
+ */
+static size_t lz4Pack(struct lz4_scratch *z, u8 *buf, size_t len){
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS)
+   int n;
+
+   if (len<2)
+      return 0;
+   n = LZ4_compress_default(buf, z->out, len, len-1, z->mem);   // fails unless it saves a byte
+   if (n<=0)
+      return 0;
+   memcpy(buf, z->out, n);
+   return n;
+#else
+   return 0;
+#endif
+}
+
+/** @brief Appends one encoded chunk to a stream, sleeping until it fits unless nonblock is set.
+ *  In framed mode the header is only numbered and encoded here under the stream lock, with the
+ *  start of the payload that shares its block, so frames from files sharing the tty stream keep
+ *  consecutive sequence numbers.
+ *  @param s The stream to append to
+ *  @param c The codec the chunk was encoded with
+ *  @param message The chunk encoded by payloadEncode()
+ *  @param src The chunk's payload
+ *  @param chunk The number of payload bytes in the chunk
+ *  @param flags UART_FRAME_* flags of the header
+ *  @param nonblock Fail with EAGAIN instead of sleeping
+ *  @return returns 0 if successful
+ */
+static int streamAppend(struct encode_stream *s, const struct uart_codec *c, u8 *message, const u8 *src, size_t chunk, u8 flags, bool nonblock){
+   size_t n = frameBytes(c, chunk);
+   struct uart_frame_hdr hdr;
+
+   if (mutex_lock_interruptible(&s->lock))
+      return -ERESTARTSYS;
+   while (kfifo_avail(&s->fifo)<n){
+      mutex_unlock(&s->lock);
+      if (nonblock)
+         return -EAGAIN;
+      if (wait_event_interruptible(s->writeWait, kfifo_avail(&s->fifo)>=n))
+         return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&s->lock))
+         return -ERESTARTSYS;
+   }
+   if (framed){
+      uart_frame_init(&hdr, flags, s->seq++, chunk);
+      codec_encode(c, message, s->head, frameHead(c, s->head, &hdr, src, chunk));
+   }
+   kfifo_in(&s->fifo, message, n);
+   mutex_unlock(&s->lock);
+   wake_up_interruptible(&s->readWait);
+   return 0;
+}
+
+/** @brief Queues a record and its plaintext for the serial port, sleeping until it fits unless
+ *  nonblock is set. Nothing is encoded here; txWork is kicked to do it.
+ *  @param ch The channel, which has a serial port
+ *  @param rec The record, rec->len bytes of plaintext follow it
+ *  @param src The plaintext, at most IN_CHUNK bytes
+ *  @param nonblock Fail with EAGAIN instead of sleeping
+ *  @return returns 0 if successful
+ */
+static int txQueueRec(struct encode_channel *ch, const struct tx_rec *rec, const u8 *src, bool nonblock){
+   struct encode_stream *s = &ch->ttyStream;
+   size_t n = sizeof(*rec) + rec->len;
+
+   if (mutex_lock_interruptible(&s->lock))
+      return -ERESTARTSYS;
+   while (kfifo_avail(&s->fifo)<n){
+      mutex_unlock(&s->lock);
+      if (nonblock)
+         return -EAGAIN;
+      if (wait_event_interruptible(s->writeWait, kfifo_avail(&s->fifo)>=n))
+         return -ERESTARTSYS;
+      if (mutex_lock_interruptible(&s->lock))
+         return -ERESTARTSYS;
+   }
+   kfifo_in(&s->fifo, rec, sizeof(*rec));
+   kfifo_in(&s->fifo, src, rec->len);
+   mutex_unlock(&s->lock);
+   queue_work(ch->txWq, &ch->txWork);
+   return 0;
+}
+
+/** @brief Queues a chunk written to a channel's device for its serial port, see txQueueRec()
+ *  @param ch The channel, which has a serial port
+ *  @param c The codec of the writing file
+ *  @param src The plaintext, at most IN_CHUNK bytes
+ *  @param chunk The number of bytes
+ *  @param written When the write started, for the time stamp
+ *  @param flags UART_FRAME_LZ4 to have it compressed, or 0
+ *  @param nonblock Fail with EAGAIN instead of sleeping
+ *  @return returns 0 if successful
+ */
+static int txQueue(struct encode_channel *ch, const struct uart_codec *c, const u8 *src, size_t chunk, u64 written, u8 flags, bool nonblock){
+   struct tx_rec rec = { .codec = c, .len = chunk, .written = written, .flags = flags };
+
+   return txQueueRec(ch, &rec, src, nonblock);
+}
+
+/** @brief Returns the channel with a serial port that has the most room for plaintext, which is
+ *  the one whose link is least behind
+ */
+static struct encode_channel *bondLink(void){
+   struct encode_channel *best = NULL;
+   unsigned int k;
+
+   for (k = 0; k < numChannels; k++)
+      if (encodeChannels[k].tty.file && (!best ||
+          kfifo_avail(&encodeChannels[k].ttyStream.fifo)>kfifo_avail(&best->ttyStream.fifo)))
+         best = &encodeChannels[k];
+   return best;
+}
+
+/** @brief Writes to /dev/UARTbondtx0. The data is cut into frames of at most IN_CHUNK bytes,
+ *  numbered in one sequence across all links, and every frame is queued on the link with the
+ *  most room with the codec parameter's code, so the links share the stream in proportion to what
+ *  they carry. The decoder puts the frames back in order. Blocking and O_NONBLOCK work as on the
+ *  channels' own devices.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param from The bytes to send
+ */
+static ssize_t bond_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct tx_rec rec = { .codec = defaultCodec, .flags = UART_FRAME_BOND | (compress ? UART_FRAME_LZ4 : 0), .written = ktime_get_ns() };
+   size_t len = iov_iter_count(from);
+   size_t done = 0, sent = 0, chunk;
+   int ret = 0;
+
+   if (mutex_lock_interruptible(&bondLock))
+      return -ERESTARTSYS;
+   while (done<len){
+      chunk = chunkFor(rec.codec, len-done, TX_BUF_SIZE);
+      if (copy_from_iter(bondTemp, chunk, from)!=chunk){
+         ret = -EFAULT;
+         break;
+      }
+      rec.len = chunk;
+      rec.seq = bondSeq;
+      ret = txQueueRec(bondLink(), &rec, bondTemp, iocbNonblock(iocb));
+      if (ret){
+         iov_iter_revert(from, chunk);    // not taken after all
+         break;
+      }
+      bondSeq++;
+      done += chunk;
+      sent += frameBytes(rec.codec, chunk);
+   }
+   mutex_unlock(&bondLock);
+   if (!done)
+      return ret;
+   trace_encode_write(done, sent);
+   return done;
+}
+
+/** @brief /dev/UARTbondtx0 is writable when the link with the most room can take a one byte frame */
+static __poll_t bond_poll(struct file *filep, poll_table *wait){
+   unsigned int k;
+
+   for (k = 0; k < numChannels; k++)
+      if (encodeChannels[k].tty.file)
+         poll_wait(filep, &encodeChannels[k].ttyStream.writeWait, wait);
+   return kfifo_avail(&bondLink()->ttyStream.fifo)>=sizeof(struct tx_rec)+1 ? EPOLLOUT | EPOLLWRNORM : 0;
 }
 
 /** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is tripple bytewise into the message[] array
- *  LKM using the sprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The data is copied in IN_CHUNK sized pieces, encoded
+ *  with the file's codec without holding any lock but the file's own, and appended to the stream
+ *  buffer. There is no length limit and no terminator is added. While the buffer is full the write
+ *  sleeps until it is drained, unless the file is non-blocking in which case it returns what was
+ *  taken or fails with EAGAIN. In framed mode every piece goes out as one frame, header included
+ *  in the encoding. The pieces are cut across the iterator's segments, so a writev of a header and
+ *  a payload is encoded as one stream. In tty mode the pieces are only queued with txQueue() and
+ *  the write returns without waiting for the codec. With compress every frame's payload is LZ4
+ *  compressed first, by txWork in tty mode.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param from The bytes to encode, user buffers for write and writev or a pipe for splice
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct encode_ctx *ctx = iocb->ki_filp->private_data;
+   u64 start = ktime_get_ns();
+   const struct uart_codec *c;
+   size_t len = iov_iter_count(from);
+   size_t done = 0, sent = 0;
+   size_t chunk, n;
+   u8 flags;
+   int ret = 0;
+
+   if (mutex_lock_interruptible(&ctx->lock))
+      return -ERESTARTSYS;
+   c = ctx->codec;
+   flags = ctx->compress ? UART_FRAME_LZ4 : 0;
+   while (done<len){
+      // a chunk must fit in an empty stream buffer, or in a tx buffer, once encoded
+      chunk = chunkFor(c, len - done, ctx->ch->tty.file ? TX_BUF_SIZE : kfifo_size(&ctx->out->fifo));
+      if (copy_from_iter(ctx->temp, chunk, from)!=chunk){
+         ret = -EFAULT;
+         break;
+      }
+      n = chunk;
+      if (ctx->ch->tty.file)
+         ret = txQueue(ctx->ch, c, ctx->temp, chunk, start, flags, iocbNonblock(iocb));
+      else {
+         n = flags ? lz4Pack(ctx->lz4, ctx->temp, chunk) : 0;
+         payloadEncode(c, ctx->message, ctx->temp, n ? n : chunk);
+         ret = streamAppend(ctx->out, c, ctx->message, ctx->temp, n ? n : chunk, n ? flags : 0, iocbNonblock(iocb));
+         n = n ? n : chunk;
+      }
+      if (ret){
+         iov_iter_revert(from, chunk);   // not taken after all
+         break;
+      }
+      done += chunk;
+      sent += frameBytes(c, n);
+   }
+   mutex_unlock(&ctx->lock);
+   if (!done)
+      return ret;
+   trace_encode_write(done, sent);
+   return done;
+}
+
+/** @brief Called by poll, select and epoll. The file is readable when encoded bytes are waiting
+ *  and writable when at least a one byte frame fits in its stream buffer, or a one byte record in
+ *  tty mode.
+ *  @param filep A pointer to a file object
+ *  @param wait The poll table to register the wait queues with
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait){
+   struct encode_ctx *ctx = filep->private_data;
+   struct encode_stream *s = ctx->out;
+   __poll_t mask = 0;
+
+   poll_wait(filep, &s->readWait, wait);
+   poll_wait(filep, &s->writeWait, wait);
+   if (!ctx->ch->tty.file && !kfifo_is_empty(&s->fifo))
+      mask |= EPOLLIN | EPOLLRDNORM;
+   if (kfifo_avail(&s->fifo)>=(ctx->ch->tty.file ? sizeof(struct tx_rec)+1 : frameBytes(READ_ONCE(ctx->codec), 1)))
+      mask |= EPOLLOUT | EPOLLWRNORM;
+   return mask;
+}
+
+/** @brief Creates the shared ring of a file as described by an ENC_IOC_RING_SETUP request
+ *  @param ctx The file's state, locked
+ *  @param setup The sizes asked for, filled in with the layout of the mapping
+ *  @return returns 0 if successful
+ */
+static int ringSetup(struct encode_ctx *ctx, struct uart_ring_setup *setup){
+   struct encode_ring *r;
+
+   if (ctx->ring)
+      return -EBUSY;
+   if (setup->in_size<PAGE_SIZE || setup->in_size>RING_MAX || !is_power_of_2(setup->in_size) ||
+       setup->out_size<PAGE_SIZE || setup->out_size>RING_MAX || !is_power_of_2(setup->out_size))
+      return -EINVAL;
+   r = kzalloc(sizeof(*r), GFP_KERNEL);
+   if (!r)
+      return -ENOMEM;
+   r->mapSize = PAGE_SIZE + setup->in_size + setup->out_size;
+   r->area = vmalloc_user(r->mapSize);       // zeroed, so all four indices start at 0
+   if (!r->area){
+      kfree(r);
+      return -ENOMEM;
+   }
+   r->ctrl = r->area;
+   r->in = r->area + PAGE_SIZE;
+   r->out = r->in + setup->in_size;
+   r->inSize = setup->in_size;
+   r->outSize = setup->out_size;
+   setup->in_offset = PAGE_SIZE;
+   setup->out_offset = PAGE_SIZE + setup->in_size;
+   setup->map_size = r->mapSize;
+   ctx->ring = r;
+   return 0;
+}
+
+/** @brief Encodes n bytes into the encoded region at outHead, which must have room. A block
+ *  that would straddle the end of the region, and an incomplete last one, are built in scratch
+ *  and wrapped byte by byte.
+ */
+static void ringPut(struct encode_ring *r, const struct uart_codec *c, const u8 *src, size_t n, u8 *t){
+   u32 mask = r->outSize-1;
+   u32 off;
+   size_t k, in, out;
+
+   while (n){
+      off = r->outHead & mask;
+      k = min(n/c->inBlock, (size_t)(r->outSize-off)/c->outBlock);
+      if (!k){
+         in = min(n, (size_t)c->inBlock);
+         out = codec_encode(c, t, src, in);
+         for (k = 0; k < out; k++)
+            r->out[(r->outHead+k) & mask] = t[k];
+         r->outHead += out;
+         src += in;
+         n -= in;
+         continue;
+      }
+      c->encode(r->out+off, src, k*c->inBlock);
+      r->outHead += k*c->outBlock;
+      src += k*c->inBlock;
+      n -= k*c->inBlock;
+   }
+}
+
+/** @brief Handles ENC_IOC_KICK: encodes the plaintext userspace has published in the ring straight
+ *  from the shared pages. Without a serial port the result goes to the encoded region, as far as
+ *  it has room; in tty mode it is queued for the serial port like a write would do.
+ *  @param ctx The file's state, locked
+ *  @param nonblock Do not sleep waiting for room in the tty stream
+ *  @return returns the number of plaintext bytes taken or a negative error
+ */
+static long ringKick(struct encode_ctx *ctx, bool nonblock){
+   struct encode_ring *r = ctx->ring;
+   const struct uart_codec *c = ctx->codec;
+   struct uart_frame_hdr hdr;
+   u32 head = smp_load_acquire(&r->ctrl->in_head);
+   u32 outTail = smp_load_acquire(&r->ctrl->out_tail);
+   u32 avail = head - r->inTail;
+   u32 off, room;
+   long taken = 0;
+   const u8 *src;
+   size_t n, k, sent = 0;
+   int ret;
+
+   if (avail>r->inSize || r->outHead-outTail>r->outSize)
+      return -EINVAL;                           // the indices userspace owns make no sense
+   while (avail){
+      off = r->inTail & (r->inSize-1);
+      src = r->in + off;
+      n = min((size_t)avail, (size_t)(r->inSize-off));
+      if (!framed && n<avail && n%c->inBlock){
+         // the region wraps inside a block, which must not be padded in an unframed stream: stop
+         // before it, or put it together in temp
+         if (n>=c->inBlock)
+            n -= n%c->inBlock;
+         else {
+            k = n;
+            n = min((size_t)avail, (size_t)c->inBlock);
+            memcpy(ctx->temp, src, k);
+            memcpy(ctx->temp + k, r->in, n - k);
+            src = ctx->temp;
+         }
+      }
+      if (ctx->ch->tty.file){
+         n = chunkFor(c, n, TX_BUF_SIZE);
+         ret = txQueue(ctx->ch, c, src, n, ktime_get_ns(), ctx->compress ? UART_FRAME_LZ4 : 0, nonblock);
+         if (ret){
+            if (!taken)
+               taken = ret;
+            break;
+         }
+      }
+      else {
+         room = r->outSize - (r->outHead-outTail);
+         if (room<frameBytes(c, 1))
+            break;
+         n = chunkFor(c, n, room);
+         if (framed){
+            uart_frame_init(&hdr, 0, ctx->own.seq++, n);
+            ringPut(r, c, ctx->temp, frameHead(c, ctx->temp, &hdr, src, n), ctx->message);
+         }
+         k = hdrShare(c, n);
+         ringPut(r, c, src + k, n - k, ctx->message);   // message and temp are free without a serial port
+      }
+      r->inTail += n;
+      avail -= n;
+      taken += n;
+      sent += frameBytes(c, n);
+   }
+   smp_store_release(&r->ctrl->out_head, r->outHead);  // publish the encoded bytes before freeing their source
+   smp_store_release(&r->ctrl->in_tail, r->inTail);
+   if (taken>0)
+      trace_encode_write(taken, sent);
+   return taken;
+}
+
+/** @brief Encodes one record of a batch straight into its output buffer, as one frame in framed
+ *  mode. Only the sequence number is taken from the file's stream, which is otherwise untouched.
+ *  @param ctx The file's state, locked
+ *  @param c The codec
+ *  @param rec The record, out_len and status are filled in
+ *  @return returns 0, or -EFAULT if an address in the record was bad
+ */
+static int batchEncode(struct encode_ctx *ctx, const struct uart_codec *c, struct uart_batch_rec *rec){
+   const u8 __user *in = u64_to_user_ptr(rec->in);
+   u8 __user *out = u64_to_user_ptr(rec->out);
+   struct encode_stream *s = ctx->out;
+   struct uart_frame_hdr hdr;
+   size_t left = rec->in_len;
+   size_t chunk, k, n;
+
+   rec->out_len = frameBytes(c, rec->in_len);
+   rec->status = 0;
+   if (framed && rec->in_len>UART_FRAME_MAXLEN){
+      rec->status = -E2BIG;
+      return 0;
+   }
+   if (rec->out_len>rec->out_cap){
+      rec->status = -EMSGSIZE;
+      return 0;
+   }
+   if (framed){
+      k = hdrShare(c, left);
+      if (copy_from_user(ctx->message, in, k))
+         return -EFAULT;
+      mutex_lock(&s->lock);
+      uart_frame_init(&hdr, 0, s->seq++, rec->in_len);
+      mutex_unlock(&s->lock);
+      n = codec_encode(c, ctx->message, ctx->temp, frameHead(c, ctx->temp, &hdr, ctx->message, left));
+      if (copy_to_user(out, ctx->message, n))
+         return -EFAULT;
+      in += k;
+      out += n;
+      left -= k;
+   }
+   while (left){
+      chunk = min(left, (size_t)IN_CHUNK/c->inBlock*c->inBlock);   // the header is behind, whole blocks
+      if (copy_from_user(ctx->temp, in, chunk))
+         return -EFAULT;
+      n = codec_encode(c, ctx->message, ctx->temp, chunk);
+      if (copy_to_user(out, ctx->message, n))
+         return -EFAULT;
+      in += chunk;
+      out += n;
+      left -= chunk;
+   }
+   return 0;
+}
+
+/** @brief Handles ENC_IOC_SUBMIT_BATCH: encodes every record of the batch with the file's codec,
+ *  writing the output length and status of each back into its descriptor.
+ *  @param ctx The file's state, locked
+ *  @param b The batch, b->done is filled in
+ *  @return returns 0, or -EFAULT if not even the first record could be handled
+ */
+static long submitBatch(struct encode_ctx *ctx, struct uart_batch *b){
+   struct uart_batch_rec __user *recs = u64_to_user_ptr(b->recs);
+   const struct uart_codec *c = ctx->codec;
+   struct uart_batch_rec rec;
+   size_t in = 0, out = 0;
+
+   for (b->done = 0; b->done<b->count; b->done++){
+      if (copy_from_user(&rec, recs+b->done, sizeof(rec)) || batchEncode(ctx, c, &rec))
+         break;
+      if (put_user(rec.out_len, &recs[b->done].out_len) || put_user(rec.status, &recs[b->done].status))
+         break;
+      if (!rec.status){
+         in += rec.in_len;
+         out += rec.out_len;
+      }
+   }
+   if (in)
+      trace_encode_write(in, out);
+   return b->done || !b->count ? 0 : -EFAULT;
+}
+
+/** @brief Handles the ioctl calls defined in uartcodec.h
+ *  @param filep A pointer to a file object
+ *  @param cmd The request
+ *  @param arg The request's argument, a user pointer for all but ENC_IOC_KICK
+ *  @return returns >= 0 if successful
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct encode_ctx *ctx = filep->private_data;
+   struct uart_ring_setup setup;
+   struct uart_batch batch;
+   const struct uart_codec *c;
+   u32 id;
+   long ret;
+
+   switch (cmd){
+   case ENC_IOC_RING_SETUP:
+      if (copy_from_user(&setup, (void __user *)arg, sizeof(setup)))
+         return -EFAULT;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      ret = ringSetup(ctx, &setup);
+      mutex_unlock(&ctx->lock);
+      if (!ret && copy_to_user((void __user *)arg, &setup, sizeof(setup)))
+         ret = -EFAULT;
+      return ret;
+   case ENC_IOC_KICK:
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      ret = ctx->ring ? ringKick(ctx, filep->f_flags & O_NONBLOCK) : -EINVAL;
+      mutex_unlock(&ctx->lock);
+      return ret;
+   case UART_IOC_SET_CODEC:
+      if (get_user(id, (u32 __user *)arg))
+         return -EFAULT;
+      c = codec_get(id);
+      if (!c || (!ctx->ch->tty.file && kfifo_size(&ctx->out->fifo)<frameBytes(c, 1)))
+         return -EINVAL;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      WRITE_ONCE(ctx->codec, c);                // takes effect from the next write
+      mutex_unlock(&ctx->lock);
+      return 0;
+   case UART_IOC_GET_CODEC:
+      return put_user(READ_ONCE(ctx->codec)->id, (u32 __user *)arg);
+   case UART_IOC_SET_COMPRESS:
+      if (get_user(id, (u32 __user *)arg))
+         return -EFAULT;
+      if (id>UART_COMPRESS_LZ4 || (id && !framed))
+         return -EINVAL;
+      if (id && !IS_ENABLED(CONFIG_LZ4_COMPRESS))
+         return -EOPNOTSUPP;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      if (id && !ctx->ch->tty.file && !ctx->lz4)
+         ctx->lz4 = kvmalloc(sizeof(*ctx->lz4), GFP_KERNEL);
+      ret = id && !ctx->ch->tty.file && !ctx->lz4 ? -ENOMEM : 0;
+      if (!ret)
+         ctx->compress = id;                    // takes effect from the next write
+      mutex_unlock(&ctx->lock);
+      return ret;
+   case UART_IOC_GET_COMPRESS:
+      return put_user(READ_ONCE(ctx->compress) ? UART_COMPRESS_LZ4 : UART_COMPRESS_NONE, (u32 __user *)arg);
+   case ENC_IOC_SUBMIT_BATCH:
+      if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+         return -EFAULT;
+      if (batch.count>UART_BATCH_MAX)
+         return -EINVAL;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      ret = submitBatch(ctx, &batch);
+      mutex_unlock(&ctx->lock);
+      if (put_user(batch.done, &((struct uart_batch __user *)arg)->done))
+         ret = -EFAULT;
+      return ret;
+   default:
+      return -ENOTTY;
+   }
+}
+
+/** @brief Maps the shared ring, which has to be set up with ENC_IOC_RING_SETUP first
  *  @param filep A pointer to a file object
- *  @param buffer The buffer to that contains the string to write to the device
- *  @param len The length of the array of data that is being passed in the const char buffer
- *  @param offset The offset if required
- */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
-  //only take the first 256
-  if(len>256)
-    len=256;
-  unsigned long ret;
-  ret=copy_from_user(temp,buffer,len);
-  temp[len-1]='\0';//force null terminator
-  short i=0; 
-  //tripple message
-  while(temp[i]){
-    message[3*i+2]=message[3*i+1]=message[3*i]=temp[i];
-  i++;
-  }
-  message[3*i]='\0';//end the string so that later characters aren't seen and don't have to be overwritten
-  messageSize=i*3+1;//length is increased by factor of three by encoding, add one for the string termination for linux reasons
-  printk(KERN_INFO "Encode: prepared message for UART with i = %d",i);
-  return len;
+ *  @param vma The userspace range to map it into
+ *  @return returns 0 if successful
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma){
+   struct encode_ctx *ctx = filep->private_data;
+   int ret = -EINVAL;
+
+   mutex_lock(&ctx->lock);
+   if (ctx->ring)
+      ret = remap_vmalloc_range(vma, ctx->ring->area, vma->vm_pgoff);
+   mutex_unlock(&ctx->lock);
+   return ret;
+}
+
+/** @brief Encodes one frame into a transmit buffer, followed by its time stamp when stamp is set
+ *  and by its CRC when crc is
+ *  @param b The buffer, which has room for it
+ *  @param head Room for a codec block, where the header is put together with what shares its block
+ *  @param c The code to encode it with
+ *  @param flags UART_FRAME_* flags of the header
+ *  @param seq Its sequence number
+ *  @param buf The payload, with TRAILER_SIZE bytes of room after it
+ *  @param len The number of payload bytes
+ *  @param written When it was written, 0 for a frame without time stamp
+ */
+static void txFrame(struct tx_buf *b, u8 *head, const struct uart_codec *c, u8 flags, u16 seq, u8 *buf, size_t len, u64 written){
+   struct uart_frame_hdr hdr;
+   size_t n = len, k = 0;
+
+   if (framed){
+      if (stamp && written){
+         put_unaligned_le64(written, buf+len);
+         put_unaligned_le64(ktime_get_ns(), buf+len+8);
+         flags |= UART_FRAME_TIME;
+         n += UART_FRAME_STAMP_SIZE;
+      }
+      uart_frame_init(&hdr, crc ? flags | UART_FRAME_CRC : flags, seq, len);
+      if (crc){
+         put_unaligned_le32(codec_frame_crc(&hdr, buf, n), buf+n);
+         n += UART_FRAME_CRC_SIZE;
+      }
+      k = hdrShare(c, n);
+      b->len += codec_encode(c, b->data+b->len, head, frameHead(c, head, &hdr, buf, n));
+   }
+   b->len += codec_encode(c, b->data+b->len, buf + k, n - k);
+}
+
+/** @brief Returns the code frames of a record go out with, the link's level overriding the file's */
+static const struct uart_codec *txCodec(struct encode_channel *ch, const struct uart_codec *c){
+   return adapt ? codec_get(codec_ladder[ch->txLevel].codec) : c;
+}
+
+/** @brief Encodes the frames marked for sending again into a transmit buffer, oldest first
+ *  @param ch The channel, with arq
+ *  @param b The buffer
+ *  @return returns true if one did not fit, so the buffer is full
+ */
+static bool arqResend(struct encode_channel *ch, struct tx_buf *b){
+   struct arq_tx *a = ch->arq;
+   struct arq_slot *slot;
+   const struct uart_codec *c;
+   bool full = false;
+   u16 seq;
+
+   mutex_lock(&a->lock);
+   for (seq = a->base; seq != a->next; seq++){
+      slot = &a->slots[seq % ARQ_WINDOW];
+      if (!slot->resend)
+         continue;
+      c = txCodec(ch, slot->codec);
+      if (txBytes(c, slot->len)>TX_BUF_SIZE-b->len){
+         full = true;
+         break;
+      }
+      slot->resend = false;
+      if (++slot->tries>=ARQ_WARN)
+         printk_ratelimited(KERN_INFO "Encode: channel %u sending frame %u for the %u. time\n", ch->index, seq, slot->tries);
+      txFrame(b, ch->txHead, c, slot->flags, seq, slot->data, slot->len, slot->written);
+   }
+   mutex_unlock(&a->lock);
+   return full;
+}
+
+/** @brief Keeps a frame about to be sent until it is acknowledged
+ *  @param a The channel's frames waiting for acknowledgement
+ *  @param seq The frame's sequence number, which arqRoom() allowed
+ *  @param rec Its record, with the code of the file it was written to and the payload's length
+ *  @param buf The buffer of framePool that arqRoom() took for it
+ *  @param data Its payload
+ *  @return returns the slot's copy of the payload, with room for the CRC
+ */
+static u8 *arqKeep(struct arq_tx *a, u16 seq, const struct tx_rec *rec, u8 *buf, const u8 *data){
+   struct arq_slot *slot = &a->slots[seq % ARQ_WINDOW];
+
+   mutex_lock(&a->lock);
+   slot->data = buf;
+   if (a->base==a->next)
+      a->heard = jiffies;                     // the timeout runs from the first frame in flight
+   slot->codec = rec->codec;
+   slot->len = rec->len;
+   slot->flags = rec->flags & UART_FRAME_LZ4;
+   slot->written = rec->written;
+   slot->acked = false;
+   slot->resend = false;
+   slot->tries = 1;
+   memcpy(slot->data, data, rec->len);
+   a->next = seq+1;
+   mutex_unlock(&a->lock);
+   return slot->data;
+}
+
+/** @brief Checks whether frame seq still fits in the window and takes a buffer for it from
+ *  framePool. That does not wait for a buffer, only acknowledgements give them back and those
+ *  arrive on a path that must not wait for txWork.
+ *  @param a The channel's frames waiting for acknowledgement
+ *  @param seq The frame's sequence number
+ *  @return returns the buffer, or NULL if the window is full or there is none for now
+ */
+static u8 *arqRoom(struct arq_tx *a, u16 seq){
+   u8 *buf = NULL;
+
+   mutex_lock(&a->lock);
+   if ((u16)(seq - a->base) < ARQ_WINDOW){
+      buf = mempool_alloc(framePool, GFP_NOWAIT | __GFP_NOWARN);
+      a->starved = !buf;
+   }
+   mutex_unlock(&a->lock);
+   return buf;
+}
+
+/** @brief The work item encoding for the serial port. It takes records out of ttyStream and
+ *  encodes them into the free buffer until the next would not fit, hands that to txTask and goes
+ *  on with the other one. When both are full it stops; txTask queues it again after sending one.
+ *  With arq, frames to be sent again go first, and new data frames wait while the window is full
+ *  until an acknowledgement queues it again, or while framePool is empty until arqWork does.
+ *  @param work The txWork of a channel
+ */
+static void txEncode(struct work_struct *work){
+   struct encode_channel *ch = container_of(work, struct encode_channel, txWork);
+   struct encode_stream *s = &ch->ttyStream;
+   const struct uart_ctrl *msg = (const struct uart_ctrl *)ch->txTemp;
+   struct tx_buf *b;
+   struct tx_rec rec;
+   const struct uart_codec *c;
+   bool more = true, data;
+   u8 *payload, *buf;
+   size_t n;
+   u16 seq;
+
+   while (more && atomic_read(&ch->txFull)<2){
+      b = &ch->txBufs[ch->txFill];
+      b->len = 0;
+      b->level = -1;
+      while (b->level<0){
+         if (ch->arq && arqResend(ch, b))
+            break;
+         mutex_lock(&s->lock);
+         if (kfifo_out_peek(&s->fifo, &rec, sizeof(rec))!=sizeof(rec)){
+            mutex_unlock(&s->lock);
+            more = false;
+            break;
+         }
+         c = txCodec(ch, rec.codec);
+         if (txBytes(c, rec.len)>TX_BUF_SIZE-b->len){
+            mutex_unlock(&s->lock);
+            break;
+         }
+         data = !(rec.flags & (UART_FRAME_BOND | UART_FRAME_CTRL)); // the others are sent once
+         buf = data && ch->arq ? arqRoom(ch->arq, s->seq) : NULL;
+         if (data && ch->arq && !buf){
+            mutex_unlock(&s->lock);
+            more = false;
+            break;
+         }
+         kfifo_out(&s->fifo, &rec, sizeof(rec));
+         kfifo_out(&s->fifo, ch->txTemp, rec.len);
+         seq = data ? s->seq++ : rec.seq;
+         mutex_unlock(&s->lock);
+         wake_up_interruptible(&s->writeWait);
+         if (stamp && rec.written)
+            codec_hist_add(&histQueue, ktime_get_ns()-rec.written);
+         if (rec.flags & UART_FRAME_LZ4){
+            n = lz4Pack(ch->lz4, ch->txTemp, rec.len);
+            if (n)
+               rec.len = n;
+            else
+               rec.flags &= ~UART_FRAME_LZ4;    // goes as it is
+         }
+         payload = ch->txTemp;
+         if (data && ch->arq){
+            payload = arqKeep(ch->arq, seq, &rec, buf, ch->txTemp);
+         }
+         txFrame(b, ch->txHead, c, rec.flags, seq, payload, rec.len, rec.written);
+         // After a switch the buffer is closed, txTask changes the baud rate once it is out
+         if ((rec.flags & UART_FRAME_CTRL) && msg->type==UART_CTRL_SWITCH){
+            ch->txLevel = msg->level;
+            b->level = msg->level;
+         }
+      }
+      if (!b->len)
+         break;
+      ch->txFill ^= 1;
+      if (stamp)
+         b->ready = ktime_get_ns();
+      smp_mb__before_atomic();                // the buffer is written before it is handed over
+      atomic_inc(&ch->txFull);
+      wake_up_interruptible(&ch->txWait);
+   }
+}
+
+/** @brief Runs every adapt_interval on a channel of an adaptive link. It moves to the level the
+ *  decoder asks for with a UART_CTRL_SWITCH frame, or back to level 0 if the decoder has not
+ *  reported from the current level for ADAPT_TIMEOUT intervals, which the decoder does as well
+ *  when it stops hearing from us. Otherwise it sends a UART_CTRL_LEVEL frame, so an idle link
+ *  still shows the decoder it is up.
+ *  @param work The adaptWork of a channel
+ */
+static void adaptWork(struct work_struct *work){
+   struct encode_channel *ch = container_of(to_delayed_work(work), struct encode_channel, adaptWork);
+   struct tx_rec rec = { .len = sizeof(struct uart_ctrl), .flags = UART_FRAME_CTRL };
+   unsigned long timeout = ADAPT_TIMEOUT*msecs_to_jiffies(adapt_interval);
+   unsigned int want = min(READ_ONCE(ch->adaptWant), READ_ONCE(adapt_max));
+   struct uart_ctrl msg;
+
+   if (time_after(jiffies, READ_ONCE(ch->adaptHeard)+timeout))
+      want = 0;                               // lost the decoder, start over where both ends begin
+   uart_ctrl_init(&msg, want!=ch->adaptLevel ? UART_CTRL_SWITCH : UART_CTRL_LEVEL, want, want);
+   if (!txQueueRec(ch, &rec, (u8 *)&msg, true) && want!=ch->adaptLevel){
+      WRITE_ONCE(ch->adaptWant, want);
+      WRITE_ONCE(ch->adaptLevel, want);
+      WRITE_ONCE(ch->adaptHeard, jiffies);    // give the decoder its time to report from the new level
+   }
+   schedule_delayed_work(&ch->adaptWork, msecs_to_jiffies(adapt_interval));
+}
+
+/** @brief Takes in an acknowledgement from the decoder. The frames it covers leave the window,
+ *  which lets txWork go on with new ones, and those missing before any that arrived out of order
+ *  are sent again at once, but only the first time.
+ *  @param ch The channel, with arq
+ *  @param next Every frame before it has arrived
+ *  @param mask Bit i is set if frame next+1+i has arrived as well
+ */
+static void arqAck(struct encode_channel *ch, u16 next, u32 mask){
+   struct arq_tx *a = ch->arq;
+   bool kick = false;
+   u16 seq, last;
+   unsigned int i;
+
+   mutex_lock(&a->lock);
+   if ((u16)(next - a->base) > (u16)(a->next - a->base)){
+      mutex_unlock(&a->lock);                 // about frames not in flight, from before a reload
+      return;
+   }
+   if (next!=a->base){
+      for (seq = a->base; seq != next; seq++)   // delivered, their buffers go back to the pool
+         mempool_free(a->slots[seq % ARQ_WINDOW].data, framePool);
+      a->base = next;
+      a->heard = jiffies;
+      kick = true;
+   }
+   last = next;
+   for (i = 0; i < 32; i++){
+      seq = next+1+i;
+      if ((mask & BIT(i)) && (u16)(seq - a->base) < (u16)(a->next - a->base)){
+         a->slots[seq % ARQ_WINDOW].acked = true;
+         last = seq;
+      }
+   }
+   for (seq = a->base; seq != last; seq++){
+      struct arq_slot *slot = &a->slots[seq % ARQ_WINDOW];
+      if (!slot->acked && !slot->resend && slot->tries==1){
+         slot->resend = true;
+         kick = true;
+      }
+   }
+   mutex_unlock(&a->lock);
+   if (kick)
+      queue_work(ch->txWq, &ch->txWork);
+}
+
+/** @brief Runs every quarter of arq_timeout on a channel with arq. Once nothing new has been
+ *  acknowledged for arq_timeout while frames are in flight, all that are not yet acknowledged are
+ *  sent again. A txWork that found framePool empty is queued again as well.
+ *  @param work The arqTimer of a channel
+ */
+static void arqWork(struct work_struct *work){
+   struct encode_channel *ch = container_of(to_delayed_work(work), struct encode_channel, arqTimer);
+   struct arq_tx *a = ch->arq;
+   unsigned long timeout = msecs_to_jiffies(READ_ONCE(arq_timeout));
+   bool kick = false;
+   u16 seq;
+
+   mutex_lock(&a->lock);
+   if (a->base!=a->next && time_after(jiffies, a->heard+timeout)){
+      for (seq = a->base; seq != a->next; seq++)
+         if (!a->slots[seq % ARQ_WINDOW].acked){
+            a->slots[seq % ARQ_WINDOW].resend = true;
+            kick = true;
+         }
+      a->heard = jiffies;                     // the frames sent again get their time as well
+   }
+   kick |= a->starved;                        // buffers may have come back on another channel
+   mutex_unlock(&a->lock);
+   if (kick)
+      queue_work(ch->txWq, &ch->txWork);
+   schedule_delayed_work(&ch->arqTimer, max(timeout/4, 1UL));
+}
+
+/** @brief Returns the size of the frame a header received from the decoder starts, or 0 if it is
+ *  neither a report nor an acknowledgement
+ */
+static size_t ctrlSize(const struct uart_frame_hdr *hdr){
+   size_t len = uart_frame_len(hdr);
+
+   if (!uart_frame_valid(hdr))
+      return 0;
+   if (!(hdr->flags & UART_FRAME_ACK ? len==sizeof(struct uart_ack) : (hdr->flags & UART_FRAME_CTRL) && len==sizeof(struct uart_ctrl)))
+      return 0;
+   return UART_FRAME_HDR_SIZE + len + (hdr->flags & UART_FRAME_CRC ? UART_FRAME_CRC_SIZE : 0);
+}
+
+/** @brief Takes in a report from the decoder. Only reports from the level last announced count;
+ *  the others were sent before the decoder saw the switch.
+ */
+static void ctrlReport(struct encode_channel *ch, const struct uart_ctrl *msg){
+   if (adapt && uart_ctrl_valid(msg) && msg->type==UART_CTRL_REPORT && msg->level==READ_ONCE(ch->adaptLevel)){
+      WRITE_ONCE(ch->adaptWant, msg->want<CODEC_LADDER_LEN ? msg->want : msg->level);
+      WRITE_ONCE(ch->adaptHeard, jiffies);
+   }
+}
+
+/** @brief Receive callback of the serial port of a link with adapt or arq, which only brings
+ *  reports and acknowledgements from the decoder. They are not encoded, so anything that is not a
+ *  whole frame with valid header, message and CRC if it has one is skipped.
+ *  @param priv The channel
+ *  @param data The received bytes
+ *  @param n The number of received bytes
+ *  @return returns n, all bytes are taken
+ */
+static size_t ctrlReceive(void *priv, const u8 *data, size_t n){
+   struct encode_channel *ch = priv;
+   const struct uart_frame_hdr *hdr = (const struct uart_frame_hdr *)ch->ctrlBuf;
+   const u8 *payload = ch->ctrlBuf+UART_FRAME_HDR_SIZE;
+   size_t i;
+
+   for (i = 0; i < n; i++){
+      if (!ch->ctrlLen && data[i]!=UART_FRAME_MAGIC)
+         continue;                            // hunt for the start of a frame
+      ch->ctrlBuf[ch->ctrlLen++] = data[i];
+      if (ch->ctrlLen==UART_FRAME_HDR_SIZE && !(ch->ctrlNeed = ctrlSize(hdr))){
+         ch->ctrlLen = 0;                     // not for us, the next one comes soon enough
+         continue;
+      }
+      if (ch->ctrlLen<UART_FRAME_HDR_SIZE || ch->ctrlLen<ch->ctrlNeed)
+         continue;
+      ch->ctrlLen = 0;
+      if ((hdr->flags & UART_FRAME_CRC) &&
+          get_unaligned_le32(payload+uart_frame_len(hdr))!=codec_frame_crc(hdr, payload, uart_frame_len(hdr)))
+         continue;
+      if (!(hdr->flags & UART_FRAME_ACK))
+         ctrlReport(ch, (const struct uart_ctrl *)payload);
+      else if (ch->arq)
+         arqAck(ch, get_unaligned_le16(payload), get_unaligned_le32(payload+2));
+   }
+   return n;
+}
+
+/** @brief The thread sending the stream of a channel with a serial port. It sleeps until txWork
+ *  has filled a buffer and writes it to the serial port in one go, then lets txWork refill it.
+ *  @param data The channel
+ */
+static int txThread(void *data){
+   struct encode_channel *ch = data;
+   struct tx_buf *b;
+
+   while (!kthread_should_stop()){
+      if (wait_event_interruptible(ch->txWait, atomic_read(&ch->txFull) || kthread_should_stop()))
+         continue;
+      if (!atomic_read(&ch->txFull))
+         continue;
+      smp_rmb();                              // read the buffer only after seeing it handed over
+      b = &ch->txBufs[ch->txSend];
+      if (codec_tty_write(&ch->tty, b->data, b->len))
+         printk(KERN_ALERT "Encode: lost %zu bytes writing to %s\n", b->len, ch->ttyPath);
+      if (stamp)
+         codec_hist_add(&histSend, ktime_get_ns()-b->ready);
+      if (b->level>=0){
+         codec_tty_set_baud(&ch->tty, codec_ladder[b->level].baud);
+         printk(KERN_INFO "Encode: channel %u now at level %d, %s at %u baud\n", ch->index, b->level,
+                codec_get(codec_ladder[b->level].codec)->name, codec_ladder[b->level].baud);
+         msleep(ADAPT_GUARD);                 // the decoder changes its rate once it has the switch
+      }
+      ch->txSend ^= 1;
+      smp_mb__before_atomic();                // done with the buffer before giving it back
+      atomic_dec(&ch->txFull);
+      queue_work(ch->txWq, &ch->txWork);
+   }
+   return 0;
 }
 
 /** @brief The device release function that is called whenever the device is closed/released by
- *  the userspace program
+ *  the userspace program. Anything encoded but not read is discarded with the file's stream.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep){
-  
-   printk(KERN_INFO "Encode: Device successfully closed\n");
+   struct encode_ctx *ctx = filep->private_data;
+
+   if (ctx->ring){
+      vfree(ctx->ring->area);
+      kfree(ctx->ring);
+   }
+   if (ctx->out == &ctx->own)
+      streamFree(&ctx->own);
+   kvfree(ctx->lz4);
+   kfree(ctx);
+   pr_debug("Encode: Device successfully closed\n");
    return 0;
 }
 
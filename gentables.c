@@ -0,0 +1,123 @@
+/**
+ * @file   gentables.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Works out the lookup tables of the Hamming(7,4) and SECDED(8,4) codecs from their
+ * parity equations and prints them as codec_tables.h, which codec_hamming.c includes. The build
+ * runs it on the host before compiling the module, or `make tables` runs it on its own. Every
+ * table has 256 entries indexed by a plaintext or received byte, so a byte is coded with one
+ * lookup and one store and the tables of both codecs take 3 KB, well inside the L1 data cache.
+ */
+
+#include <stdio.h>
+#include "codec_kernels.h"        // How codec_hamming_decode() reads the entries
+
+#define HAM_FIXED (1 << CODEC_HAM_FIXED_SHIFT) ///< Added to a decode table entry when one bit was put right
+#define HAM_BAD   (1 << CODEC_HAM_BAD_SHIFT)   ///< Added to a decode table entry when the damage could not be repaired
+
+/** @brief Returns the XOR of the positions of the set bits of a 7 bit word, 0 for a codeword.
+ *  Bit k-1 holds codeword position k.
+ */
+static unsigned int syndrome74(unsigned int w){
+   unsigned int s = 0;
+   int k;
+
+   for (k = 1; k <= 7; k++)
+      if (w >> (k-1) & 1)
+         s ^= k;
+   return s;
+}
+
+/** @brief Builds the Hamming(7,4) codeword of a nibble. The data bits sit at positions 3, 5, 6
+ *  and 7 and the parity bits at 1, 2 and 4 are set to cancel their syndrome.
+ */
+static unsigned int hamming74(unsigned int d){
+   unsigned int w = (d & 1) << 2 | (d >> 1 & 7) << 4;
+   unsigned int s = syndrome74(w);
+
+   return w | (s & 1) | (s >> 1 & 1) << 1 | (s >> 2 & 1) << 3;
+}
+
+/** @brief Builds the SECDED codeword of a nibble, the Hamming(7,4) one with bit 7 the overall parity */
+static unsigned int secded84(unsigned int d){
+   unsigned int w = hamming74(d);
+
+   return w | (__builtin_popcount(w) & 1) << 7;
+}
+
+/** @brief Returns the nibble carried by a codeword */
+static unsigned int data74(unsigned int w){
+   return (w >> 2 & 1) | (w >> 4 & 7) << 1;
+}
+
+/** @brief Returns the nibble and status of a received Hamming(7,4) word, bit 7 ignored */
+static unsigned int decode74(unsigned int w){
+   unsigned int s = syndrome74(w & 0x7f);
+
+   return s ? data74(w ^ 1 << (s-1)) | HAM_FIXED : data74(w);
+}
+
+/** @brief Returns the nibble and status of a received SECDED byte */
+static unsigned int decode84(unsigned int w){
+   unsigned int s = syndrome74(w & 0x7f);
+
+   if (!(__builtin_popcount(w) & 1))          // even weight: clean, or two bits wrong
+      return s ? data74(w) | HAM_BAD : data74(w);
+   if (s)                                     // odd weight: one bit wrong among the seven
+      return data74(w ^ 1 << (s-1)) | HAM_FIXED;
+   return data74(w) | HAM_FIXED;              // just the overall parity bit
+}
+
+/** @brief Prints a table of 256 entries with a doc comment */
+static void table(const char *doc, const char *name, unsigned int (*entry)(unsigned int)){
+   unsigned int i;
+
+   printf("\n/** @brief %s */\nstatic const u16 %s[256] = {", doc, name);
+   for (i = 0; i < 256; i++)
+      printf("%s0x%04x,", i % 8 ? " " : "\n   ", entry(i));
+   printf("\n};\n");
+}
+
+static unsigned int encode74Entry(unsigned int b){
+   return hamming74(b & 0x0f) | hamming74(b >> 4) << 8;
+}
+
+static unsigned int encode84Entry(unsigned int b){
+   return secded84(b & 0x0f) | secded84(b >> 4) << 8;
+}
+
+static unsigned int decode74Lo(unsigned int w){
+   return decode74(w);
+}
+
+static unsigned int decode74Hi(unsigned int w){
+   unsigned int e = decode74(w);
+
+   return (e & 0x0f) << 4 | (e & ~0x0fu);
+}
+
+static unsigned int decode84Lo(unsigned int w){
+   return decode84(w);
+}
+
+static unsigned int decode84Hi(unsigned int w){
+   unsigned int e = decode84(w);
+
+   return (e & 0x0f) << 4 | (e & ~0x0fu);
+}
+
+int main(void){
+   printf("/* Generated by gentables.c, do not edit */\n");
+   table("Both Hamming(7,4) codewords of every byte, the low nibble's in the low byte",
+         "encode74", encode74Entry);
+   table("Both SECDED codewords of every byte, the low nibble's in the low byte",
+         "encode84", encode84Entry);
+   table("Low nibble and status of every received Hamming(7,4) byte, bit 7 ignored",
+         "decode74Lo", decode74Lo);
+   table("High nibble and status of every received Hamming(7,4) byte",
+         "decode74Hi", decode74Hi);
+   table("Low nibble and status of every received SECDED byte", "decode84Lo", decode84Lo);
+   table("High nibble and status of every received SECDED byte", "decode84Hi", decode84Hi);
+   return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file   latency.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Latency histograms the encode and decode modules fill in as frames pass the stages of
+ * the link, shown in debugfs under /sys/kernel/debug/uartcodec/. Every histogram counts per CPU
+ * in power of two buckets of nanoseconds, so recording a sample is one increment without a lock;
+ * reading a file adds up the CPUs and writing to it clears them.
+ */
+
+#include <linux/module.h>         // EXPORT_SYMBOL_GPL()
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/init.h>           // __init and __exit
+#include <linux/fs.h>             // The operations of the debugfs files
+#include <linux/debugfs.h>        // debugfs_create_file()
+#include <linux/seq_file.h>       // single_open()
+#include <linux/percpu.h>         // The per-CPU counts
+#include "codec.h"
+
+static struct dentry *latencyDir;  ///< /sys/kernel/debug/uartcodec
+
+/** @brief Prints the buckets from the first to the last one that counted anything, one per line
+ *  as the lowest latency in nanoseconds the bucket takes and its count
+ */
+static int histShow(struct seq_file *m, void *v){
+   struct codec_hist *h = m->private;
+   unsigned long sum[CODEC_HIST_BUCKETS] = {0};
+   unsigned int b, first = CODEC_HIST_BUCKETS, last = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      for (b = 0; b < CODEC_HIST_BUCKETS; b++)
+         sum[b] += READ_ONCE(per_cpu_ptr(h->cpu, cpu)->n[b]);
+   for (b = 0; b < CODEC_HIST_BUCKETS; b++)
+      if (sum[b]){
+         first = min(first, b);
+         last = b;
+      }
+   for (b = first; b <= last && first<CODEC_HIST_BUCKETS; b++)
+      seq_printf(m, "%llu %lu\n", b ? 1ULL << b : 0ULL, sum[b]);
+   return 0;
+}
+
+static int histOpen(struct inode *inode, struct file *file){
+   return single_open(file, histShow, inode->i_private);
+}
+
+/** @brief Clears the histogram on any write. Samples recorded meanwhile may survive it. */
+static ssize_t histWrite(struct file *file, const char __user *buf, size_t len, loff_t *ppos){
+   struct codec_hist *h = ((struct seq_file *)file->private_data)->private;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      memset(per_cpu_ptr(h->cpu, cpu), 0, sizeof(struct codec_hist_cpu));
+   return len;
+}
+
+static const struct file_operations histFops = {
+   .owner = THIS_MODULE,
+   .open = histOpen,
+   .read = seq_read,
+   .write = histWrite,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+
+/** @brief Sets up an empty histogram shown as /sys/kernel/debug/uartcodec/name. Without debugfs
+ *  the samples are still counted, there is just nothing to show them.
+ *  @param h The histogram
+ *  @param name The file name
+ *  @return returns 0 if successful
+ */
+int codec_hist_create(struct codec_hist *h, const char *name){
+   h->cpu = alloc_percpu(struct codec_hist_cpu);
+   if (!h->cpu)
+      return -ENOMEM;
+   h->file = debugfs_create_file(name, 0600, latencyDir, h, &histFops);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(codec_hist_create);
+
+/** @brief Removes the file of a histogram set up by codec_hist_create() and frees its counts. NULL
+ *  counts, from a histogram never set up, are left alone.
+ */
+void codec_hist_destroy(struct codec_hist *h){
+   if (!h->cpu)
+      return;
+   debugfs_remove(h->file);
+   free_percpu(h->cpu);
+   h->cpu = NULL;
+}
+EXPORT_SYMBOL_GPL(codec_hist_destroy);
+
+/** @brief Creates the debugfs directory of the histograms, called when uartcodec is loaded */
+void __init codec_latency_init(void){
+   latencyDir = debugfs_create_dir("uartcodec", NULL);
+}
+
+/** @brief Removes the directory again, the other modules are unloaded by then */
+void __exit codec_latency_exit(void){
+   debugfs_remove_recursive(latencyDir);
+}
@@ -0,0 +1,221 @@
+/**
+ * @file   libuartcodec.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   The codecs of uartcodec.ko for userspace, see libuartcodec.h. The kernels are picked
+ * once, the first time a buffer is coded: AVX2 or SSSE3 if the CPU has them, NEON on ARM, and the
+ * C kernels of codec_kernels.h otherwise and for whatever is left after the SIMD steps, the same
+ * split as codec.c makes. Reed-Solomon is left out, the module takes it from the kernel's
+ * lib/reed_solomon which has no userspace build.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "libuartcodec.h"
+#include "codec_kernels.h"
+#include "codec_tables.h"         // Generated by gentables.c
+
+#define MAX_REPEAT_BLOCK 341      ///< CODEC_MAX_BLOCK/3 of codec.h
+
+/** @brief A set of SIMD kernels and the number of bytes they take per step */
+struct uc_kernels {
+   const char *name;
+   size_t step;
+   void (*encode)(u8 *dst, const u8 *src, size_t n);
+   void (*decode)(u8 *dst, const u8 *src, size_t n, struct codec_stats *st);
+   void (*majority)(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st);
+};
+
+#if defined(__x86_64__)
+static const struct uc_kernels kernelsAvx2 = {
+   "avx2", 32, codec_repeat3_encode_avx2, codec_repeat3_decode_avx2, codec_majority3_avx2,
+};
+static const struct uc_kernels kernelsSsse3 = {
+   "ssse3", 16, codec_repeat3_encode_ssse3, codec_repeat3_decode_ssse3, codec_majority3_ssse3,
+};
+#elif defined(__ARM_NEON)
+static const struct uc_kernels kernelsNeon = {
+   "neon", 16, codec_repeat3_encode_neon, codec_repeat3_decode_neon, codec_majority3_neon,
+};
+#endif
+
+static const struct uc_kernels *simdKernels;  ///< Best kernels the CPU can run, NULL for none
+static int picked;                ///< Whether simdKernels has been worked out
+static int simdOn = 1;            ///< Set by uc_set_simd()
+static unsigned int repeatBlock = 128;  ///< Set by uc_set_repeat_block()
+
+/** @brief Returns the SIMD kernels to use, or NULL to do everything in C */
+static const struct uc_kernels *kernels(void){
+   if (!picked){
+#if defined(__x86_64__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+         simdKernels = &kernelsAvx2;
+      else if (__builtin_cpu_supports("ssse3"))
+         simdKernels = &kernelsSsse3;
+#elif defined(__ARM_NEON)
+      simdKernels = &kernelsNeon;
+#endif
+      picked = 1;
+   }
+   return simdOn ? simdKernels : NULL;
+}
+
+static void repeat3Encode(u8 *dst, const u8 *src, size_t n){
+   const struct uc_kernels *k = kernels();
+   size_t blocks;
+
+   if (k){
+      blocks = n & ~(k->step - 1);
+      k->encode(dst, src, blocks);
+      dst += 3*blocks;
+      src += blocks;
+      n -= blocks;
+   }
+   codec_repeat3_encode_c(dst, src, n);
+}
+
+static void repeat3Decode(u8 *dst, const u8 *src, size_t n, struct codec_stats *st){
+   const struct uc_kernels *k = kernels();
+   size_t blocks;
+
+   if (k){
+      blocks = n & ~(k->step - 1);
+      k->decode(dst, src, blocks, st);
+      dst += blocks;
+      src += 3*blocks;
+      n -= blocks;
+   }
+   codec_repeat3_decode_c(dst, src, n, st);
+}
+
+static void majority3(u8 *dst, const u8 *a, const u8 *b, const u8 *c, size_t n, struct codec_stats *st){
+   const struct uc_kernels *k = kernels();
+   size_t blocks;
+
+   if (k){
+      blocks = n & ~(k->step - 1);
+      k->majority(dst, a, b, c, blocks, st);
+      dst += blocks;
+      a += blocks;
+      b += blocks;
+      c += blocks;
+      n -= blocks;
+   }
+   codec_majority3_c(dst, a, b, c, n, st);
+}
+
+/** @brief Returns the plaintext and encoded block sizes of a codec, or 0 if there is no such codec */
+static int blockSizes(uint32_t codec, size_t *in, size_t *out){
+   switch (codec){
+   case UART_CODEC_REPEAT3:
+      *in = 1;
+      *out = 3;
+      return 1;
+   case UART_CODEC_REPEAT3I:
+      *in = repeatBlock;
+      *out = 3*repeatBlock;
+      return 1;
+   case UART_CODEC_HAMMING74:
+   case UART_CODEC_SECDED84:
+      *in = 1;
+      *out = 2;
+      return 1;
+   }
+   return 0;
+}
+
+/** @brief Sets errno for a codec the library cannot code */
+static ssize_t noCodec(uint32_t codec){
+   errno = codec == UART_CODEC_RS255 ? ENOTSUP : EINVAL;
+   return -1;
+}
+
+size_t uc_encoded_len(uint32_t codec, size_t n){
+   size_t in, out;
+
+   if (!blockSizes(codec, &in, &out))
+      return 0;
+   return (n + in - 1) / in * out;
+}
+
+ssize_t uc_encode(uint32_t codec, uint8_t *dst, const uint8_t *src, size_t n){
+   size_t len = uc_encoded_len(codec, n), take;
+   uint8_t *p = dst;
+
+   switch (codec){
+   case UART_CODEC_REPEAT3:
+      repeat3Encode(dst, src, n);
+      break;
+   case UART_CODEC_REPEAT3I:
+      while (n){                  // encodeRepeat3i() of codec.c
+         take = n<repeatBlock ? n : repeatBlock;
+         memcpy(p, src, take);
+         memset(p + take, 0, repeatBlock - take);
+         memcpy(p + repeatBlock, p, repeatBlock);
+         memcpy(p + 2*repeatBlock, p, repeatBlock);
+         p += 3*repeatBlock;
+         src += take;
+         n -= take;
+      }
+      break;
+   case UART_CODEC_HAMMING74:
+      codec_hamming_encode(encode74, dst, src, n);
+      break;
+   case UART_CODEC_SECDED84:
+      codec_hamming_encode(encode84, dst, src, n);
+      break;
+   default:
+      return noCodec(codec);
+   }
+   return len;
+}
+
+ssize_t uc_decode(uint32_t codec, uint8_t *dst, const uint8_t *src, size_t n, struct uc_stats *st){
+   struct codec_stats cs = {0, 0};
+   size_t in, out, blocks, k;
+
+   if (!blockSizes(codec, &in, &out))
+      return noCodec(codec);
+   blocks = n / out;
+   switch (codec){
+   case UART_CODEC_REPEAT3:
+      repeat3Decode(dst, src, blocks, &cs);
+      break;
+   case UART_CODEC_REPEAT3I:
+      for (k = 0; k < blocks; k++)
+         majority3(dst + k*in, src + k*out, src + k*out + in, src + k*out + 2*in, in, &cs);
+      break;
+   case UART_CODEC_HAMMING74:
+      codec_hamming_decode(decode74Lo, decode74Hi, dst, src, blocks, &cs);
+      break;
+   case UART_CODEC_SECDED84:
+      codec_hamming_decode(decode84Lo, decode84Hi, dst, src, blocks, &cs);
+      break;
+   }
+   if (st){
+      st->corrected += cs.corrected;
+      st->disagree += cs.disagree;
+   }
+   return blocks*in;
+}
+
+int uc_set_repeat_block(unsigned int block){
+   if (block<1 || block>MAX_REPEAT_BLOCK){
+      errno = EINVAL;
+      return -1;
+   }
+   repeatBlock = block;
+   return 0;
+}
+
+void uc_set_simd(int on){
+   simdOn = on;
+}
+
+const char *uc_kernels(void){
+   const struct uc_kernels *k = kernels();
+
+   return k ? k->name : "generic";
+}
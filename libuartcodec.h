@@ -0,0 +1,66 @@
+/**
+ * @file   libuartcodec.h
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Userspace version of the uartcodec coding kernels, for tools that encode or decode
+ * the serial stream without the modules, and to check the modules against. It builds the same C
+ * kernels as uartcodec.ko from codec_kernels.h and the same Hamming tables from gentables.c, so a
+ * buffer comes out bit for bit as /dev/UARTencode writes it unframed and decodes with the same
+ * corrected and disagree counts. On x86 it picks SSSE3 or AVX2 versions of the repetition code
+ * at run time and on ARM the NEON ones of the module. Build it with `make lib` and link with
+ * libuartcodec.a.
+ */
+
+#ifndef LIBUARTCODEC_H
+#define LIBUARTCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>            // ssize_t
+#include "uartcodec.h"            // UART_CODEC_* codes
+
+/** @brief What uc_decode() found, the counts behind corrected_bits and triplets_disagree */
+struct uc_stats {
+   uint64_t corrected;            ///< Bits put right
+   uint64_t disagree;             ///< Blocks seen damaged beyond repair
+};
+
+/** @brief Returns how many encoded bytes n plaintext bytes become, the last block padded, or 0
+ *  for a codec the library does not have
+ */
+size_t uc_encoded_len(uint32_t codec, size_t n);
+
+/** @brief Encodes n bytes with one of the UART_CODEC_* codes, an incomplete last block padded
+ *  with zeros
+ *  @param codec The UART_CODEC_* code
+ *  @param dst Where the uc_encoded_len(codec, n) encoded bytes go
+ *  @param src The n plaintext bytes
+ *  @param n The number of bytes to encode
+ *  @return returns the number of encoded bytes, or -1 with errno set
+ */
+ssize_t uc_encode(uint32_t codec, uint8_t *dst, const uint8_t *src, size_t n);
+
+/** @brief Decodes the whole blocks of n encoded bytes, a trailing incomplete block is ignored
+ *  @param codec The UART_CODEC_* code
+ *  @param dst Where the decoded bytes go, room for n bytes is always enough
+ *  @param src The n encoded bytes
+ *  @param n The number of encoded bytes
+ *  @param st Statistics to add to, or NULL
+ *  @return returns the number of decoded bytes, or -1 with errno set
+ */
+ssize_t uc_decode(uint32_t codec, uint8_t *dst, const uint8_t *src, size_t n, struct uc_stats *st);
+
+/** @brief Sets the block size of UART_CODEC_REPEAT3I, repeat_block of uartcodec.ko, 128 until
+ *  set. Not thread safe against coding calls in flight.
+ *  @return returns 0, or -1 with errno EINVAL if it is not 1 to 341
+ */
+int uc_set_repeat_block(unsigned int block);
+
+/** @brief Turns the SIMD kernels off (0) or back on, like the simd parameter of uartcodec.ko */
+void uc_set_simd(int on);
+
+/** @brief Returns the name of the kernels in use: "avx2", "ssse3", "neon" or "generic" */
+const char *uc_kernels(void);
+
+#endif
@@ -0,0 +1,310 @@
+/**
+ * @file   n_repeat3.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   A tty line discipline applying the three repeat code inline, as an alternative to the
+ * UARTencode and UARTdecode devices. Bytes written to the tty are trippled on their way to the
+ * driver and received bytes are majority decoded before a reader sees them. Attach it with
+ * "ldattach 29 /dev/ttyS4" once uartcodec.ko and this module are loaded.
+ */
+
+#include <linux/init.h>           // Macros used to mark up functions e.g. __init __exit
+#include <linux/module.h>         // Core header for loading LKMs into the kernel
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/tty.h>            // The tty layer
+#include <linux/tty_flip.h>       // tty_flip_buffer_push() to restart a stalled receive
+#include <linux/tty_ldisc.h>      // Line discipline operations
+#include <linux/kfifo.h>          // Ring buffer holding the decoded bytes
+#include <linux/slab.h>           // kzalloc() and kfree()
+#include <linux/poll.h>           // poll_wait()
+#include <linux/workqueue.h>      // Deferred transmit when the driver asks for more data
+#include "codec.h"                // Trippling and majority vote kernels from the uartcodec module
+
+#define  N_REPEAT3   29           ///< Line discipline number, the one Linux leaves free for development (N_DEVELOPMENT)
+#define  RX_SCRATCH  256          ///< Bytes decoded per pass in receive_buf
+#define  TX_BUF      3072         ///< Encoded bytes that may wait for room in the driver, a multiple of three
+
+MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
+MODULE_AUTHOR("Matthew Callahan");    ///< The author -- visible when you use modinfo
+MODULE_DESCRIPTION("A line discipline encoding and decoding the three repeat code inline");  ///< The description -- see modinfo
+MODULE_VERSION("0.1");            ///< A version number to inform users
+MODULE_ALIAS_LDISC(N_REPEAT3);
+
+static unsigned int rx_size = 65536;        ///< Size of each tty's decoded byte buffer
+module_param(rx_size, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_size, "Size in bytes of the decoded receive buffer of each tty (default 65536)");
+
+/** @brief The state of one tty using the line discipline, kept in tty->disc_data */
+struct repeat3 {
+   struct tty_struct *tty;           ///< The tty this belongs to
+   struct kfifo rx;                  ///< Decoded bytes waiting for a reader
+   spinlock_t rxLock;                ///< Protects rx, carry and stalled between receive_buf2, readers and flushes
+   u8 carry[3];                      ///< Start of a triplet split across receive_buf2 calls
+   unsigned int carryLen;            ///< Number of bytes in carry
+   bool stalled;                     ///< receive_buf2 left bytes in the tty layer for want of room in rx
+   u8 rxScratch[RX_SCRATCH];         ///< Decoded bytes on their way into rx
+   struct mutex txLock;              ///< Protects the transmit buffer
+   u8 txBuf[TX_BUF];                 ///< Encoded bytes the driver has not taken yet
+   size_t txHead, txLen;             ///< Start and length of the pending bytes in txBuf
+   struct work_struct txWork;        ///< Pushes txBuf to the driver after a write wakeup
+};
+
+/** @brief Hands as much of the transmit buffer to the driver as it will take. If some is left
+ *  the driver is asked for a wakeup once it has room. Called with txLock held.
+ */
+static void txPush(struct repeat3 *r3){
+   struct tty_struct *tty = r3->tty;
+   int sent;
+
+   while (r3->txLen){
+      set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+      sent = tty->ops->write(tty, r3->txBuf + r3->txHead, r3->txLen);
+      if (sent <= 0)
+         return;                     // the driver is full, write_wakeup resumes from here
+      r3->txHead += sent;
+      r3->txLen -= sent;
+   }
+   clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+   r3->txHead = 0;
+   wake_up_interruptible(&tty->write_wait);
+}
+
+/** @brief Work item resuming transmission after the driver made room */
+static void txWork(struct work_struct *work){
+   struct repeat3 *r3 = container_of(work, struct repeat3, txWork);
+
+   mutex_lock(&r3->txLock);
+   txPush(r3);
+   mutex_unlock(&r3->txLock);
+}
+
+/** @brief Called when the line discipline is attached to a tty
+ *  @param tty The tty being attached to
+ *  @return returns 0 if successful
+ */
+static int r3_open(struct tty_struct *tty){
+   struct repeat3 *r3 = kzalloc(sizeof(*r3), GFP_KERNEL);
+
+   if (!r3)
+      return -ENOMEM;
+   if (kfifo_alloc(&r3->rx, rx_size, GFP_KERNEL)){
+      kfree(r3);
+      return -ENOMEM;
+   }
+   r3->tty = tty;
+   spin_lock_init(&r3->rxLock);
+   mutex_init(&r3->txLock);
+   INIT_WORK(&r3->txWork, txWork);
+   tty->disc_data = r3;
+   return 0;
+}
+
+/** @brief Called when the line discipline is detached from a tty */
+static void r3_close(struct tty_struct *tty){
+   struct repeat3 *r3 = tty->disc_data;
+
+   clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+   cancel_work_sync(&r3->txWork);
+   kfifo_free(&r3->rx);
+   kfree(r3);
+   tty->disc_data = NULL;
+}
+
+/** @brief Discards everything received but not read yet */
+static void r3_flush_buffer(struct tty_struct *tty){
+   struct repeat3 *r3 = tty->disc_data;
+   unsigned long flags;
+
+   spin_lock_irqsave(&r3->rxLock, flags);
+   kfifo_reset(&r3->rx);
+   r3->carryLen = 0;
+   spin_unlock_irqrestore(&r3->rxLock, flags);
+}
+
+/** @brief Called by the tty layer with bytes received from the driver. Complete triplets are
+ *  majority decoded in place of the driver's buffer and a split one is carried to the next call.
+ *  Only as many bytes are taken as decode into the room left in rx, the tty layer keeps the rest,
+ *  which throttles the driver once its own buffers fill up, until a read makes room and restarts
+ *  delivery. The flags are ignored, a byte the UART marked bad is outvoted like any other error.
+ *  @param tty The tty the bytes arrived on
+ *  @param cp The received bytes
+ *  @param fp Per-byte error flags, may be NULL
+ *  @param count The number of received bytes
+ *  @return returns the number of bytes taken
+ */
+static int r3_receive_buf2(struct tty_struct *tty, const unsigned char *cp, char *fp, int count){
+   struct repeat3 *r3 = tty->disc_data;
+   unsigned long flags;
+   unsigned int avail;
+   size_t n;
+   int left = count;
+
+   spin_lock_irqsave(&r3->rxLock, flags);
+   avail = kfifo_avail(&r3->rx);
+   if (r3->carryLen && avail){
+      while (r3->carryLen < 3 && left){
+         r3->carry[r3->carryLen++] = *cp++;
+         left--;
+      }
+      if (r3->carryLen == 3){
+         codec_repeat3_decode(r3->rxScratch, r3->carry, 1, NULL);
+         kfifo_in(&r3->rx, r3->rxScratch, 1);
+         r3->carryLen = 0;
+         avail--;
+      }
+   }
+   while (left >= 3 && avail){
+      n = min3((size_t)left/3, (size_t)RX_SCRATCH, (size_t)avail);
+      codec_repeat3_decode(r3->rxScratch, cp, n, NULL);
+      kfifo_in(&r3->rx, r3->rxScratch, n);
+      cp += 3*n;
+      left -= 3*n;
+      avail -= n;
+   }
+   if (left < 3 && avail){            // the start of a triplet, room for it is there
+      memcpy(r3->carry + r3->carryLen, cp, left);
+      r3->carryLen += left;
+      left = 0;
+   }
+   r3->stalled = left > 0;
+   spin_unlock_irqrestore(&r3->rxLock, flags);
+   if (left < count)
+      wake_up_interruptible(&tty->read_wait);
+   return count - left;
+}
+
+/** @brief Called when a reader reads the tty. It sleeps until a decoded byte is there unless the
+ *  file is non-blocking.
+ *  @return returns the number of bytes read or a negative error
+ */
+static ssize_t r3_read(struct tty_struct *tty, struct file *file, unsigned char *buf, size_t nr, void **cookie, unsigned long offset){
+   struct repeat3 *r3 = tty->disc_data;
+   unsigned long flags;
+   bool stalled;
+   int ret;
+
+   while (kfifo_is_empty(&r3->rx)){
+      if (tty_hung_up_p(file) || test_bit(TTY_OTHER_CLOSED, &tty->flags))
+         return 0;
+      if (file->f_flags & O_NONBLOCK)
+         return -EAGAIN;
+      ret = wait_event_interruptible(tty->read_wait, !kfifo_is_empty(&r3->rx) || tty_hung_up_p(file));
+      if (ret)
+         return ret;
+   }
+   spin_lock_irqsave(&r3->rxLock, flags);
+   ret = kfifo_out(&r3->rx, buf, nr);
+   stalled = r3->stalled;
+   r3->stalled = false;
+   spin_unlock_irqrestore(&r3->rxLock, flags);
+   if (stalled)
+      tty_flip_buffer_push(tty->port);      // requeue the flip work to hand over what receive_buf2 had no room for
+   return ret;
+}
+
+/** @brief Called when a writer writes the tty. The bytes are trippled into the transmit buffer
+ *  and pushed to the driver, sleeping while the buffer is full unless the file is non-blocking.
+ *  @return returns the number of plaintext bytes taken or a negative error
+ */
+static ssize_t r3_write(struct tty_struct *tty, struct file *file, const unsigned char *buf, size_t nr){
+   struct repeat3 *r3 = tty->disc_data;
+   size_t done = 0;
+   size_t chunk;
+   int ret;
+
+   while (done < nr){
+      mutex_lock(&r3->txLock);
+      if (r3->txHead){                // move what is pending to the front to make room
+         memmove(r3->txBuf, r3->txBuf + r3->txHead, r3->txLen);
+         r3->txHead = 0;
+      }
+      chunk = min(nr - done, (TX_BUF - r3->txLen)/3);
+      if (chunk){
+         codec_repeat3_encode(r3->txBuf + r3->txLen, buf + done, chunk);
+         r3->txLen += 3*chunk;
+         done += chunk;
+         txPush(r3);
+      }
+      mutex_unlock(&r3->txLock);
+      if (chunk)
+         continue;
+      if (done)
+         break;
+      if (tty_hung_up_p(file))
+         return -EIO;
+      if (file->f_flags & O_NONBLOCK)
+         return -EAGAIN;
+      ret = wait_event_interruptible(tty->write_wait, READ_ONCE(r3->txLen) <= TX_BUF - 3 || tty_hung_up_p(file));
+      if (ret)
+         return ret;
+   }
+   return done;
+}
+
+/** @brief Called by the driver when it has room for more bytes, possibly from interrupt context */
+static void r3_write_wakeup(struct tty_struct *tty){
+   struct repeat3 *r3 = tty->disc_data;
+
+   clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+   schedule_work(&r3->txWork);
+}
+
+/** @brief Reports whether a read or a write would go ahead without sleeping */
+static __poll_t r3_poll(struct tty_struct *tty, struct file *file, poll_table *wait){
+   struct repeat3 *r3 = tty->disc_data;
+   __poll_t mask = 0;
+
+   poll_wait(file, &tty->read_wait, wait);
+   poll_wait(file, &tty->write_wait, wait);
+   if (!kfifo_is_empty(&r3->rx))
+      mask |= EPOLLIN | EPOLLRDNORM;
+   if (READ_ONCE(r3->txLen) <= TX_BUF - 3)
+      mask |= EPOLLOUT | EPOLLWRNORM;
+   if (tty_hung_up_p(file))
+      mask |= EPOLLHUP;
+   return mask;
+}
+
+/** @brief Termios and the other standard tty ioctls still work with the discipline attached */
+static int r3_ioctl(struct tty_struct *tty, struct file *file, unsigned int cmd, unsigned long arg){
+   return n_tty_ioctl_helper(tty, file, cmd, arg);
+}
+
+static struct tty_ldisc_ops repeat3Ldisc = {
+   .owner = THIS_MODULE,
+   .magic = TTY_LDISC_MAGIC,
+   .name = "n_repeat3",
+   .open = r3_open,
+   .close = r3_close,
+   .flush_buffer = r3_flush_buffer,
+   .read = r3_read,
+   .write = r3_write,
+   .ioctl = r3_ioctl,
+   .poll = r3_poll,
+   .receive_buf2 = r3_receive_buf2,
+   .write_wakeup = r3_write_wakeup,
+};
+
+/** @brief The LKM initialization function, registers the line discipline
+ *  @return returns 0 if successful
+ */
+static int __init repeat3Init(void){
+   int err = tty_register_ldisc(N_REPEAT3, &repeat3Ldisc);
+
+   if (err){
+      printk(KERN_ALERT "Repeat3 failed to register line discipline %d (%d)\n", N_REPEAT3, err);
+      return err;
+   }
+   printk(KERN_INFO "Repeat3: registered line discipline %d\n", N_REPEAT3);
+   return 0;
+}
+
+/** @brief The LKM cleanup function, only possible once no tty uses the discipline */
+static void __exit repeat3Exit(void){
+   tty_unregister_ldisc(N_REPEAT3);
+   printk(KERN_INFO "Repeat3: Goodbye from the LKM!\n");
+}
+
+module_init(repeat3Init);
+module_exit(repeat3Exit);
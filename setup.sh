@@ -8,8 +8,19 @@ config-pin P8_37 uart
 stty -F /dev/ttyS4 115200 raw -echo
 stty -F /dev/ttyS5 115200 raw -echo
 
-sudo insmod encode.ko
-sudo insmod decode.ko
+sudo insmod uartcodec.ko
+#"./setup.sh direct" lets the modules drive the UARTs themselves
+if [ "$1" == "direct" ]; then
+  sudo insmod encode.ko tty=/dev/ttyS4
+  sudo insmod decode.ko tty=/dev/ttyS5
+#"./setup.sh adaptive" also lets them find the fastest code and baud rate the link takes
+elif [ "$1" == "adaptive" ]; then
+  sudo insmod encode.ko tty=/dev/ttyS4 framed=1 adapt=1
+  sudo insmod decode.ko tty=/dev/ttyS5 framed=1 adapt=1
+else
+  sudo insmod encode.ko
+  sudo insmod decode.ko
+fi
 
 sudo chmod 666 /dev/UARTdecode
 sudo chmod 666 /dev/UARTencode
@@ -0,0 +1,195 @@
+/**
+ * @file   transport.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Lets the encode and decode modules use a serial port directly, so the encoded stream
+ * goes from the codec to the UART without a trip through userspace. The port is opened like
+ * any other file for writing, and received bytes are handed to a callback straight from the
+ * tty layer's receive path as the driver's DMA completions push them.
+ */
+
+#include <linux/module.h>         // EXPORT_SYMBOL_GPL()
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/fs.h>             // filp_open() and kernel_write()
+#include <linux/err.h>            // IS_ERR() and PTR_ERR()
+#include <linux/tty.h>            // tty_kopen_shared(), tty_kref_put() and the port of a tty
+#include <linux/tty_flip.h>       // tty_flip_buffer_push()
+#include "codec.h"
+#include "uartcodec.h"            // UART_CODEC_*
+
+/** @brief The settings an adaptive link steps through, in order of payload rate: at 0 what
+ *  setup.sh configures, then lighter codes and faster clocks up to the 3.6 Mbaud the OMAP UARTs
+ *  reach from their 48 MHz clock. Both ends must have the same table.
+ */
+const struct codec_rate codec_ladder[CODEC_LADDER_LEN] = {
+   { UART_CODEC_REPEAT3,  115200 },
+   { UART_CODEC_SECDED84, 115200 },
+   { UART_CODEC_SECDED84, 460800 },
+   { UART_CODEC_RS255,    460800 },
+   { UART_CODEC_RS255,    921600 },
+   { UART_CODEC_RS255,    1500000 },
+   { UART_CODEC_RS255,    3000000 },
+   { UART_CODEC_RS255,    3686400 },
+};
+EXPORT_SYMBOL_GPL(codec_ladder);
+
+/** @brief Opens the serial port at path for reading and writing. It must already be set up
+ *  with stty (raw, no echo, baud rate) as done in setup.sh. Anything but a tty is refused: the
+ *  device number of the file is looked up among the open ttys, which also holds a reference to
+ *  the tty for as long as the transport is open.
+ *  @param t The transport to set up
+ *  @param path The tty device, e.g. /dev/ttyS4
+ *  @return returns 0 if successful
+ */
+int codec_tty_open(struct codec_tty *t, const char *path){
+   struct inode *inode;
+   struct tty_struct *tty;
+
+   memset(t, 0, sizeof(*t));
+   t->file = filp_open(path, O_RDWR | O_NOCTTY, 0);
+   if (IS_ERR(t->file)){
+      int err = PTR_ERR(t->file);
+      t->file = NULL;
+      printk(KERN_ALERT "Codec: failed to open %s (%d)\n", path, err);
+      return err;
+   }
+   inode = file_inode(t->file);
+   tty = S_ISCHR(inode->i_mode) ? tty_kopen_shared(inode->i_rdev) : NULL;   // open through file, so it is found
+   if (IS_ERR_OR_NULL(tty)){
+      filp_close(t->file, NULL);
+      t->file = NULL;
+      printk(KERN_ALERT "Codec: %s is not a tty\n", path);
+      return -ENOTTY;
+   }
+   t->tty = tty;
+   return 0;
+}
+EXPORT_SYMBOL_GPL(codec_tty_open);
+
+/** @brief Writes all n bytes to the serial port, sleeping while its output buffer is full. Only
+ *  one thread may write to a transport at a time.
+ *  @return returns 0 if successful or a negative error if the write was interrupted or failed
+ */
+int codec_tty_write(struct codec_tty *t, const u8 *buf, size_t n){
+   ssize_t ret;
+
+   while (n){
+      ret = kernel_write(t->file, buf, n, &t->txPos);
+      if (ret < 0)
+         return ret;
+      buf += ret;
+      n -= ret;
+   }
+   return 0;
+}
+EXPORT_SYMBOL_GPL(codec_tty_write);
+
+/** @brief Called by the tty layer's flip buffer work with what the driver has received, in place
+ *  of the line discipline. The driver pushes its buffers on every RX DMA completion or FIFO
+ *  interrupt, so the bytes reach the callback without a copy through n_tty or a thread waking
+ *  up to read them. The per-byte error flags are ignored, the codec outvotes bad bytes.
+ *  @return returns the number of bytes taken; the tty layer keeps the rest until
+ *  codec_tty_rx_resume() is called
+ */
+static int rxReceive(struct tty_port *port, const unsigned char *cp, const unsigned char *fp, size_t count){
+   struct codec_tty *t = port->client_data;
+
+   return t->receive(t->priv, cp, count);
+}
+
+/** @brief Passes write wakeups on to the tty's own line discipline, writes still go through it */
+static void rxWriteWakeup(struct tty_port *port){
+   struct codec_tty *t = port->client_data;
+
+   t->oldOps->write_wakeup(port);
+}
+
+static const struct tty_port_client_operations rxOps = {
+   .receive_buf = rxReceive,
+   .write_wakeup = rxWriteWakeup,
+};
+
+/** @brief Has receive(priv, data, n) called with every block the port receives, straight from
+ *  the tty layer's flip buffer work. The callback runs in process context and may take a mutex
+ *  but must not wait for readers; it returns how much it took, and once it has room for more
+ *  the owner calls codec_tty_rx_resume().
+ *
+ *  The port's client operations are swapped below the line discipline instead of attaching one,
+ *  so the port keeps its own for writes. This is safe because flush_to_ldisc() only calls
+ *  client_ops->receive_buf with port->buf.lock held, which tty_buffer_lock_exclusive() takes
+ *  too, so no call sees the swap half done. The line discipline is only reached through the old
+ *  operations, so a TIOCSETD meanwhile just changes tty->ldisc, which rxOps never touch, and
+ *  write wakeups are passed on to it. The file and the tty reference taken by codec_tty_open()
+ *  keep the port alive through a hangup, after which writes fail until the transport is closed.
+ *  @return returns 0 if successful
+ */
+int codec_tty_start_rx(struct codec_tty *t, size_t (*receive)(void *, const u8 *, size_t), void *priv){
+   if (!t->tty->port)
+      return -ENOTTY;
+   t->receive = receive;
+   t->priv = priv;
+   t->port = t->tty->port;
+   tty_buffer_lock_exclusive(t->port);     // no receive_buf call is running while the operations change
+   t->oldOps = t->port->client_ops;
+   t->oldData = t->port->client_data;
+   t->port->client_data = t;
+   t->port->client_ops = &rxOps;
+   tty_buffer_unlock_exclusive(t->port);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(codec_tty_start_rx);
+
+/** @brief Restarts delivery of the bytes the receive callback left in the tty layer */
+void codec_tty_rx_resume(struct codec_tty *t){
+   if (t->port)
+      tty_flip_buffer_push(t->port);
+}
+EXPORT_SYMBOL_GPL(codec_tty_rx_resume);
+
+/** @brief Gives the port back to its line discipline if receiving was started. Once it returns
+ *  the receive callback is not running and will not be called again.
+ */
+void codec_tty_stop_rx(struct codec_tty *t){
+   if (t->port){
+      tty_buffer_lock_exclusive(t->port);   // waits for a receive callback in progress
+      t->port->client_ops = t->oldOps;
+      t->port->client_data = t->oldData;
+      tty_buffer_unlock_exclusive(t->port);
+      t->port = NULL;
+   }
+}
+EXPORT_SYMBOL_GPL(codec_tty_stop_rx);
+
+/** @brief Waits for everything written to the serial port to leave the UART, then changes its
+ *  baud rate, like the stty call of setup.sh does. The one thread writing to the transport calls
+ *  this between writes.
+ *  @param t The transport
+ *  @param baud The new rate, which need not be a standard one
+ *  @return returns 0 if successful
+ */
+int codec_tty_set_baud(struct codec_tty *t, unsigned int baud){
+   struct ktermios termios;
+
+   tty_wait_until_sent(t->tty, HZ);
+   termios = t->tty->termios;
+   termios.c_cflag &= ~CBAUD;
+   tty_termios_encode_baud_rate(&termios, baud, baud);
+   tty_set_termios(t->tty, &termios);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(codec_tty_set_baud);
+
+/** @brief Gives the port back to its line discipline if receiving was started and closes it */
+void codec_tty_close(struct codec_tty *t){
+   codec_tty_stop_rx(t);
+   if (t->tty){
+      tty_kref_put(t->tty);
+      t->tty = NULL;
+   }
+   if (t->file){
+      filp_close(t->file, NULL);
+      t->file = NULL;
+   }
+}
+EXPORT_SYMBOL_GPL(codec_tty_close);
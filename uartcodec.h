@@ -0,0 +1,218 @@
+/**
+ * @file   uartcodec.h
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   Definitions shared by the encode and decode modules and the userspace programs
+ * that talk to them. Everything here describes bytes on the wire or the device interface, so
+ * it must stay usable from both kernel and userspace code.
+ */
+
+#ifndef UARTCODEC_H
+#define UARTCODEC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define UART_FRAME_MAGIC   0xA5      ///< First byte of every frame header, used to find frames
+#define UART_FRAME_MAXLEN  65535     ///< Largest payload length a header can describe
+
+/** @brief Header sent in front of every frame in framed mode. The payload follows it directly
+ *  and is exactly len bytes long, so binary data including zeros goes through unchanged. Multi
+ *  byte fields are little endian and kept as byte arrays so the layout does not depend on the host.
+ */
+struct uart_frame_hdr {
+   __u8 magic;                       ///< Always UART_FRAME_MAGIC
+   __u8 flags;                       ///< Frame options, UART_FRAME_* bits
+   __u8 seq[2];                      ///< Sequence number, incremented for every frame sent
+   __u8 len[2];                      ///< Number of payload bytes that follow the header
+   __u8 reserved;                    ///< Zero
+   __u8 check;                       ///< XOR of the bytes above, lets the receiver reject false magic bytes
+};
+
+#define UART_FRAME_HDR_SIZE sizeof(struct uart_frame_hdr)
+
+#define UART_FRAME_BOND    0x01      ///< The frame belongs to the bonded stream, seq numbers it across all links
+#define UART_FRAME_CTRL    0x02      ///< The payload is a struct uart_ctrl for the module at the other end, not data
+#define UART_FRAME_CRC     0x04      ///< UART_FRAME_CRC_SIZE check bytes follow the payload, see below
+#define UART_FRAME_ACK     0x08      ///< The payload is a struct uart_ack, sent back by the decoder
+#define UART_FRAME_TIME    0x10      ///< A struct uart_stamp follows the payload, see below
+#define UART_FRAME_LZ4     0x20      ///< The payload is LZ4 compressed, see below
+
+/** The payload of a UART_FRAME_LZ4 frame is one LZ4 block as lib/lz4 compresses it, without the
+ *  header of the LZ4 frame format, and len counts the compressed bytes. It decompresses to at most
+ *  1024 bytes. The encoder only sets the flag where compressing made the payload smaller, and any
+ *  CRC covers the compressed bytes.
+ */
+
+/** The check bytes of a UART_FRAME_CRC frame are the CRC-32 (IEEE 802.3, the one of zlib's
+ *  crc32()) of the header followed by the payload, little endian. They are not counted in len.
+ */
+#define UART_FRAME_CRC_SIZE 4
+
+/** @brief Trailer of a UART_FRAME_TIME frame, between the payload and any check bytes and not
+ *  counted in len. The times are the encoder's CLOCK_MONOTONIC in nanoseconds, so the decoder can
+ *  only measure against them when both modules run on the same machine, as with UART4 wired to
+ *  UART5 of one BeagleBone.
+ */
+struct uart_stamp {
+   __u8 written[8];                  ///< When the chunk was written to the encoder, little endian
+   __u8 encoded[8];                  ///< When the frame was encoded for the serial port, little endian
+};
+
+#define UART_FRAME_STAMP_SIZE sizeof(struct uart_stamp)
+
+/** @brief Payload of an acknowledgement, which the decoder of a link with selective repeat (arq=1)
+ *  sends back unencoded on the same serial port. The encoder sends again whatever it does not
+ *  cover once nothing new has been acknowledged for a while, or at once if frames after it are.
+ */
+struct uart_ack {
+   __u8 next[2];                     ///< Every frame before this sequence number has arrived
+   __u8 mask[4];                     ///< Bit i set if frame next+1+i has arrived as well, little endian
+};
+
+/** @brief Computes the check byte over the first seven header bytes */
+static inline __u8 uart_frame_checksum(const struct uart_frame_hdr *hdr){
+   const __u8 *p = (const __u8 *)hdr;
+   __u8 check = 0x5A;
+   unsigned int i;
+
+   for (i = 0; i < UART_FRAME_HDR_SIZE - 1; i++)
+      check ^= p[i];
+   return check;
+}
+
+/** @brief Fills in a frame header for a payload of len bytes */
+static inline void uart_frame_init(struct uart_frame_hdr *hdr, __u8 flags, __u16 seq, __u16 len){
+   hdr->magic = UART_FRAME_MAGIC;
+   hdr->flags = flags;
+   hdr->seq[0] = seq & 0xff;
+   hdr->seq[1] = seq >> 8;
+   hdr->len[0] = len & 0xff;
+   hdr->len[1] = len >> 8;
+   hdr->reserved = 0;
+   hdr->check = uart_frame_checksum(hdr);
+}
+
+/** @brief Returns nonzero if the header has the magic byte and a matching check byte */
+static inline int uart_frame_valid(const struct uart_frame_hdr *hdr){
+   return hdr->magic == UART_FRAME_MAGIC && hdr->check == uart_frame_checksum(hdr);
+}
+
+static inline __u16 uart_frame_seq(const struct uart_frame_hdr *hdr){
+   return hdr->seq[0] | (hdr->seq[1] << 8);
+}
+
+static inline __u16 uart_frame_len(const struct uart_frame_hdr *hdr){
+   return hdr->len[0] | (hdr->len[1] << 8);
+}
+
+/** @brief Payload of a control frame, with which the two ends of an adaptive link (adapt=1) agree
+ *  on the code and baud rate. A level is a step of a ladder both modules know, from the most
+ *  robust and slowest setting at 0 up to the fastest. The encoder sends UART_CTRL_LEVEL and
+ *  UART_CTRL_SWITCH in the encoded stream; the decoder sends UART_CTRL_REPORT back unencoded on
+ *  the same serial port, often enough that a lost one does not matter.
+ */
+struct uart_ctrl {
+   __u8 type;                        ///< One of the UART_CTRL_* messages
+   __u8 level;                       ///< The sender's level, for UART_CTRL_SWITCH the one everything after the frame is at
+   __u8 want;                        ///< UART_CTRL_REPORT: the level the decoder asks for, otherwise level
+   __u8 check;                       ///< XOR of the bytes above, reports have no codec protecting them
+};
+
+#define UART_CTRL_LEVEL    1         ///< Still at level, sent when nothing else is so the decoder knows the link is up
+#define UART_CTRL_SWITCH   2         ///< Everything after this frame is coded and sent at level
+#define UART_CTRL_REPORT   3         ///< What the decoder at level measured, asking for want
+
+/** @brief Fills in a control message */
+static inline void uart_ctrl_init(struct uart_ctrl *msg, __u8 type, __u8 level, __u8 want){
+   msg->type = type;
+   msg->level = level;
+   msg->want = want;
+   msg->check = 0x5A ^ type ^ level ^ want;
+}
+
+/** @brief Returns nonzero if the control message has a matching check byte */
+static inline int uart_ctrl_valid(const struct uart_ctrl *msg){
+   return msg->check == (0x5A ^ msg->type ^ msg->level ^ msg->want);
+}
+
+/** @brief Control block at the start of a shared ring mapping (see ENC_IOC_RING_SETUP). The
+ *  indices run freely and are reduced modulo the region size, so head - tail is always the
+ *  number of bytes waiting. Each index has exactly one writer: userspace produces plaintext at
+ *  in_head and consumes encoded bytes at out_tail, the module advances the other two.
+ */
+struct uart_ring_ctrl {
+   __u32 in_head;                    ///< Plaintext bytes produced by userspace
+   __u32 in_tail;                    ///< Plaintext bytes consumed by the encoder
+   __u32 out_head;                   ///< Encoded bytes produced by the encoder
+   __u32 out_tail;                   ///< Encoded bytes consumed by userspace
+};
+
+/** @brief Argument of ENC_IOC_RING_SETUP. Userspace chooses the region sizes, which must be
+ *  powers of two of at least one page, and gets back where they are in the mapping.
+ */
+struct uart_ring_setup {
+   __u32 in_size;                    ///< In: size of the plaintext region
+   __u32 out_size;                   ///< In: size of the encoded region
+   __u32 in_offset;                  ///< Out: offset of the plaintext region in the mapping
+   __u32 out_offset;                 ///< Out: offset of the encoded region in the mapping
+   __u32 map_size;                   ///< Out: length to pass to mmap()
+};
+
+/** @brief One record of a batch (see ENC_IOC_SUBMIT_BATCH). Every record is coded on its own:
+ *  the encoder turns in into one frame in framed mode, or just encodes it, and the decoder
+ *  turns exactly that back into the original bytes.
+ */
+struct uart_batch_rec {
+   __u64 in;                         ///< In: user address of the in_len input bytes
+   __u64 out;                        ///< In: user address of a buffer for out_cap output bytes
+   __u32 in_len;                     ///< In: number of input bytes
+   __u32 out_cap;                    ///< In: size of the output buffer
+   __u32 out_len;                    ///< Out: bytes written to out, or needed if status is -EMSGSIZE
+   __s32 status;                     ///< Out: 0, or a negative errno for this record alone
+};
+
+/** @brief One record of DEC_IOC_SUBMIT_SOFT. Besides the decoded bytes the decoder writes a mask
+ *  for every one of them, with the bits set that it was not sure of: those where the copies of a
+ *  repetition code did not all agree, or the nibble of a Hamming codeword that was repaired or
+ *  beyond repair. A zero mask is a byte that arrived clean. With it a higher layer can ask for
+ *  just the doubtful bytes again, or accept a record whose doubts its own check clears.
+ */
+struct uart_soft_rec {
+   struct uart_batch_rec rec;        ///< The record as for DEC_IOC_SUBMIT_BATCH
+   __u64 mask;                       ///< In: user address of a buffer of out_cap bytes for the masks
+};
+
+/** @brief Argument of ENC_IOC_SUBMIT_BATCH, DEC_IOC_SUBMIT_BATCH and DEC_IOC_SUBMIT_SOFT */
+struct uart_batch {
+   __u64 recs;                       ///< In: user address of an array of count records
+   __u32 count;                      ///< In: number of records, at most UART_BATCH_MAX
+   __u32 done;                       ///< Out: records processed, all of them unless an address was bad
+};
+
+#define UART_BATCH_MAX      1024     ///< Most records in one batch
+
+#define UART_IOC_MAGIC      'u'
+#define ENC_IOC_RING_SETUP  _IOWR(UART_IOC_MAGIC, 1, struct uart_ring_setup) ///< Creates the shared ring of this file
+#define ENC_IOC_KICK        _IO(UART_IOC_MAGIC, 2)   ///< Encodes the waiting plaintext, returns the number of bytes taken
+#define UART_IOC_SET_CODEC  _IOW(UART_IOC_MAGIC, 3, __u32) ///< Switches this file to one of the UART_CODEC_* codes
+#define UART_IOC_GET_CODEC  _IOR(UART_IOC_MAGIC, 4, __u32) ///< Returns the UART_CODEC_* code this file uses
+#define ENC_IOC_SUBMIT_BATCH _IOWR(UART_IOC_MAGIC, 5, struct uart_batch) ///< Encodes many records in one call
+#define DEC_IOC_SUBMIT_BATCH _IOWR(UART_IOC_MAGIC, 6, struct uart_batch) ///< Decodes many records in one call
+#define DEC_IOC_SUBMIT_SOFT  _IOWR(UART_IOC_MAGIC, 7, struct uart_batch) ///< Decodes many struct uart_soft_rec records with their masks
+#define UART_IOC_SET_COMPRESS _IOW(UART_IOC_MAGIC, 8, __u32) ///< Switches the writes of this file to one of the UART_COMPRESS_* modes, framed only
+#define UART_IOC_GET_COMPRESS _IOR(UART_IOC_MAGIC, 9, __u32) ///< Returns the UART_COMPRESS_* mode this file uses
+
+// Compression of the encoder's frames, as used with UART_IOC_SET_COMPRESS
+#define UART_COMPRESS_NONE   0       ///< Payloads go as they are written
+#define UART_COMPRESS_LZ4    1       ///< Every payload LZ4 compressed where that makes it smaller, see UART_FRAME_LZ4
+
+// Error correcting codes understood by both modules, as used with UART_IOC_SET_CODEC
+#define UART_CODEC_REPEAT3   0       ///< Every byte sent three times and majority voted, 3x
+#define UART_CODEC_HAMMING74 1       ///< Every nibble as a Hamming(7,4) codeword in one byte, 2x, corrects one bit per nibble
+#define UART_CODEC_SECDED84  2       ///< Extended Hamming(8,4), 2x, corrects one bit and detects two per nibble
+#define UART_CODEC_RS255     3       ///< Interleaved Reed-Solomon RS(255,223), 1.14x, corrects bursts
+#define UART_CODEC_REPEAT3I  4       ///< Repetition code sending whole blocks three times over, 3x, survives bursts shorter than a block
+
+#endif
@@ -0,0 +1,360 @@
+/**
+ * @file   uartloop.c
+ * @author Matthew Callahan
+ * @date   11 November 2021
+ * @version 0.1
+ * @brief   A loopback device for measuring the codecs without a UART in the way. Everything
+ * written to /dev/UARTloop is encoded, has bit errors injected at the rate set by ber_ppm, is
+ * decoded again and compared with what was written. Only the time spent in the codec is counted,
+ * and the results are shown in /sys/class/uloop/UARTloop/stats/.
+ */
+
+#include <linux/init.h>           // Macros used to mark up functions e.g. __init __exit
+#include <linux/module.h>         // Core header for loading LKMs into the kernel
+#include <linux/device.h>         // Header to support the kernel Driver Model
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/fs.h>             // Header for the Linux file system support
+#include <linux/uaccess.h>        // get_user() and put_user()
+#include <linux/uio.h>            // struct iov_iter
+#include <linux/mutex.h>          // Serializes writers sharing a file
+#include <linux/spinlock.h>       // Protects the statistics
+#include <linux/mm.h>             // kvzalloc()
+#include <linux/random.h>         // Seeds of the error injection
+#include <linux/prandom.h>        // Fast pseudo random numbers for the error injection
+#include <linux/ktime.h>          // Timing of the codec
+#include <linux/math64.h>         // 64-bit division
+#include <linux/moduleparam.h>    // The ber_ppm setter
+#include "uartcodec.h"            // UART_IOC_* calls
+#include "codec.h"                // Codecs from the uartcodec module
+
+
+#define  DEVICE_NAME "UARTloop"   ///< The device will appear at /dev/UARTloop using this value
+#define  CLASS_NAME  "uloop"      ///< The device class -- this is a character device driver
+#define  LOOP_CHUNK  4096         ///< Most plaintext bytes sent round the loop at once
+
+
+MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
+MODULE_AUTHOR("Matthew Callahan");    ///< The author -- visible when you use modinfo
+MODULE_DESCRIPTION("Loopback device running encode, error injection and decode back to back");  ///< The description -- see modinfo
+MODULE_VERSION("0.1");            ///< A version number to inform users
+
+static char  *codec = "repeat3";            ///< Name of the code files start out with
+module_param(codec, charp, S_IRUGO);
+MODULE_PARM_DESC(codec, "Error correcting code, repeat3, repeat3i, hamming74, secded84 or rs255 (default repeat3)");
+static unsigned int ber_ppm = 0;            ///< Bit errors injected per million encoded bits
+
+/** @brief Sets ber_ppm, refusing rates above one error per bit */
+static int berSet(const char *val, const struct kernel_param *kp){
+   unsigned int ppm;
+   int err = kstrtouint(val, 0, &ppm);
+
+   if (err)
+      return err;
+   if (ppm>1000000)
+      return -EINVAL;
+   WRITE_ONCE(ber_ppm, ppm);
+   return 0;
+}
+
+static const struct kernel_param_ops berOps = {
+   .set = berSet,
+   .get = param_get_uint,
+};
+module_param_cb(ber_ppm, &berOps, &ber_ppm, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ber_ppm, "Bit errors injected per million encoded bits, can be changed at any time (default 0)");
+
+/** @brief The state of one open file, kept in filep->private_data */
+struct loop_ctx {
+   struct mutex lock;                ///< Serializes writers sharing this file, protects everything below
+   const struct uart_codec *codec;   ///< The code the loop runs, see UART_IOC_SET_CODEC
+   struct rnd_state rnd;             ///< Random numbers of the error injection
+   u64 errorDebt;                    ///< Millionths of a bit error owed from previous chunks
+   u8 in[LOOP_CHUNK];                ///< Plaintext copied from userspace
+   u8 enc[3*LOOP_CHUNK+CODEC_MAX_BLOCK]; ///< The encoded chunk, damaged by the injection
+   u8 dec[LOOP_CHUNK+CODEC_MAX_BLOCK];   ///< What it decodes to
+};
+
+/** @brief What has gone round the loop since the last reset */
+struct loop_stats {
+   u64 bytes;                        ///< Plaintext bytes
+   u64 encodeNs;                     ///< Time spent encoding
+   u64 decodeNs;                     ///< Time spent decoding
+   u64 injected;                     ///< Bits flipped by the injection
+   u64 corrected;                    ///< Bits the codec put right
+   u64 uncorrected;                  ///< Bits that came out different from what went in
+   u64 uncorrectable;                ///< Blocks the codec saw damaged beyond repair
+};
+
+static int    majorNumber;                  ///< Stores the device number -- determined automatically
+static const struct uart_codec *defaultCodec; ///< The codec named by the codec parameter
+static struct loop_stats loopStats;         ///< Totals of all files
+static DEFINE_SPINLOCK(statsLock);          ///< Protects loopStats
+static struct class*  loopClass  = NULL;    ///< The device-driver class struct pointer
+static struct device* loopDevice = NULL;    ///< The device-driver device struct pointer
+
+
+// The prototype functions for the character driver -- must come before the struct definition
+static int     dev_open(struct inode *, struct file *);
+static int     dev_release(struct inode *, struct file *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static const struct attribute_group *loopGroups[];
+
+/** @brief Devices are represented as file structure in the kernel. The loop only takes writes;
+ *  what comes out of it is only looked at, not kept.
+ */
+static struct file_operations fops =
+{
+   .open = dev_open,
+   .write_iter = dev_write_iter,
+   .unlocked_ioctl = dev_ioctl,
+   .compat_ioctl = compat_ptr_ioctl,
+   .release = dev_release,
+};
+
+/** @brief The LKM initialization function
+ *  @return returns 0 if successful
+ */
+static int __init loopInit(void){
+   printk(KERN_INFO "Loop: Initializing the loopback module\n");
+
+   defaultCodec = codec_find(codec);
+   if (!defaultCodec){
+      printk(KERN_ALERT "Loop: unknown codec %s\n", codec);
+      return -EINVAL;
+   }
+
+   // Try to dynamically allocate a major number for the device -- more difficult but worth it
+   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+   if (majorNumber<0){
+      printk(KERN_ALERT "Loop failed to register a major number\n");
+      return majorNumber;
+   }
+
+   // Register the device class
+   loopClass = class_create(THIS_MODULE, CLASS_NAME);
+   if (IS_ERR(loopClass)){                  // Check for error and clean up if there is
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      printk(KERN_ALERT "Failed to register device class\n");
+      return PTR_ERR(loopClass);            // Correct way to return an error on a pointer
+   }
+
+   // Register the device driver, with its statistics in the stats directory
+   loopDevice = device_create_with_groups(loopClass, NULL, MKDEV(majorNumber, 0), NULL, loopGroups, DEVICE_NAME);
+   if (IS_ERR(loopDevice)){                 // Clean up if there is an error
+      class_destroy(loopClass);             // Repeated code but the alternative is goto statements
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      printk(KERN_ALERT "Failed to create the device\n");
+      return PTR_ERR(loopDevice);
+   }
+   printk(KERN_INFO "Loop: device created with major number %d\n", majorNumber);
+   return 0;                                // Made it! device was initialized
+}
+
+/** @brief The LKM cleanup function */
+static void __exit loopExit(void){
+   device_destroy(loopClass, MKDEV(majorNumber, 0));       // remove the device
+   class_unregister(loopClass);                            // unregister the device class
+   class_destroy(loopClass);                               // remove the device class
+   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   printk(KERN_INFO "Loop: Goodbye from the LKM!\n");
+}
+
+/** @brief Gives the new file its own buffers and random numbers
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int dev_open(struct inode *inodep, struct file *filep){
+   struct loop_ctx *ctx = kvzalloc(sizeof(*ctx), GFP_KERNEL);
+
+   if (!ctx)
+      return -ENOMEM;
+   mutex_init(&ctx->lock);
+   ctx->codec = defaultCodec;
+   prandom_seed_state(&ctx->rnd, get_random_u64());
+   filep->private_data = ctx;
+   return 0;
+}
+
+/** @brief Flips ber_ppm in a million of the n bytes' bits at random places. The fraction of an
+ *  error left over is carried to the next call, so low rates still come out right on average.
+ *  @return returns the number of bits flipped
+ */
+static unsigned int inject(struct loop_ctx *ctx, u8 *buf, size_t n){
+   u32 bits = 8*n;                   // n is at most sizeof(ctx->enc)
+   unsigned int k, errors;
+   u32 pos;
+
+   ctx->errorDebt += (u64)bits*READ_ONCE(ber_ppm);
+   errors = div_u64(ctx->errorDebt, 1000000);
+   ctx->errorDebt -= errors*1000000ULL;
+   for (k = 0; k < errors; k++){
+      pos = reciprocal_scale(prandom_u32_state(&ctx->rnd), bits);
+      buf[pos/8] ^= 1 << (pos%8);
+   }
+   return errors;
+}
+
+/** @brief Sends everything written round the loop in LOOP_CHUNK pieces and adds the results to
+ *  the statistics. The write always takes all its bytes.
+ *  @param iocb The request, iocb->ki_filp is the file
+ *  @param from The plaintext
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct loop_ctx *ctx = iocb->ki_filp->private_data;
+   struct loop_stats sum = {0};
+   struct codec_stats cs = {0};
+   const struct uart_codec *c;
+   size_t len = iov_iter_count(from);
+   size_t done = 0, chunk, encLen, k;
+   u64 t0, t1, t2;
+
+   if (mutex_lock_interruptible(&ctx->lock))
+      return -ERESTARTSYS;
+   c = ctx->codec;
+   while (done<len){
+      chunk = min(len-done, (size_t)LOOP_CHUNK/c->inBlock*c->inBlock);
+      chunk = min(chunk, (sizeof(ctx->enc)/c->outBlock)*c->inBlock);
+      if (copy_from_iter(ctx->in, chunk, from)!=chunk)
+         break;
+      t0 = ktime_get_ns();
+      encLen = codec_encode(c, ctx->enc, ctx->in, chunk);
+      t1 = ktime_get_ns();
+      sum.injected += inject(ctx, ctx->enc, encLen);
+      t2 = ktime_get_ns();
+      c->decode(ctx->dec, ctx->enc, encLen/c->outBlock, &cs);
+      sum.decodeNs += ktime_get_ns()-t2;
+      sum.encodeNs += t1-t0;
+      for (k = 0; k < chunk; k++)
+         sum.uncorrected += hweight8(ctx->dec[k] ^ ctx->in[k]);
+      done += chunk;
+      cond_resched();
+   }
+   mutex_unlock(&ctx->lock);
+   spin_lock(&statsLock);
+   loopStats.bytes += done;
+   loopStats.encodeNs += sum.encodeNs;
+   loopStats.decodeNs += sum.decodeNs;
+   loopStats.injected += sum.injected;
+   loopStats.corrected += cs.corrected;
+   loopStats.uncorrected += sum.uncorrected;
+   loopStats.uncorrectable += cs.disagree;
+   spin_unlock(&statsLock);
+   return done ? done : -EFAULT;
+}
+
+/** @brief Handles UART_IOC_SET_CODEC and UART_IOC_GET_CODEC, as on the other devices
+ *  @param filep A pointer to a file object
+ *  @param cmd The request
+ *  @param arg The request's argument, a user pointer
+ *  @return returns 0 if successful
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct loop_ctx *ctx = filep->private_data;
+   const struct uart_codec *c;
+   u32 id;
+
+   switch (cmd){
+   case UART_IOC_SET_CODEC:
+      if (get_user(id, (u32 __user *)arg))
+         return -EFAULT;
+      c = codec_get(id);
+      if (!c)
+         return -EINVAL;
+      if (mutex_lock_interruptible(&ctx->lock))
+         return -ERESTARTSYS;
+      WRITE_ONCE(ctx->codec, c);
+      mutex_unlock(&ctx->lock);
+      return 0;
+   case UART_IOC_GET_CODEC:
+      return put_user(READ_ONCE(ctx->codec)->id, (u32 __user *)arg);
+   default:
+      return -ENOTTY;
+   }
+}
+
+/** @brief Frees the file's state
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int dev_release(struct inode *inodep, struct file *filep){
+   kvfree(filep->private_data);
+   return 0;
+}
+
+/** @brief Takes a consistent copy of the statistics */
+static void statsRead(struct loop_stats *sum){
+   spin_lock(&statsLock);
+   *sum = loopStats;
+   spin_unlock(&statsLock);
+}
+
+/** @brief Defines a read-only attribute showing one field of the statistics */
+#define LOOP_STAT(name, field)                                                                    \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf){         \
+   struct loop_stats sum;                                                                         \
+                                                                                                  \
+   statsRead(&sum);                                                                               \
+   return sysfs_emit(buf, "%llu\n", sum.field);                                                   \
+}                                                                                                 \
+static DEVICE_ATTR_RO(name)
+
+LOOP_STAT(bytes, bytes);
+LOOP_STAT(encode_ns, encodeNs);
+LOOP_STAT(decode_ns, decodeNs);
+LOOP_STAT(bits_injected, injected);
+LOOP_STAT(bits_corrected, corrected);
+LOOP_STAT(bits_uncorrected, uncorrected);
+LOOP_STAT(blocks_uncorrectable, uncorrectable);
+
+/** @brief Shows the plaintext bytes per second the codec gets through, encoding and decoding
+ *  together, counting only the time spent in it
+ */
+static ssize_t throughput_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct loop_stats sum;
+   u64 ns;
+
+   statsRead(&sum);
+   ns = sum.encodeNs + sum.decodeNs;
+   return sysfs_emit(buf, "%llu\n", ns ? mul_u64_u64_div_u64(sum.bytes, NSEC_PER_SEC, ns) : 0);
+}
+static DEVICE_ATTR_RO(throughput);
+
+/** @brief Clears the statistics when anything is written */
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   spin_lock(&statsLock);
+   memset(&loopStats, 0, sizeof(loopStats));
+   spin_unlock(&statsLock);
+   return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *statsAttrs[] = {
+   &dev_attr_bytes.attr,
+   &dev_attr_encode_ns.attr,
+   &dev_attr_decode_ns.attr,
+   &dev_attr_bits_injected.attr,
+   &dev_attr_bits_corrected.attr,
+   &dev_attr_bits_uncorrected.attr,
+   &dev_attr_blocks_uncorrectable.attr,
+   &dev_attr_throughput.attr,
+   &dev_attr_reset.attr,
+   NULL,
+};
+
+static const struct attribute_group statsGroup = {
+   .name = "stats",                  // /sys/class/uloop/UARTloop/stats/
+   .attrs = statsAttrs,
+};
+
+static const struct attribute_group *loopGroups[] = {
+   &statsGroup,
+   NULL,
+};
+
+/** @brief A module must use the module_init() module_exit() macros from linux/init.h, which
+ *  identify the initialization function at insertion time and the cleanup function (as
+ *  listed above)
+ */
+module_init(loopInit);
+module_exit(loopExit);